@@ -1,4 +1,9 @@
 #include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/zookeeper/zookeeper_utils.hpp"
+#include <algorithm>
+#include <deque>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 namespace bolt {
 using namespace ::folly;
@@ -23,13 +28,60 @@ static void dataCompletionCb(int rc,
                              const struct Stat *stat,
                              const void *data);
 
-static std::shared_ptr<Promise<ZKResult>> promiseFromData(const void *data) {
-  const Promise<ZKResult> *constPromise =
-    static_cast<const Promise<ZKResult> *>(data);
+// the read's result, unless the sync before it failed
+static Future<ZKResult> afterSync(Future<ZKResult> synced,
+                                  Future<ZKResult> read) {
+  return collectAll(synced, read)
+    .then([](std::tuple<Try<ZKResult>, Try<ZKResult>> &&t) {
+      auto &s = std::get<0>(t);
+      auto &r = std::get<1>(t);
+      // a read we can't tell is linearizable is not returned as one
+      if(r.hasValue() && r.value().result == ZOK) {
+        s.throwIfFailed();
+        if(s.value().result != ZOK) {
+          return ZKResult(s.value().result);
+        }
+      }
+      return std::move(r.value());
+    });
+}
+
+template <class R = ZKResult>
+static std::shared_ptr<Promise<R>> promiseFromData(const void *data) {
+  const Promise<R> *constPromise = static_cast<const Promise<R> *>(data);
+
+  Promise<R> *promise = const_cast<Promise<R> *>(constPromise);
 
-  Promise<ZKResult> *promise = const_cast<Promise<ZKResult> *>(constPromise);
+  return std::shared_ptr<Promise<R>>(promise);
+}
+
+// Completions of the *Compact() calls: R is built right from the
+// completion's arguments, see the constructors of the ZK*Result types.
+template <class R>
+static void compactStatCb(int rc, const struct Stat *stat, const void *data) {
+  promiseFromData<R>(data)->setValue(R(rc, stat));
+}
+
+template <class R>
+static void compactDataCb(int rc,
+                          const char *value,
+                          int value_len,
+                          const struct Stat *stat,
+                          const void *data) {
+  promiseFromData<R>(data)->setValue(R(rc, value, value_len, stat));
+}
+
+template <class R>
+static void compactStringsCb(int rc,
+                             const struct String_vector *strs,
+                             const struct Stat *stat,
+                             const void *data) {
+  promiseFromData<R>(data)->setValue(R(rc, strs, stat));
+}
 
-  return std::shared_ptr<Promise<ZKResult>>(promise);
+template <class R>
+static void compactStringCb(int rc, const char *value, const void *data) {
+  promiseFromData<R>(data)->setValue(R(rc, value));
 }
 
 // copy from stout / modified w/ __builtin_unreachable()
@@ -77,74 +129,457 @@ void ZKClient::init(bool block) {
   CHECK(zoo_ == nullptr) << "Doubly initializing zookeeper";
   CHECK(!hosts_.empty()) << "Passed in an invalid host string";
 
-  rawInitHandle(this);
+  debouncer_ = std::make_unique<ZKWatchDebouncer>(
+    [this](int type, int state, const std::string &path) {
+      watch_(type, state, path, this);
+    });
+
+  rawInitHandle(this, block);
+  recoveryThread_ = std::thread([this] { recoveryLoop(); });
 
   LOG(INFO) << "Zookeeper initialized. State: " << getState()
             << ", session id: " << getSessionId();
 }
 
 void ZKClient::destroy() {
-  if(!zoo_) {
-    return;
+  {
+    std::lock_guard<std::mutex> lock(recoveryMutex_);
+    closing_ = true;
+    recoveryCv_.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(probeMutex_);
+    probeCv_.notify_all();
+  }
+  std::vector<Promise<Unit>> waiting;
+  {
+    std::lock_guard<std::mutex> lock(readyMutex_);
+    readyCv_.notify_all();
+    waiting.swap(connectedPromises_);
+  }
+  for(auto &p : waiting) {
+    p.setException(std::runtime_error("Closing"));
+  }
+  if(recoveryThread_.joinable()) {
+    recoveryThread_.join();
   }
-  int ret = zookeeper_close(zoo_);
-  if(ret != ZOK) {
-    LOG(ERROR) << "Failed to cleanup ZooKeeper, zookeeper_close: "
-               << zerror(ret);
+  if(probeThread_.joinable()) {
+    probeThread_.join();
   }
-  zoo_ = nullptr;
+  zhandle_t *zh;
+  {
+    std::unique_lock<folly::SharedMutex> lock(zooLock_);
+    zh = zoo_;
+    zoo_ = nullptr;
+  }
+  if(zh) {
+    int ret = zookeeper_close(zh);
+    if(ret != ZOK) {
+      LOG(ERROR) << "Failed to cleanup ZooKeeper, zookeeper_close: "
+                 << zerror(ret);
+    }
+    releasePathWatches(zh);
+  }
+  // no more events coming in, stop delivering the delayed ones
+  debouncer_ = nullptr;
 }
 
 ZKClient::~ZKClient() { destroy(); }
 
-void ZKClient::rawInitHandle(ZKClient *cli) {
-  std::lock_guard<std::mutex>(cli->rawInitMutex_);
-  if(cli->zoo_ && cli->getState() != ZOO_EXPIRED_SESSION_STATE) {
-    return;
-  }
-  if(cli->zoo_) {
-    // This is due to server connection failure. give it a second.
-    // On local host testing, this is due to the zookeepr process is out of heap
-    // and is doing a major GC compaction. So its useless to try and reconnect
-    std::this_thread::sleep_for(std::chrono::seconds(1));
-  }
-  cli->ready = false;
-  // Idea taken from Zookeper/zookeeper.cpp in mesos
-  // We retry zookeeper_init until the timeout elapses because we've
-  // seen cases where temporary DNS outages cause the slave to abort
-  // here. See MESOS-1326 for more information.
-  // ZooKeeper masks EAI_AGAIN as EINVAL and a name resolution timeout
-  // may be upwards of 30 seconds. As such, a 10 second timeout is not
-  // enough. Hard code this to 10 minutes to be sure we're trying again
-  // in the face of temporary name resolution failures. See MESOS-1523
-  // for more information.
-  int maxInitTries = 600;
-  while(maxInitTries-- > 0) {
-    cli->zoo_ = zookeeper_init(cli->hosts().c_str(), &watchCb, cli->timeout(),
-                               cli->getClientId(), (void *)cli, cli->flags());
-    // Unfortunately, EINVAL is highly overloaded in zookeeper_init
-    // and can correspond to:
-    //   (1) Empty / invalid 'host' string format.
-    //   (2) Any getaddrinfo error other than EAI_NONAME,
-    //       EAI_NODATA, and EAI_MEMORY are mapped to EINVAL.
-    // Either way, retrying is not problematic.
-    if(cli->zoo_ == nullptr && errno == EINVAL) {
-      LOG(ERROR) << "Error initializing zookeeper. Retrying in 1 second";
-      std::this_thread::sleep_for(std::chrono::seconds(1));
+Future<Unit> ZKClient::connected() {
+  std::lock_guard<std::mutex> lock(readyMutex_);
+  if(ready) {
+    return makeFuture();
+  }
+  if(closing_) {
+    return makeFuture<Unit>(std::runtime_error("Closing"));
+  }
+  connectedPromises_.emplace_back();
+  return connectedPromises_.back().getFuture();
+}
+
+void ZKClient::markConnected() {
+  std::vector<Promise<Unit>> waiting;
+  {
+    std::lock_guard<std::mutex> lock(readyMutex_);
+    ready = true;
+    readyCv_.notify_all();
+    waiting.swap(connectedPromises_);
+  }
+  for(auto &p : waiting) {
+    p.setValue();
+  }
+}
+
+void ZKClient::scheduleRecovery() {
+  std::lock_guard<std::mutex> lock(recoveryMutex_);
+  recoveryPending_ = true;
+  recoveryCv_.notify_one();
+}
+
+void ZKClient::recoveryLoop() {
+  for(;;) {
+    {
+      std::unique_lock<std::mutex> lock(recoveryMutex_);
+      recoveryCv_.wait(lock, [this] { return recoveryPending_ || closing_; });
+      if(closing_) {
+        return;
+      }
+      recoveryPending_ = false;
+    }
+    // no-op if a *Sync retry loop already replaced the session
+    rawInitHandle(this);
+  }
+}
+
+void ZKClient::rawInitHandle(ZKClient *cli, bool wait) {
+  zhandle_t *expired = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(cli->rawInitMutex_);
+    if(cli->zoo_ && cli->getState() != ZOO_EXPIRED_SESSION_STATE) {
+      return;
+    }
+    // The ensemble already told us the session is gone, so there is nothing
+    // to wait out: open a fresh session right away and replay our state on
+    // it below. The expired handle is closed outside of the locks, its
+    // completion thread may be blocked on us in a *Sync call or waiting
+    // for zooLock_. zoo_ only changes under rawInitMutex_, we can read it.
+    expired = cli->zoo_;
+    cli->ready = false;
+    // Idea taken from Zookeper/zookeeper.cpp in mesos
+    // We retry zookeeper_init until the timeout elapses because we've
+    // seen cases where temporary DNS outages cause the slave to abort
+    // here. See MESOS-1326 for more information.
+    // ZooKeeper masks EAI_AGAIN as EINVAL and a name resolution timeout
+    // may be upwards of 30 seconds. As such, a 10 second timeout is not
+    // enough. Hard code this to 10 minutes to be sure we're trying again
+    // in the face of temporary name resolution failures. See MESOS-1523
+    // for more information.
+    int maxInitTries = 600;
+    const clientid_t *clientId = cli->getClientId();
+    zhandle_t *fresh = nullptr;
+    while(maxInitTries-- > 0) {
+      int err;
+      {
+        // Held over the init: a caller that sees the new session
+        // connected must not get the expired handle.
+        std::unique_lock<folly::SharedMutex> swap(cli->zooLock_);
+        fresh = zookeeper_init(cli->hosts().c_str(), &watchCb, cli->timeout(),
+                               clientId, (void *)cli, cli->flags());
+        err = errno;
+        if(fresh) {
+          cli->zoo_ = fresh;
+        }
+      }
+      // Unfortunately, EINVAL is highly overloaded in zookeeper_init
+      // and can correspond to:
+      //   (1) Empty / invalid 'host' string format.
+      //   (2) Any getaddrinfo error other than EAI_NONAME,
+      //       EAI_NODATA, and EAI_MEMORY are mapped to EINVAL.
+      // Either way, retrying is not problematic.
+      if(fresh == nullptr && err == EINVAL && !cli->closing_) {
+        LOG(ERROR) << "Error initializing zookeeper. Retrying in 1 second";
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        continue;
+      }
+
+      break;
+    }
+
+    if(fresh == NULL) {
+      PLOG(FATAL) << "Failed to create ZooKeeper, zookeeper_init";
+    }
+
+    CHECK(fresh) << "Failed to initialize zookeeper";
+
+    if(wait) {
+      std::unique_lock<std::mutex> ready(cli->readyMutex_);
+      cli->readyCv_.wait(ready,
+                         [cli] { return cli->ready || cli->closing_; });
+    }
+  }
+
+  if(expired) {
+    int ret = zookeeper_close(expired);
+    if(ret != ZOK) {
+      LOG(ERROR) << "Failed to cleanup expired session, zookeeper_close: "
+                 << zerror(ret);
+    }
+    cli->releasePathWatches(expired);
+    if(!cli->closing_) {
+      cli->notifySessionRecovered(cli->restoreSession());
+    }
+  }
+}
+
+uint64_t ZKClient::addSessionRecoveredCb(ZKSessionRecoveredCb cb) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  recoveredCbs_.emplace(nextRecoveredCbId_, std::move(cb));
+  return nextRecoveredCbId_++;
+}
+
+void ZKClient::removeSessionRecoveredCb(uint64_t id) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  recoveredCbs_.erase(id);
+}
+
+void ZKClient::trackEphemeral(const std::string &path,
+                              const std::string &requestedPath,
+                              std::shared_ptr<folly::IOBuf> data,
+                              ACL_vector *acl,
+                              int flags) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  ephemerals_[path] = TrackedEphemeral{requestedPath, std::move(data), acl,
+                                       flags};
+}
+
+void ZKClient::untrackEphemeral(const std::string &path) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  ephemerals_.erase(path);
+}
+
+bool ZKClient::isTrackedEphemeral(const std::string &path) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  return ephemerals_.count(path) > 0;
+}
+
+bool ZKClient::trackWatch(WatchKind kind, const std::string &path) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  return watches_.emplace(kind, path).second;
+}
+
+void ZKClient::untrackWatch(WatchKind kind, const std::string &path) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  watches_.erase(std::make_pair(kind, path));
+}
+
+uint64_t ZKClient::addSessionListener(ZKWatchCb cb) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  sessionListeners_.emplace(nextSessionListenerId_, std::move(cb));
+  return nextSessionListenerId_++;
+}
+
+void ZKClient::removeSessionListener(uint64_t id) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  sessionListeners_.erase(id);
+}
+
+void ZKClient::sessionEvent(int state) {
+  health_.sessionEvent(state);
+  std::vector<ZKWatchCb> cbs;
+  {
+    std::lock_guard<std::mutex> lock(trackMutex_);
+    for(auto &cb : sessionListeners_) {
+      cbs.push_back(cb.second);
+    }
+  }
+  for(auto &cb : cbs) {
+    cb(ZOO_SESSION_EVENT, state, "", this);
+  }
+}
+
+ZKHealthSnapshot ZKClient::health() {
+  auto ret = health_.snapshot();
+  if(!ready) {
+    return ret;
+  }
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  auto connected = withHandle([&addr, &len](zhandle_t *zh) {
+    return zh && zookeeper_get_connected_host(zh, (struct sockaddr *)&addr,
+                                              &len) != nullptr;
+  });
+  if(!connected) {
+    return ret;
+  }
+  char host[INET6_ADDRSTRLEN] = {0};
+  if(addr.ss_family == AF_INET) {
+    auto in = (struct sockaddr_in *)&addr;
+    inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+    ret.server = std::string(host) + ":" + std::to_string(ntohs(in->sin_port));
+  } else if(addr.ss_family == AF_INET6) {
+    auto in6 = (struct sockaddr_in6 *)&addr;
+    inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+    ret.server =
+      "[" + std::string(host) + "]:" + std::to_string(ntohs(in6->sin6_port));
+  }
+  return ret;
+}
+
+void ZKClient::startHealthProbes(std::chrono::milliseconds interval) {
+  CHECK(!probeThread_.joinable()) << "Health probes already running";
+  probeThread_ = std::thread([this, interval] { probeLoop(interval); });
+}
+
+void ZKClient::probeLoop(std::chrono::milliseconds interval) {
+  auto inFlight = std::make_shared<std::atomic<bool>>(false);
+  for(;;) {
+    {
+      std::unique_lock<std::mutex> lock(probeMutex_);
+      if(probeCv_.wait_for(lock, interval,
+                           [this] { return closing_.load(); })) {
+        break;
+      }
+    }
+    if(!ready || inFlight->exchange(true)) {
       continue;
     }
+    const auto start = ZKSessionHealth::Clock::now();
+    exists("/").then([this, start, inFlight](Try<ZKResult> &&t) {
+      health_.probed(std::chrono::duration_cast<std::chrono::microseconds>(
+                       ZKSessionHealth::Clock::now() - start),
+                     t.hasValue() && t.value().result == ZOK);
+      *inFlight = false;
+    });
+  }
+  // outstanding probes complete with ZCLOSING before the client goes away
+}
+
+void ZKClient::setWatchDebounce(const std::string &pathPrefix,
+                                ZKDebounce debounce) {
+  debouncer_->setRule(pathPrefix, debounce);
+}
 
-    break;
+std::map<std::string, ZKDebounceStats> ZKClient::watchDebounceStats() {
+  return debouncer_->stats();
+}
+
+bool ZKClient::debounced(int type, int state, const std::string &path) {
+  return debouncer_ && debouncer_->offer(type, state, path);
+}
+
+void ZKClient::untrackFiredWatch(int type, const std::string &path) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  if(type == ZOO_CREATED_EVENT || type == ZOO_CHANGED_EVENT
+     || type == ZOO_DELETED_EVENT) {
+    watches_.erase(std::make_pair(kDataWatch, path));
+    watches_.erase(std::make_pair(kExistsWatch, path));
+  }
+  if(type == ZOO_CHILD_EVENT || type == ZOO_DELETED_EVENT) {
+    watches_.erase(std::make_pair(kChildWatch, path));
   }
+  if(type == ZOO_DELETED_EVENT) {
+    ephemerals_.erase(path);
+  }
+}
 
-  if(cli->zoo_ == NULL) {
-    PLOG(FATAL) << "Failed to create ZooKeeper, zookeeper_init";
+void ZKClient::pathWatchCb(
+  zhandle_t *zh, int type, int state, const char *cpath, void *ctx) {
+  auto w = static_cast<PathWatch *>(ctx);
+  auto cli = w->cli;
+  auto id = w->id;
+  w->cb(type, state, std::string(cpath == nullptr ? "" : cpath), cli);
+  if(type != ZOO_SESSION_EVENT) {
+    cli->releasePathWatch(id);
   }
+}
+
+ZKClient::PathWatch *ZKClient::addPathWatch(zhandle_t *zh, ZKWatchCb cb) {
+  std::lock_guard<std::mutex> lock(trackMutex_);
+  auto id = nextPathWatchId_++;
+  auto &w = pathWatches_[id];
+  w.reset(new PathWatch{this, zh, id, std::move(cb)});
+  return w.get();
+}
 
-  CHECK(cli->zoo_) << "Failed to initialize zookeeper";
+void ZKClient::releasePathWatch(uint64_t id) {
+  std::unique_ptr<PathWatch> w;
+  {
+    std::lock_guard<std::mutex> lock(trackMutex_);
+    auto it = pathWatches_.find(id);
+    if(it == pathWatches_.end()) {
+      return;
+    }
+    w = std::move(it->second);
+    pathWatches_.erase(it);
+  }
+}
 
-  while(!cli->ready) {
-    std::this_thread::yield();
+void ZKClient::releasePathWatches(zhandle_t *zh) {
+  // the handle is closed, nothing can fire anymore
+  std::vector<std::unique_ptr<PathWatch>> released;
+  {
+    std::lock_guard<std::mutex> lock(trackMutex_);
+    for(auto it = pathWatches_.begin(); it != pathWatches_.end();) {
+      if(it->second->zh == zh) {
+        released.push_back(std::move(it->second));
+        it = pathWatches_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+Future<ZKResult>
+ZKClient::releaseUnarmed(Future<ZKResult> f, uint64_t id, bool existsWatch) {
+  return f.then([this, id, existsWatch](Try<ZKResult> &&t) {
+    auto rc = t.hasValue() ? t.value().result : ZSYSTEMERROR;
+    if(!(rc == ZOK || (existsWatch && rc == ZNONODE))) {
+      releasePathWatch(id);
+    }
+    return makeFuture(std::move(t));
+  });
+}
+
+std::map<std::string, std::string> ZKClient::restoreSession() {
+  std::map<std::string, TrackedEphemeral> ephemerals;
+  std::set<std::pair<WatchKind, std::string>> watches;
+  {
+    std::lock_guard<std::mutex> lock(trackMutex_);
+    ephemerals.swap(ephemerals_);
+    watches.swap(watches_);
+  }
+  LOG(INFO) << "Restoring " << ephemerals.size() << " ephemerals and "
+            << watches.size() << " watches on session: " << getSessionId();
+
+  // Issue everything back to back and only then wait. The calls below
+  // track their nodes/watches again as they complete.
+  std::vector<std::string> oldPaths;
+  std::vector<Future<ZKResult>> creates;
+  for(auto &e : ephemerals) {
+    oldPaths.push_back(e.first);
+    creates.push_back(create(e.second.requestedPath, e.second.data->clone(),
+                             e.second.acl, e.second.flags));
+  }
+  std::vector<Future<ZKResult>> rearms;
+  for(auto &w : watches) {
+    if(w.first == kChildWatch) {
+      rearms.push_back(children(w.second, true));
+    } else {
+      // exists() leaves a watch even if the node went away with the session
+      rearms.push_back(exists(w.second, true));
+    }
+  }
+
+  std::map<std::string, std::string> renamed;
+  auto created = collectAll(creates.begin(), creates.end()).get();
+  for(auto i = 0u; i < created.size(); ++i) {
+    auto &t = created[i];
+    if(t.hasValue() && t.value().result == ZOK && t.value().buff) {
+      renamed[oldPaths[i]] = std::string((const char *)t.value().data(),
+                                         t.value().buff->length());
+    } else {
+      LOG(ERROR) << "Could not restore ephemeral: " << oldPaths[i] << ", ret: "
+                 << (t.hasValue() ? t.value().result : ZSYSTEMERROR);
+      renamed[oldPaths[i]] = "";
+    }
+  }
+  collectAll(rearms.begin(), rearms.end()).wait();
+  return renamed;
+}
+
+void ZKClient::notifySessionRecovered(
+  const std::map<std::string, std::string> &renamed) {
+  std::vector<ZKSessionRecoveredCb> cbs;
+  {
+    std::lock_guard<std::mutex> lock(trackMutex_);
+    for(auto &cb : recoveredCbs_) {
+      cbs.push_back(cb.second);
+    }
+  }
+  for(auto &cb : cbs) {
+    cb(this, renamed);
   }
 }
 
@@ -157,12 +592,19 @@ watchCb(zhandle_t *zh, int type, int state, const char *cpath, void *ctx) {
   if(type == ZOO_SESSION_EVENT) {
     if(state == ZOO_CONNECTED_STATE) {
       LOG(INFO) << "Zookeeper connected...";
-      self->ready = true;
+      self->markConnected();
     } else if(state == ZOO_ASSOCIATING_STATE) {
       LOG(ERROR) << "Zookeeper associating...";
     } else if(state == ZOO_EXPIRED_SESSION_STATE) {
       LOG(ERROR) << "Zookeeper session expired. ZOO_EXPIRED_SESSION_STATE. "
                     "Attempting to retry session stablishment";
+      self->scheduleRecovery();
+    }
+    self->sessionEvent(state);
+  } else if(cpath != nullptr) {
+    self->untrackFiredWatch(type, cpath);
+    if(self->debounced(type, state, cpath)) {
+      return;
     }
   }
   self->watch_(type, state, std::string(cpath == nullptr ? "" : cpath), self);
@@ -259,38 +701,69 @@ statCompletionCb(int rc, const struct Stat *stat, const void *data) {
   promise->setValue(std::move(result));
 }
 
-Future<ZKResult> ZKClient::get(std::string path, bool watch) {
+Future<ZKResult>
+ZKClient::get(std::string path, bool watch, ZKConsistency consistency) {
+  if(consistency == ZKConsistency::kLinearizable) {
+    // issued back to back, the session's FIFO order does the rest
+    auto synced = sync(path);
+    return afterSync(std::move(synced), get(path, watch));
+  }
   Promise<ZKResult> *promise = new Promise<ZKResult>;
+  auto f = promise->getFuture();
 
   if(!ready) {
     promise->setException(std::runtime_error("Not connected"));
-  } else {
-    zoo_aget(zoo_, path.c_str(), watch ? 1 : 0, &dataCompletionCb,
-             static_cast<void *>(promise));
+    delete promise;
+    return f;
   }
-
-  return promise->getFuture();
+  // a call refused here gets no completion, and sets no watch
+  const bool tracked = watch && trackWatch(kDataWatch, path);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_aget(zoo_, path.c_str(), watch ? 1 : 0, &dataCompletionCb,
+                  static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    if(tracked) {
+      untrackWatch(kDataWatch, path);
+    }
+    promiseFromData(promise)->setValue(ZKResult(rc));
+  }
+  return f;
 }
 
 const clientid_t *ZKClient::getClientId() {
-  if(!zoo_ || getState() == ZSESSIONEXPIRED) {
-    return nullptr;
-  }
-  return zoo_client_id(zoo_);
+  return withHandle([](zhandle_t *zh) -> const clientid_t * {
+    if(!zh || zoo_state(zh) == ZOO_EXPIRED_SESSION_STATE) {
+      return nullptr;
+    }
+    return zoo_client_id(zh);
+  });
 }
 
 
 ZKResult ZKClient::getSync(std::string path, bool watch) {
+  if(watch) {
+    trackWatch(kDataWatch, path);
+  }
   struct Stat stat;
   int bufLen = 1 << 20; // 1MB is max for zookeeper
   std::unique_ptr<char[]> buf(new char[bufLen]());
-  int rc =
-    zoo_get(zoo_, path.c_str(), watch ? 1 : 0, buf.get(), &bufLen, &stat);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_get(zoo_, path.c_str(), watch ? 1 : 0, buf.get(), &bufLen, &stat);
+  }
   int maxTries = kMaxTriesPerSyncOperation;
   while(maxTries-- > 0 && (rc == ZINVALIDSTATE || retryable(rc))) {
     CHECK(getState() != ZOO_AUTH_FAILED_STATE);
     ZKClient::rawInitHandle(this);
-    rc = zoo_get(zoo_, path.c_str(), watch ? 1 : 0, buf.get(), &bufLen, &stat);
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      rc = zoo_get(zoo_, path.c_str(), watch ? 1 : 0, buf.get(), &bufLen,
+                   &stat);
+    }
   }
 
   if(rc != ZOK) {
@@ -310,8 +783,11 @@ Future<ZKResult> ZKClient::set(std::string path,
   if(!ready) {
     promise->setException(std::runtime_error("Not connected"));
   } else {
-    zoo_aset(zoo_, path.c_str(), (char *)val->data(), val->length(), version,
-             &statCompletionCb, static_cast<void *>(promise));
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      zoo_aset(zoo_, path.c_str(), (char *)val->data(), val->length(), version,
+               &statCompletionCb, static_cast<void *>(promise));
+    }
   }
 
   return promise->getFuture();
@@ -322,46 +798,80 @@ ZKResult ZKClient::setSync(std::string path,
                            int version) {
 
   struct Stat stat;
-  int rc = zoo_set2(zoo_, path.c_str(), (const char *)val->data(),
-                    val->length(), version, &stat);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_set2(zoo_, path.c_str(), (const char *)val->data(),
+                  val->length(), version, &stat);
+  }
   int maxTries = kMaxTriesPerSyncOperation;
   while(maxTries-- > 0 && (rc == ZINVALIDSTATE || retryable(rc))) {
     CHECK(getState() != ZOO_AUTH_FAILED_STATE);
     ZKClient::rawInitHandle(this);
-    rc = zoo_set2(zoo_, path.c_str(), (const char *)val->data(), val->length(),
-                  version, &stat);
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      rc = zoo_set2(zoo_, path.c_str(), (const char *)val->data(),
+                    val->length(), version, &stat);
+    }
   }
   struct ZKResult result(rc, stat);
   return result;
 }
 
-Future<ZKResult> ZKClient::children(std::string path, bool watch) {
+Future<ZKResult>
+ZKClient::children(std::string path, bool watch, ZKConsistency consistency) {
+  if(consistency == ZKConsistency::kLinearizable) {
+    auto synced = sync(path);
+    return afterSync(std::move(synced), children(path, watch));
+  }
   Promise<ZKResult> *promise = new Promise<ZKResult>;
+  auto f = promise->getFuture();
 
   if(!ready) {
     promise->setException(std::runtime_error("Not connected"));
-  } else {
-    // zoo_aget_children2(zhandle_t *zh, const char *path, int watch,
-    //    strings_stat_completion_t completion, const void *data);
-    zoo_aget_children2(zoo_, path.c_str(), watch ? 1 : 0,
-                       stringsAndStatCompletionCb,
-                       static_cast<void *>(promise));
+    delete promise;
+    return f;
   }
-
-  return promise->getFuture();
+  const bool tracked = watch && trackWatch(kChildWatch, path);
+  // zoo_aget_children2(zhandle_t *zh, const char *path, int watch,
+  //    strings_stat_completion_t completion, const void *data);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_aget_children2(zoo_, path.c_str(), watch ? 1 : 0,
+                            stringsAndStatCompletionCb,
+                            static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    if(tracked) {
+      untrackWatch(kChildWatch, path);
+    }
+    promiseFromData(promise)->setValue(ZKResult(rc));
+  }
+  return f;
 }
 ZKResult ZKClient::childrenSync(std::string path, bool watch) {
+  if(watch) {
+    trackWatch(kChildWatch, path);
+  }
 
   struct String_vector strs {
     0, nullptr
   }; //  = nullptr;
   struct Stat stat;
-  int rc = zoo_get_children(zoo_, path.c_str(), watch ? 1 : 0, &strs);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_get_children(zoo_, path.c_str(), watch ? 1 : 0, &strs);
+  }
   int maxTries = kMaxTriesPerSyncOperation;
   while(maxTries-- > 0 && (rc == ZINVALIDSTATE || retryable(rc))) {
     CHECK(getState() != ZOO_AUTH_FAILED_STATE);
     ZKClient::rawInitHandle(this);
-    rc = zoo_get_children(zoo_, path.c_str(), watch ? 1 : 0, &strs);
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      rc = zoo_get_children(zoo_, path.c_str(), watch ? 1 : 0, &strs);
+    }
   }
   struct ZKResult result(rc, stat);
   for(auto i = 0; strs.data && i < strs.count; ++i) {
@@ -373,28 +883,55 @@ ZKResult ZKClient::childrenSync(std::string path, bool watch) {
   return result;
 }
 
-Future<ZKResult> ZKClient::exists(std::string path, bool watch) {
+Future<ZKResult>
+ZKClient::exists(std::string path, bool watch, ZKConsistency consistency) {
+  if(consistency == ZKConsistency::kLinearizable) {
+    auto synced = sync(path);
+    return afterSync(std::move(synced), exists(path, watch));
+  }
   Promise<ZKResult> *p = new Promise<ZKResult>;
+  auto f = p->getFuture();
 
   if(!ready) {
     p->setException(std::runtime_error("Not connected"));
-  } else {
-    zoo_aexists(zoo_, path.c_str(), watch ? 1 : 0, &statCompletionCb,
-                static_cast<void *>(p));
+    delete p;
+    return f;
   }
-
-  return p->getFuture();
+  const bool tracked = watch && trackWatch(kExistsWatch, path);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_aexists(zoo_, path.c_str(), watch ? 1 : 0, &statCompletionCb,
+                     static_cast<void *>(p));
+  }
+  if(rc != ZOK) {
+    if(tracked) {
+      untrackWatch(kExistsWatch, path);
+    }
+    promiseFromData(p)->setValue(ZKResult(rc));
+  }
+  return f;
 }
 
 ZKResult ZKClient::existsSync(std::string path, bool watch) {
+  if(watch) {
+    trackWatch(kExistsWatch, path);
+  }
 
   struct Stat stat;
-  int rc = zoo_exists(zoo_, path.c_str(), watch ? 1 : 0, &stat);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_exists(zoo_, path.c_str(), watch ? 1 : 0, &stat);
+  }
   int maxTries = kMaxTriesPerSyncOperation;
   while(maxTries-- > 0 && (rc == ZINVALIDSTATE || retryable(rc))) {
     CHECK(getState() != ZOO_AUTH_FAILED_STATE);
     ZKClient::rawInitHandle(this);
-    rc = zoo_exists(zoo_, path.c_str(), watch ? 1 : 0, &stat);
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      rc = zoo_exists(zoo_, path.c_str(), watch ? 1 : 0, &stat);
+    }
   }
   struct ZKResult result(rc, stat);
   return result;
@@ -422,11 +959,24 @@ Future<ZKResult> ZKClient::create(std::string path,
   if(!ready) {
     p->setException(std::runtime_error("Not connected"));
   } else {
-    zoo_acreate(zoo_, path.c_str(), (char *)val->data(), val->length(), acl,
-                flags, &stringCompletionCb, static_cast<void *>(p));
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      zoo_acreate(zoo_, path.c_str(), (char *)val->data(), val->length(), acl,
+                  flags, &stringCompletionCb, static_cast<void *>(p));
+    }
   }
 
-  return p->getFuture();
+  if(!(flags & ZOO_EPHEMERAL)) {
+    return p->getFuture();
+  }
+  std::shared_ptr<folly::IOBuf> data(val->clone());
+  return p->getFuture().then([this, path, data, acl, flags](ZKResult &&r) {
+    if(r.result == ZOK && r.buff) {
+      trackEphemeral(std::string((const char *)r.data(), r.buff->length()),
+                     path, data, acl, flags);
+    }
+    return std::move(r);
+  });
 }
 
 ZKResult ZKClient::createSync(std::string path,
@@ -435,20 +985,34 @@ ZKResult ZKClient::createSync(std::string path,
                               int flags) {
 
   std::unique_ptr<char[]> pathBuf(new char[1024]());
-  int rc = zoo_create(zoo_, path.c_str(), (const char *)val->data(),
-                      val->length(), acl, flags, pathBuf.get(), 1024);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_create(zoo_, path.c_str(), (const char *)val->data(),
+                    val->length(), acl, flags, pathBuf.get(), 1024);
+  }
   int maxTries = kMaxTriesPerSyncOperation;
   while(maxTries-- > 0 && (rc == ZINVALIDSTATE || retryable(rc))) {
     CHECK(getState() != ZOO_AUTH_FAILED_STATE);
     ZKClient::rawInitHandle(this);
-    rc = zoo_create(zoo_, path.c_str(), (const char *)val->data(),
-                    val->length(), acl, flags, pathBuf.get(), 1024);
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      rc = zoo_create(zoo_, path.c_str(), (const char *)val->data(),
+                      val->length(), acl, flags, pathBuf.get(), 1024);
+    }
   }
 
-  struct ZKResult result(
-    rc, boost::none,
-    folly::IOBuf::copyBuffer(pathBuf.get(),
-                             std::char_traits<char>::length(pathBuf.get())));
+  // the created path, only if there is one
+  struct ZKResult result(rc);
+  if(rc == ZOK) {
+    result.buff = folly::IOBuf::copyBuffer(
+      pathBuf.get(), std::char_traits<char>::length(pathBuf.get()));
+  }
+
+  if(rc == ZOK && (flags & ZOO_EPHEMERAL)) {
+    trackEphemeral(pathBuf.get(), path,
+                   std::shared_ptr<folly::IOBuf>(val->clone()), acl, flags);
+  }
 
   return result;
 }
@@ -467,23 +1031,640 @@ Future<ZKResult> ZKClient::del(std::string path, int version) {
   if(!ready) {
     p->setException(std::runtime_error("Not connected"));
   } else {
-    zoo_adelete(zoo_, path.c_str(), version, &voidCompletionCb,
-                static_cast<void *>(p));
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      zoo_adelete(zoo_, path.c_str(), version, &voidCompletionCb,
+                  static_cast<void *>(p));
+    }
+  }
+
+  // most deletes are not of our ephemerals, spare them the continuation
+  if(!isTrackedEphemeral(path)) {
+    return p->getFuture();
+  }
+  return p->getFuture().then([this, path](ZKResult &&r) {
+    if(r.result == ZOK || r.result == ZNONODE) {
+      untrackEphemeral(path);
+    }
+    return std::move(r);
+  });
+}
+
+Future<ZKGetResult> ZKClient::getCompact(std::string path, bool watch) {
+  auto promise = new Promise<ZKGetResult>;
+  auto f = promise->getFuture();
+
+  if(!ready) {
+    promise->setException(std::runtime_error("Not connected"));
+    delete promise;
+    return f;
+  }
+  const bool tracked = watch && trackWatch(kDataWatch, path);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_aget(zoo_, path.c_str(), watch ? 1 : 0,
+                  &compactDataCb<ZKGetResult>, static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    if(tracked) {
+      untrackWatch(kDataWatch, path);
+    }
+    compactDataCb<ZKGetResult>(rc, nullptr, -1, nullptr, promise);
+  }
+  return f;
+}
+
+Future<ZKStatResult> ZKClient::existsCompact(std::string path, bool watch) {
+  auto promise = new Promise<ZKStatResult>;
+  auto f = promise->getFuture();
+
+  if(!ready) {
+    promise->setException(std::runtime_error("Not connected"));
+    delete promise;
+    return f;
+  }
+  const bool tracked = watch && trackWatch(kExistsWatch, path);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_aexists(zoo_, path.c_str(), watch ? 1 : 0,
+                     &compactStatCb<ZKStatResult>,
+                     static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    if(tracked) {
+      untrackWatch(kExistsWatch, path);
+    }
+    compactStatCb<ZKStatResult>(rc, nullptr, promise);
+  }
+  return f;
+}
+
+Future<ZKChildrenResult> ZKClient::childrenCompact(std::string path,
+                                                   bool watch) {
+  auto promise = new Promise<ZKChildrenResult>;
+  auto f = promise->getFuture();
+
+  if(!ready) {
+    promise->setException(std::runtime_error("Not connected"));
+    delete promise;
+    return f;
+  }
+  const bool tracked = watch && trackWatch(kChildWatch, path);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_aget_children2(zoo_, path.c_str(), watch ? 1 : 0,
+                            &compactStringsCb<ZKChildrenResult>,
+                            static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    if(tracked) {
+      untrackWatch(kChildWatch, path);
+    }
+    compactStringsCb<ZKChildrenResult>(rc, nullptr, nullptr, promise);
   }
+  return f;
+}
+
+Future<ZKCreateResult>
+ZKClient::createCompact(std::string path,
+                        std::unique_ptr<folly::IOBuf> &&val,
+                        ACL_vector *acl,
+                        int flags) {
+  auto promise = new Promise<ZKCreateResult>;
+  auto f = promise->getFuture();
+
+  if(!ready) {
+    promise->setException(std::runtime_error("Not connected"));
+    delete promise;
+    return f;
+  }
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_acreate(zoo_, path.c_str(), (char *)val->data(), val->length(),
+                     acl, flags, &compactStringCb<ZKCreateResult>,
+                     static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    compactStringCb<ZKCreateResult>(rc, nullptr, promise);
+  }
+
+  if(!(flags & ZOO_EPHEMERAL)) {
+    return f;
+  }
+  std::shared_ptr<folly::IOBuf> data(val->clone());
+  return std::move(f).then(
+    [this, path, data, acl, flags](ZKCreateResult &&r) {
+      if(r.ok()) {
+        trackEphemeral(r.path, path, data, acl, flags);
+      }
+      return std::move(r);
+    });
+}
+
+Future<ZKResult> ZKClient::sync(std::string path) {
+  Promise<ZKResult> *p = new Promise<ZKResult>;
+  auto f = p->getFuture();
 
-  return p->getFuture();
+  if(!ready) {
+    p->setException(std::runtime_error("Not connected"));
+    delete p;
+    return f;
+  }
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_async(zoo_, path.c_str(), &stringCompletionCb,
+                   static_cast<void *>(p));
+  }
+  if(rc != ZOK) {
+    promiseFromData(p)->setValue(ZKResult(rc));
+  }
+  return f;
 }
 
 ZKResult ZKClient::delSync(std::string path, int version) {
-  int rc = zoo_delete(zoo_, path.c_str(), version);
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_delete(zoo_, path.c_str(), version);
+  }
   int maxTries = kMaxTriesPerSyncOperation;
   while(maxTries-- > 0 && (rc == ZINVALIDSTATE || retryable(rc))) {
     CHECK(getState() != ZOO_AUTH_FAILED_STATE);
     ZKClient::rawInitHandle(this);
-    rc = zoo_delete(zoo_, path.c_str(), version);
+    {
+      std::shared_lock<folly::SharedMutex> pin(zooLock_);
+      rc = zoo_delete(zoo_, path.c_str(), version);
+    }
+  }
+
+  if(rc == ZOK || rc == ZNONODE) {
+    untrackEphemeral(path);
   }
 
   struct ZKResult result(rc);
   return result;
 }
+
+ZKOp ZKOp::create(std::string path,
+                  std::unique_ptr<folly::IOBuf> &&val,
+                  ACL_vector *acl,
+                  int flags) {
+  ZKOp op;
+  op.type = kCreate;
+  op.path = std::move(path);
+  op.data = std::move(val);
+  op.data->coalesce();
+  op.acl = acl;
+  op.flags = flags;
+  return op;
+}
+
+ZKOp ZKOp::del(std::string path, int version) {
+  ZKOp op;
+  op.type = kDelete;
+  op.path = std::move(path);
+  op.version = version;
+  return op;
+}
+
+ZKOp ZKOp::set(std::string path,
+               std::unique_ptr<folly::IOBuf> &&val,
+               int version) {
+  ZKOp op;
+  op.type = kSet;
+  op.path = std::move(path);
+  op.data = std::move(val);
+  op.data->coalesce();
+  op.version = version;
+  return op;
+}
+
+ZKOp ZKOp::check(std::string path, int version) {
+  ZKOp op;
+  op.type = kCheck;
+  op.path = std::move(path);
+  op.version = version;
+  return op;
+}
+
+namespace {
+// everything zoo_amulti points into, until the completion
+struct MultiCall {
+  explicit MultiCall(std::vector<ZKOp> &&o)
+    : ops(std::move(o))
+    , zops(ops.size())
+    , results(ops.size())
+    , stats(ops.size())
+    , createdPaths(ops.size()) {}
+
+  std::vector<ZKOp> ops;
+  std::vector<zoo_op_t> zops;
+  std::vector<zoo_op_result_t> results;
+  std::vector<struct Stat> stats;
+  std::vector<std::unique_ptr<char[]>> createdPaths;
+  Promise<ZKMultiResult> promise;
+};
+}
+
+static void multiCompletionCb(int rc, const void *data) {
+  std::unique_ptr<MultiCall> call(
+    static_cast<MultiCall *>(const_cast<void *>(data)));
+  ZKMultiResult result;
+  result.result = rc;
+  for(auto i = 0u; i < call->ops.size(); ++i) {
+    auto &r = call->results[i];
+    ZKResult opResult(r.err);
+    if(r.err == ZOK && call->ops[i].type == ZKOp::kSet) {
+      opResult.status = call->stats[i];
+    }
+    if(r.err == ZOK && call->ops[i].type == ZKOp::kCreate && r.value) {
+      opResult.buff = folly::IOBuf::copyBuffer(
+        r.value, std::char_traits<char>::length(r.value));
+    }
+    result.results.push_back(std::move(opResult));
+  }
+  call->promise.setValue(std::move(result));
+}
+
+Future<ZKMultiResult> ZKClient::multi(std::vector<ZKOp> ops) {
+  auto call = new MultiCall(std::move(ops));
+  auto f = call->promise.getFuture();
+  if(!ready) {
+    call->promise.setException(std::runtime_error("Not connected"));
+    delete call;
+    return f;
+  }
+
+  for(auto i = 0u; i < call->ops.size(); ++i) {
+    auto &op = call->ops[i];
+    auto zop = &call->zops[i];
+    switch(op.type) {
+    case ZKOp::kCreate: {
+      // room for a sequential suffix
+      auto len = op.path.size() + 16;
+      call->createdPaths[i].reset(new char[len]());
+      zoo_create_op_init(zop, op.path.c_str(), (const char *)op.data->data(),
+                         op.data->length(), op.acl, op.flags,
+                         call->createdPaths[i].get(), len);
+      break;
+    }
+    case ZKOp::kDelete:
+      zoo_delete_op_init(zop, op.path.c_str(), op.version);
+      break;
+    case ZKOp::kSet:
+      zoo_set_op_init(zop, op.path.c_str(), (const char *)op.data->data(),
+                      op.data->length(), op.version, &call->stats[i]);
+      break;
+    case ZKOp::kCheck:
+      zoo_check_op_init(zop, op.path.c_str(), op.version);
+      break;
+    }
+  }
+
+  // the ops are gone after the completion, keep what the registry needs
+  std::vector<std::tuple<size_t, std::string, std::shared_ptr<folly::IOBuf>,
+                         ACL_vector *, int>>
+    ephemerals;
+  std::vector<std::string> deletes;
+  for(auto i = 0u; i < call->ops.size(); ++i) {
+    auto &op = call->ops[i];
+    if(op.type == ZKOp::kCreate && (op.flags & ZOO_EPHEMERAL)) {
+      ephemerals.emplace_back(i, op.path,
+                              std::shared_ptr<folly::IOBuf>(op.data->clone()),
+                              op.acl, op.flags);
+    } else if(op.type == ZKOp::kDelete) {
+      deletes.push_back(op.path);
+    }
+  }
+
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    rc = zoo_amulti(zoo_, call->zops.size(), call->zops.data(),
+                    call->results.data(), &multiCompletionCb, call);
+  }
+  if(rc != ZOK) {
+    ZKMultiResult failed;
+    failed.result = rc;
+    call->promise.setValue(std::move(failed));
+    delete call;
+    return f;
+  }
+  if(ephemerals.empty() && deletes.empty()) {
+    return f;
+  }
+  return f.then([this, ephemerals, deletes](ZKMultiResult &&r) {
+    if(r.result != ZOK) {
+      return std::move(r);
+    }
+    for(auto &e : ephemerals) {
+      auto &created = r.results[std::get<0>(e)];
+      if(created.buff) {
+        trackEphemeral(
+          std::string((const char *)created.data(), created.buff->length()),
+          std::get<1>(e), std::get<2>(e), std::get<3>(e), std::get<4>(e));
+      }
+    }
+    for(auto &path : deletes) {
+      untrackEphemeral(path);
+    }
+    return std::move(r);
+  });
+}
+
+namespace {
+struct SubtreeWalk : std::enable_shared_from_this<SubtreeWalk> {
+  SubtreeWalk(ZKClient *c, std::string r, ZKWalkCb v, size_t p)
+    : zk(c), root(std::move(r)), visit(std::move(v)), parallelism(p) {
+    pending.push_back(root);
+  }
+
+  void pump() {
+    std::vector<std::string> issue;
+    bool finished = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(done) {
+        return;
+      }
+      while(result == ZOK && inFlight < parallelism && !pending.empty()) {
+        issue.push_back(std::move(pending.front()));
+        pending.pop_front();
+        inFlight++;
+      }
+      if(inFlight == 0) {
+        done = finished = true;
+      }
+    }
+    if(issue.empty()) {
+      if(finished) {
+        promise.setValue(ZKResult(result));
+      }
+      return;
+    }
+    auto self = shared_from_this();
+    for(auto &path : issue) {
+      zk->children(path).then([self, path](Try<ZKResult> &&t) {
+        self->listed(path, std::move(t));
+      });
+    }
+  }
+
+  void listed(const std::string &path, Try<ZKResult> &&t) {
+    int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+    if(rc == ZOK) {
+      visit(path, t.value());
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      inFlight--;
+      if(rc == ZOK) {
+        for(auto &child : t.value().strings) {
+          pending.push_back(childPath(path, child));
+        }
+      } else if(result == ZOK && (rc != ZNONODE || path == root)) {
+        result = rc;
+      }
+    }
+    pump();
+  }
+
+  ZKClient *const zk;
+  const std::string root;
+  const ZKWalkCb visit;
+  const size_t parallelism;
+
+  std::mutex mutex;
+  std::deque<std::string> pending;
+  size_t inFlight{0};
+  int result{ZOK};
+  bool done{false};
+  Promise<ZKResult> promise;
+};
+
+// multi()s of deletes, issued in order with a bounded window. The session
+// keeps them in order, so a batch never races one before it.
+struct BatchedDelete : std::enable_shared_from_this<BatchedDelete> {
+  BatchedDelete(ZKClient *c,
+                std::vector<std::string> &&p,
+                size_t window,
+                size_t batch)
+    : zk(c), paths(std::move(p)), parallelism(window), batchSize(batch) {}
+
+  void pump() {
+    std::vector<std::vector<ZKOp>> issue;
+    bool finished = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(done) {
+        return;
+      }
+      while(result == ZOK && inFlight < parallelism && next < paths.size()) {
+        auto end = std::min(paths.size(), next + batchSize);
+        std::vector<ZKOp> ops;
+        for(; next < end; ++next) {
+          ops.push_back(ZKOp::del(std::move(paths[next])));
+        }
+        issue.push_back(std::move(ops));
+        inFlight++;
+      }
+      if(inFlight == 0) {
+        done = finished = true;
+      }
+    }
+    if(issue.empty()) {
+      if(finished) {
+        promise.setValue(ZKResult(result));
+      }
+      return;
+    }
+    auto self = shared_from_this();
+    for(auto &ops : issue) {
+      zk->multi(std::move(ops)).then([self](Try<ZKMultiResult> &&t) {
+        {
+          std::lock_guard<std::mutex> lock(self->mutex);
+          self->inFlight--;
+          int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+          if(self->result == ZOK) {
+            self->result = rc;
+          }
+        }
+        self->pump();
+      });
+    }
+  }
+
+  ZKClient *const zk;
+  std::vector<std::string> paths;
+  const size_t parallelism;
+  const size_t batchSize;
+
+  std::mutex mutex;
+  size_t next{0};
+  size_t inFlight{0};
+  int result{ZOK};
+  bool done{false};
+  Promise<ZKResult> promise;
+};
+}
+
+Future<ZKResult>
+ZKClient::walk(std::string root, ZKWalkCb visit, size_t parallelism) {
+  CHECK(parallelism > 0) << "Walking with no children() in flight";
+  auto w = std::make_shared<SubtreeWalk>(this, std::move(root),
+                                         std::move(visit), parallelism);
+  auto f = w->promise.getFuture();
+  w->pump();
+  return f;
+}
+
+static Future<ZKResult> deletePass(ZKClient *zk,
+                                   std::string root,
+                                   size_t parallelism,
+                                   size_t batchSize,
+                                   int passesLeft) {
+  auto paths = std::make_shared<std::vector<std::string>>();
+  auto walked = zk->walk(
+    root,
+    [paths](const std::string &path, const ZKResult &) {
+      paths->push_back(path);
+    },
+    parallelism);
+  return walked.then([=](ZKResult &&r) -> Future<ZKResult> {
+    if(r.result != ZOK) {
+      return makeFuture(std::move(r));
+    }
+    // walk order has parents before children, reversed it is a valid
+    // delete order
+    std::reverse(paths->begin(), paths->end());
+    auto d = std::make_shared<BatchedDelete>(zk, std::move(*paths),
+                                             parallelism, batchSize);
+    auto deleted = d->promise.getFuture();
+    d->pump();
+    return deleted.then([=](ZKResult &&r) -> Future<ZKResult> {
+      bool raced = r.result == ZNOTEMPTY || r.result == ZNONODE;
+      if(!raced || passesLeft <= 1) {
+        return makeFuture(std::move(r));
+      }
+      VLOG(1) << "Subtree " << root << " changed while deleting it, ret: "
+              << r.result << ", walking it again";
+      return deletePass(zk, root, parallelism, batchSize, passesLeft - 1);
+    });
+  });
+}
+
+Future<ZKResult> ZKClient::deleteRecursive(std::string root,
+                                           size_t parallelism,
+                                           size_t batchSize) {
+  CHECK(root != "/") << "Refusing to delete the whole tree";
+  CHECK(batchSize > 0) << "Deleting in empty batches";
+  return deletePass(this, std::move(root), parallelism, batchSize, 3);
+}
+
+Future<ZKResult> ZKClient::wget(std::string path, ZKWatchCb watcher) {
+  Promise<ZKResult> *promise = new Promise<ZKResult>;
+  auto f = promise->getFuture();
+
+  if(!ready) {
+    promise->setException(std::runtime_error("Not connected"));
+    delete promise;
+    return f;
+  }
+  uint64_t id;
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    auto w = addPathWatch(zoo_, std::move(watcher));
+    // w belongs to the zk thread once issued
+    id = w->id;
+    rc = zoo_awget(zoo_, path.c_str(), &pathWatchCb, w, &dataCompletionCb,
+                   static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    promiseFromData(promise)->setValue(ZKResult(rc));
+  }
+  return releaseUnarmed(std::move(f), id, false);
+}
+
+Future<ZKResult> ZKClient::wexists(std::string path, ZKWatchCb watcher) {
+  Promise<ZKResult> *promise = new Promise<ZKResult>;
+  auto f = promise->getFuture();
+
+  if(!ready) {
+    promise->setException(std::runtime_error("Not connected"));
+    delete promise;
+    return f;
+  }
+  uint64_t id;
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    auto w = addPathWatch(zoo_, std::move(watcher));
+    // w belongs to the zk thread once issued
+    id = w->id;
+    rc = zoo_awexists(zoo_, path.c_str(), &pathWatchCb, w, &statCompletionCb,
+                      static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    promiseFromData(promise)->setValue(ZKResult(rc));
+  }
+  return releaseUnarmed(std::move(f), id, true);
+}
+
+Future<ZKResult> ZKClient::wchildren(std::string path, ZKWatchCb watcher) {
+  Promise<ZKResult> *promise = new Promise<ZKResult>;
+  auto f = promise->getFuture();
+
+  if(!ready) {
+    promise->setException(std::runtime_error("Not connected"));
+    delete promise;
+    return f;
+  }
+  uint64_t id;
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    auto w = addPathWatch(zoo_, std::move(watcher));
+    // w belongs to the zk thread once issued
+    id = w->id;
+    rc = zoo_awget_children2(zoo_, path.c_str(), &pathWatchCb, w,
+                             &stringsAndStatCompletionCb,
+                             static_cast<void *>(promise));
+  }
+  if(rc != ZOK) {
+    promiseFromData(promise)->setValue(ZKResult(rc));
+  }
+  return releaseUnarmed(std::move(f), id, false);
+}
+
+ZKResult ZKClient::wchildrenSync(std::string path, ZKWatchCb watcher) {
+  uint64_t id;
+  struct String_vector strs {
+    0, nullptr
+  };
+  struct Stat stat;
+  int rc;
+  {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    auto w = addPathWatch(zoo_, std::move(watcher));
+    id = w->id;
+    rc = zoo_wget_children2(zoo_, path.c_str(), &pathWatchCb, w, &strs,
+                            &stat);
+  }
+  if(rc != ZOK) {
+    releasePathWatch(id);
+    return ZKResult(rc);
+  }
+  struct ZKResult result(rc, stat);
+  for(auto i = 0; strs.data && i < strs.count; ++i) {
+    result.strings.push_back(std::string(strs.data[i]));
+  }
+  deallocate_String_vector(&strs);
+  return result;
+}
 }
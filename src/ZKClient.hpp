@@ -6,12 +6,20 @@
 #include <utility>
 #include <thread>
 #include <zookeeper/zookeeper.h>
+#include <folly/SharedMutex.h>
 #include <folly/futures/Future.h>
 #include <folly/io/IOBuf.h>
 #include <boost/optional.hpp>
 #include <atomic>
 #include <limits>
+#include <map>
 #include <mutex>
+#include <set>
+#include <condition_variable>
+#include <shared_mutex>
+#include "bolt/zookeeper/ZKCodec.hpp"
+#include "bolt/zookeeper/ZKSessionHealth.hpp"
+#include "bolt/zookeeper/ZKWatchDebouncer.hpp"
 
 namespace bolt {
 using namespace ::folly;
@@ -65,8 +73,155 @@ struct ZKResult {
   std::vector<std::string> strings;
 };
 
+// ZKResult decoded through ZKCodec<T>. value is empty when the call failed
+// or the bytes did not decode as a T.
+template <class T> struct ZKTypedResult {
+  explicit ZKTypedResult(ZKResult &&r) : result(r.result), status(r.status) {
+    if(result == ZOK) {
+      T val;
+      if(r.buff ? ZKCodec<T>::decode(*r.buff, val)
+                : ZKCodec<T>::decode(folly::IOBuf(), val)) {
+        value = std::move(val);
+      }
+    }
+  }
+
+  bool ok() const { return result == ZOK && value; }
+
+  int result = -1;
+  boost::optional<Stat> status;
+  boost::optional<T> value;
+};
+
+// One operation of a multi(). Data is made contiguous when the op is built.
+struct ZKOp {
+  enum Type { kCreate, kDelete, kSet, kCheck };
+
+  static ZKOp create(std::string path,
+                     std::unique_ptr<folly::IOBuf> &&val,
+                     ACL_vector *acl,
+                     int flags);
+  static ZKOp del(std::string path, int version = -1);
+  static ZKOp
+  set(std::string path, std::unique_ptr<folly::IOBuf> &&val, int version = -1);
+  static ZKOp check(std::string path, int version);
+
+  Type type;
+  std::string path;
+  std::unique_ptr<folly::IOBuf> data;
+  ACL_vector *acl{nullptr};
+  int flags{0};
+  int version{-1};
+};
+
+struct ZKMultiResult {
+  bool ok() const { return result == ZOK; }
+
+  // ZOK if every op was applied. Otherwise none was, and this is the error
+  // of the first op that failed.
+  int result = -1;
+  // one per op, in order: the op's error code, the new Stat for sets and
+  // the created path (in buff) for creates
+  std::vector<ZKResult> results;
+};
+
+// Compact results of the *Compact() calls: only what the op returns, no
+// boost::optional, and no IOBuf or vector unless the op has one. Built
+// straight from the completion's arguments; fields other than result are
+// empty (stats zeroed) unless ok().
+struct ZKStatResult {
+  ZKStatResult(int rc, const struct Stat *s) : result(rc) {
+    if(s && rc == ZOK) {
+      stat = *s;
+    }
+  }
+  bool ok() const { return result == ZOK; }
+
+  int result = -1;
+  Stat stat{};
+};
+
+struct ZKGetResult {
+  ZKGetResult(int rc, const char *value, int len, const struct Stat *s)
+    : result(rc) {
+    if(rc == ZOK) {
+      if(s) {
+        stat = *s;
+      }
+      if(value) {
+        buff = folly::IOBuf::copyBuffer(value, len);
+      }
+    }
+  }
+  bool ok() const { return result == ZOK; }
+  // node data, nullptr for a node without any
+  const uint8_t *data() const { return buff ? buff->data() : nullptr; }
+  size_t length() const { return buff ? buff->length() : 0; }
+
+  int result = -1;
+  Stat stat{};
+  std::unique_ptr<folly::IOBuf> buff;
+};
+
+struct ZKChildrenResult {
+  ZKChildrenResult(int rc,
+                   const struct String_vector *strs,
+                   const struct Stat *s)
+    : result(rc) {
+    if(rc != ZOK) {
+      return;
+    }
+    if(s) {
+      stat = *s;
+    }
+    if(strs) {
+      children.reserve(strs->count);
+      for(auto i = 0; i < strs->count; ++i) {
+        children.emplace_back(strs->data[i]);
+      }
+    }
+  }
+  bool ok() const { return result == ZOK; }
+
+  int result = -1;
+  Stat stat{};
+  std::vector<std::string> children;
+};
+
+struct ZKCreateResult {
+  ZKCreateResult(int rc, const char *value) : result(rc) {
+    if(rc == ZOK && value) {
+      path = value;
+    }
+  }
+  bool ok() const { return result == ZOK; }
+
+  int result = -1;
+  // the node created, sequence suffix included. Short paths fit the
+  // string's inline buffer.
+  std::string path;
+};
+
 typedef std::function<void(int, int, const std::string, ZKClient *)> ZKWatchCb;
 
+// Called once per node of a subtree walk, with its children listing.
+typedef std::function<void(const std::string &path, const ZKResult &children)>
+  ZKWalkCb;
+
+// kSequential: whatever the server we are connected to has, which may lag
+// the leader. kLinearizable: sync() first, pipelined with the read, so the
+// read sees every write committed before it was issued. Costs a round
+// trip through the leader.
+enum class ZKConsistency { kSequential, kLinearizable };
+
+// Called once an expired session has been replaced and the ephemerals and
+// watches created through the client were restored on the new one. Maps
+// every tracked ephemeral to its path on the new session: sequential nodes
+// get a new name, and the path is empty if it could not be recreated.
+typedef std::function<void(ZKClient *,
+                           const std::map<std::string, std::string> &)>
+  ZKSessionRecoveredCb;
+
 class ZKClient {
   public:
   static std::string printZookeeperEventType(int type);
@@ -75,10 +230,13 @@ class ZKClient {
 
   static bool retryable(int rc);
 
-  static void rawInitHandle(ZKClient *);
+  // wait: until the new session is connected
+  static void rawInitHandle(ZKClient *, bool wait = true);
 
 
   enum { NO_TIMEOUT = std::numeric_limits<int>::max() };
+  // block: return once the session is established. Otherwise return right
+  // away, connected() tells when calls can be made.
   template <class F>
   ZKClient(F &&watch,
            const std::string &hosts = "127.0.0.1:2181",
@@ -95,11 +253,21 @@ class ZKClient {
 
   ~ZKClient();
 
-  Future<ZKResult> children(std::string path, bool watch = false);
+  // Completes once connected, right away if we are. Fails if the client is
+  // destroyed first.
+  Future<Unit> connected();
+
+  Future<ZKResult>
+  children(std::string path,
+           bool watch = false,
+           ZKConsistency consistency = ZKConsistency::kSequential);
 
   ZKResult childrenSync(std::string path, bool watch = false);
 
-  Future<ZKResult> get(std::string path, bool watch = false);
+  Future<ZKResult>
+  get(std::string path,
+      bool watch = false,
+      ZKConsistency consistency = ZKConsistency::kSequential);
 
   ZKResult getSync(std::string path, bool watch = false);
 
@@ -110,7 +278,10 @@ class ZKClient {
                    std::unique_ptr<folly::IOBuf> &&val,
                    int version = -1);
 
-  Future<ZKResult> exists(std::string path, bool watch = false);
+  Future<ZKResult>
+  exists(std::string path,
+         bool watch = false,
+         ZKConsistency consistency = ZKConsistency::kSequential);
 
   ZKResult existsSync(std::string path, bool watch = false);
 
@@ -126,19 +297,124 @@ class ZKClient {
 
   Future<ZKResult> del(std::string path, int version = -1);
 
+  // The same reads and create with compact, op-specific results: smaller
+  // futures and no unused members built. Watches and ephemerals are tracked
+  // as for the calls above.
+  Future<ZKGetResult> getCompact(std::string path, bool watch = false);
+  Future<ZKStatResult> existsCompact(std::string path, bool watch = false);
+  Future<ZKChildrenResult> childrenCompact(std::string path,
+                                           bool watch = false);
+  Future<ZKCreateResult> createCompact(std::string path,
+                                       std::unique_ptr<folly::IOBuf> &&val,
+                                       ACL_vector *acl,
+                                       int flags);
+
+  // zoo_async: the server we are connected to catches up with the leader
+  // on path. Reads issued after it on this session see everything
+  // committed before it.
+  Future<ZKResult> sync(std::string path);
+
   ZKResult delSync(std::string path, int version = -1);
 
+  // zoo_amulti: all ops are applied atomically, or none is.
+  Future<ZKMultiResult> multi(std::vector<ZKOp> ops);
+
+  // Visits `root` and every node below it, a node always before its
+  // children. One children() per node, at most `parallelism` in flight.
+  // visit runs on the zookeeper thread. Nodes deleted during the walk are
+  // skipped; completes with ZNONODE if root does not exist, with the first
+  // other error if any listing failed, ZOK otherwise.
+  Future<ZKResult>
+  walk(std::string root, ZKWalkCb visit, size_t parallelism = 64);
+
+  // Deletes `root` and everything below it: walk(), then deletes in
+  // multi()s of `batchSize`, children before parents, up to `parallelism`
+  // of them in flight. Nodes created or deleted by someone else meanwhile
+  // abort a batch; the subtree is then walked again, a few times at most.
+  Future<ZKResult> deleteRecursive(std::string root,
+                                   size_t parallelism = 64,
+                                   size_t batchSize = 500);
+
+  // One-shot watches delivered to `watcher` instead of the client callback,
+  // like zoo_awget & co. Session events reach the watcher too while it is
+  // pending. It is dropped once its node event fired, or with the session:
+  // these are not replayed by session recovery.
+  Future<ZKResult> wget(std::string path, ZKWatchCb watcher);
+
+  Future<ZKResult> wexists(std::string path, ZKWatchCb watcher);
+
+  Future<ZKResult> wchildren(std::string path, ZKWatchCb watcher);
+
+  ZKResult wchildrenSync(std::string path, ZKWatchCb watcher);
+
+  // Session events (ZOO_SESSION_EVENT) for recipes sharing this client,
+  // delivered before the watch callback gets them.
+  uint64_t addSessionListener(ZKWatchCb cb);
+  void removeSessionListener(uint64_t id);
+
+  // Typed accessors. See ZKCodec.hpp for the supported types.
+  template <class T>
+  Future<ZKTypedResult<T>> getAs(std::string path, bool watch = false) {
+    return get(std::move(path), watch).then([](ZKResult &&r) {
+      return ZKTypedResult<T>(std::move(r));
+    });
+  }
+
+  template <class T>
+  ZKTypedResult<T> getAsSync(std::string path, bool watch = false) {
+    return ZKTypedResult<T>(getSync(std::move(path), watch));
+  }
+
+  template <class T>
+  Future<ZKResult> setAs(std::string path, const T &val, int version = -1) {
+    return set(std::move(path), ZKCodec<T>::encode(val), version);
+  }
+
+  template <class T>
+  ZKResult setAsSync(std::string path, const T &val, int version = -1) {
+    return setSync(std::move(path), ZKCodec<T>::encode(val), version);
+  }
+
+  // Session recovery. Ephemerals created and watches set through this client
+  // are replayed, pipelined, on the session that replaces an expired one.
+  // ACLs passed to create() must outlive the client (ZOO_OPEN_ACL_UNSAFE &co).
+  uint64_t addSessionRecoveredCb(ZKSessionRecoveredCb cb);
+  void removeSessionRecoveredCb(uint64_t id);
+
+  // Debounce node events for `pathPrefix` and below before they reach the
+  // watch callback. Delayed events are delivered from a separate thread.
+  // Session events are never debounced.
+  void setWatchDebounce(const std::string &pathPrefix, ZKDebounce debounce);
+  std::map<std::string, ZKDebounceStats> watchDebounceStats();
+
+  // Session health: time per connection state, reconnects, the server we
+  // are talking to and - once probes are started - round trip times.
+  ZKHealthSnapshot health();
+  // Times an exists("/") every interval, at most one in flight. Cheap on
+  // the server, and measures the network plus our completion thread.
+  void startHealthProbes(std::chrono::milliseconds interval);
+
+  // valid until the session is replaced
   const clientid_t *getClientId();
 
   // State constants
-  int getState() { return zoo_state(zoo_); }
+  int getState() {
+    return withHandle([](zhandle_t *zh) { return zoo_state(zh); });
+  }
 
-  int64_t getSessionId() { return zoo_client_id(zoo_)->client_id; }
+  int64_t getSessionId() {
+    return withHandle(
+      [](zhandle_t *zh) { return zoo_client_id(zh)->client_id; });
+  }
 
 
   void decrementSessionTries() { maxSessionConnTries_--; }
   int getSessionsTriesLeft() const { return maxSessionConnTries_; }
   int timeout() const { return timeout_; }
+  // session timeout the ensemble settled on, in ms
+  int negotiatedTimeout() {
+    return withHandle([](zhandle_t *zh) { return zoo_recv_timeout(zh); });
+  }
   int flags() const { return flags_; }
   std::string hosts() { return hosts_; }
 
@@ -149,16 +425,108 @@ class ZKClient {
   ZKWatchCb watch_;
   std::atomic<bool> ready;
   zhandle_t *zoo_{nullptr};
+  // Session recovery swaps zoo_ under the exclusive lock, every call
+  // through it holds the shared one: the expired handle is only closed
+  // once no call can still be using it. Never held across a completion
+  // or a continuation, a waiting writer would deadlock a nested reader.
+  folly::SharedMutex zooLock_;
   std::mutex rawInitMutex_;
 
+  // f(zoo_) with the handle pinned
+  template <class F> auto withHandle(F &&f) -> decltype(f(zoo_)) {
+    std::shared_lock<folly::SharedMutex> pin(zooLock_);
+    return f(zoo_);
+  }
+
   void destroy();
   void init(bool block);
+  // from the watch callback: replace an expired session in the background
+  void scheduleRecovery();
+  // keep the ephemeral/watch registry in sync w/ the events zk delivers
+  void untrackFiredWatch(int type, const std::string &path);
+  void markConnected();
+  // health bookkeeping and session listeners
+  void sessionEvent(int state);
+  // true if the debouncer took the event, it must not be delivered now
+  bool debounced(int type, int state, const std::string &path);
+
+  // for calls that bypass the Future API (see ZKClientCoro.hpp)
+  enum WatchKind { kDataWatch, kExistsWatch, kChildWatch };
+  void trackEphemeral(const std::string &path,
+                      const std::string &requestedPath,
+                      std::shared_ptr<folly::IOBuf> data,
+                      ACL_vector *acl,
+                      int flags);
+  void untrackEphemeral(const std::string &path);
+  bool isTrackedEphemeral(const std::string &path);
+  // false if an identical watch was tracked already
+  bool trackWatch(WatchKind kind, const std::string &path);
+  // undoes a trackWatch() whose call failed before reaching the server
+  void untrackWatch(WatchKind kind, const std::string &path);
 
   private:
+  // context of a per-call watcher. Owned by pathWatches_ until it fires,
+  // fails to arm, or its handle is closed.
+  struct PathWatch {
+    ZKClient *cli;
+    zhandle_t *zh;
+    uint64_t id;
+    ZKWatchCb cb;
+  };
+
+  static void
+  pathWatchCb(zhandle_t *zh, int type, int state, const char *path, void *ctx);
+  // zh: the handle the watch is set on, pinned by the caller
+  PathWatch *addPathWatch(zhandle_t *zh, ZKWatchCb cb);
+  void releasePathWatch(uint64_t id);
+  void releasePathWatches(zhandle_t *zh);
+  // drops the watcher if the call did not leave a watch behind
+  Future<ZKResult>
+  releaseUnarmed(Future<ZKResult> f, uint64_t id, bool existsWatch);
+
+  struct TrackedEphemeral {
+    std::string requestedPath;
+    std::shared_ptr<folly::IOBuf> data;
+    ACL_vector *acl;
+    int flags;
+  };
+
+  std::map<std::string, std::string> restoreSession();
+  void notifySessionRecovered(const std::map<std::string, std::string> &);
+  void recoveryLoop();
+
   const std::string hosts_;
   int timeout_;
   int flags_;
   int maxSessionConnTries_ = {600};
+
+  std::mutex trackMutex_;
+  std::map<std::string, TrackedEphemeral> ephemerals_;
+  std::set<std::pair<WatchKind, std::string>> watches_;
+  std::map<uint64_t, ZKSessionRecoveredCb> recoveredCbs_;
+  uint64_t nextRecoveredCbId_{0};
+  std::map<uint64_t, ZKWatchCb> sessionListeners_;
+  uint64_t nextSessionListenerId_{0};
+  std::map<uint64_t, std::unique_ptr<PathWatch>> pathWatches_;
+  uint64_t nextPathWatchId_{0};
+
+  std::unique_ptr<ZKWatchDebouncer> debouncer_;
+  ZKSessionHealth health_;
+  std::thread probeThread_;
+  void probeLoop(std::chrono::milliseconds interval);
+  // the probe thread's own: a recovery wake-up must not land on it
+  std::mutex probeMutex_;
+  std::condition_variable probeCv_;
+
+  std::mutex readyMutex_;
+  std::condition_variable readyCv_;
+  std::vector<Promise<Unit>> connectedPromises_;
+
+  std::mutex recoveryMutex_;
+  std::condition_variable recoveryCv_;
+  bool recoveryPending_{false};
+  std::atomic<bool> closing_{false};
+  std::thread recoveryThread_;
 };
 }
 
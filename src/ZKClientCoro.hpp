@@ -0,0 +1,444 @@
+#pragma once
+#include <folly/Portability.h>
+
+#if FOLLY_HAS_COROUTINES
+#include <cstring>
+#include <stdexcept>
+#include <boost/algorithm/string.hpp>
+#include <folly/experimental/coro/Coroutine.h>
+#include <folly/experimental/coro/Task.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/zookeeper/ZKLeader.hpp"
+#include "bolt/zookeeper/zookeeper_utils.hpp"
+
+namespace bolt {
+namespace coro {
+// co_await-able ZooKeeper calls.
+//
+// The awaiter lives in the awaiting coroutine's frame and is handed to the C
+// client as the completion context; the completion callback fills in the
+// result and resumes the coroutine. No Promise, Future or continuation is
+// allocated. Inside a folly::coro::Task the resumption is moved back onto
+// the task's executor, so nothing runs on the zookeeper completion thread.
+//
+// Same semantics as the Future API: throws std::runtime_error when not
+// connected, otherwise returns a ZKResult with the zookeeper return code.
+class ZKAwaiter {
+  public:
+  explicit ZKAwaiter(ZKClient &zk) : zk_(zk) {}
+  ZKAwaiter(const ZKAwaiter &) = delete;
+  ZKAwaiter(ZKAwaiter &&) = default;
+
+  bool await_ready() const noexcept { return false; }
+
+  ZKResult await_resume() {
+    if(notConnected_) {
+      throw std::runtime_error("Not connected");
+    }
+    return std::move(result_);
+  }
+
+  protected:
+  // issue(data) calls the zoo_a* function. If it fails up front there is no
+  // completion coming, so we do not suspend at all. Must not touch *this
+  // once issued - the coroutine may already be running on the zk thread.
+  // watchPath: the watch the call sets, if any. Tracked before the call so
+  // its event can't reach the registry first, untracked if nothing was set.
+  template <class F>
+  bool suspend(folly::coro::coroutine_handle<> h,
+               F &&issue,
+               const std::string *watchPath = nullptr,
+               ZKClient::WatchKind kind = ZKClient::kDataWatch) {
+    handle_ = h;
+    if(!zk_.ready) {
+      notConnected_ = true;
+      return false;
+    }
+    std::string watched;
+    bool tracked = false;
+    if(watchPath) {
+      watched = *watchPath;
+      tracked = zk_.trackWatch(kind, watched);
+    }
+    auto &zk = zk_;
+    int rc;
+    {
+      // see ZKClient::zooLock_
+      std::shared_lock<folly::SharedMutex> pin(zk.zooLock_);
+      rc = issue(static_cast<const void *>(this));
+    }
+    if(rc != ZOK) {
+      // no completion coming, *this is still ours
+      if(tracked) {
+        zk.untrackWatch(kind, watched);
+      }
+      result_.result = rc;
+      return false;
+    }
+    return true;
+  }
+
+  static ZKAwaiter *self(const void *data) {
+    return const_cast<ZKAwaiter *>(static_cast<const ZKAwaiter *>(data));
+  }
+
+  static boost::optional<Stat> optStat(const struct Stat *stat) {
+    return stat ? boost::optional<Stat>(*stat) : boost::none;
+  }
+
+  static void dataCb(int rc,
+                     const char *value,
+                     int valueLen,
+                     const struct Stat *stat,
+                     const void *data) {
+    auto s = self(data);
+    s->result_ = ZKResult(rc, optStat(stat));
+    if(value) {
+      s->result_.buff = folly::IOBuf::copyBuffer(value, valueLen);
+    }
+    s->handle_.resume();
+  }
+
+  static void statCb(int rc, const struct Stat *stat, const void *data) {
+    auto s = self(data);
+    s->result_ = ZKResult(rc, optStat(stat));
+    s->handle_.resume();
+  }
+
+  static void stringsCb(int rc,
+                        const struct String_vector *strs,
+                        const struct Stat *stat,
+                        const void *data) {
+    auto s = self(data);
+    s->result_ = ZKResult(rc, optStat(stat));
+    for(auto i = 0; strs && i < strs->count; ++i) {
+      s->result_.strings.push_back(strs->data[i]);
+    }
+    s->handle_.resume();
+  }
+
+  static void voidCb(int rc, const void *data) {
+    auto s = self(data);
+    s->result_ = ZKResult(rc);
+    s->handle_.resume();
+  }
+
+  ZKClient &zk_;
+  folly::coro::coroutine_handle<> handle_;
+  ZKResult result_{-1};
+  bool notConnected_{false};
+};
+
+class GetAwaiter : public ZKAwaiter {
+  public:
+  GetAwaiter(ZKClient &zk, std::string path, bool watch)
+    : ZKAwaiter(zk), path_(std::move(path)), watch_(watch) {}
+
+  bool await_suspend(folly::coro::coroutine_handle<> h) {
+    return suspend(
+      h,
+      [this](const void *data) {
+        return zoo_aget(zk_.zoo_, path_.c_str(), watch_, &dataCb, data);
+      },
+      watch_ ? &path_ : nullptr, ZKClient::kDataWatch);
+  }
+
+  private:
+  std::string path_;
+  bool watch_;
+};
+
+class ExistsAwaiter : public ZKAwaiter {
+  public:
+  ExistsAwaiter(ZKClient &zk, std::string path, bool watch)
+    : ZKAwaiter(zk), path_(std::move(path)), watch_(watch) {}
+
+  bool await_suspend(folly::coro::coroutine_handle<> h) {
+    return suspend(
+      h,
+      [this](const void *data) {
+        return zoo_aexists(zk_.zoo_, path_.c_str(), watch_, &statCb, data);
+      },
+      watch_ ? &path_ : nullptr, ZKClient::kExistsWatch);
+  }
+
+  private:
+  std::string path_;
+  bool watch_;
+};
+
+class ChildrenAwaiter : public ZKAwaiter {
+  public:
+  ChildrenAwaiter(ZKClient &zk, std::string path, bool watch)
+    : ZKAwaiter(zk), path_(std::move(path)), watch_(watch) {}
+
+  bool await_suspend(folly::coro::coroutine_handle<> h) {
+    return suspend(
+      h,
+      [this](const void *data) {
+        return zoo_aget_children2(zk_.zoo_, path_.c_str(), watch_,
+                                  &stringsCb, data);
+      },
+      watch_ ? &path_ : nullptr, ZKClient::kChildWatch);
+  }
+
+  private:
+  std::string path_;
+  bool watch_;
+};
+
+class SetAwaiter : public ZKAwaiter {
+  public:
+  SetAwaiter(ZKClient &zk,
+             std::string path,
+             std::unique_ptr<folly::IOBuf> val,
+             int version)
+    : ZKAwaiter(zk)
+    , path_(std::move(path))
+    , val_(std::move(val))
+    , version_(version) {}
+
+  bool await_suspend(folly::coro::coroutine_handle<> h) {
+    val_->coalesce();
+    return suspend(h, [this](const void *data) {
+      return zoo_aset(zk_.zoo_, path_.c_str(), (const char *)val_->data(),
+                      val_->length(), version_, &statCb, data);
+    });
+  }
+
+  private:
+  std::string path_;
+  std::unique_ptr<folly::IOBuf> val_;
+  int version_;
+};
+
+class CreateAwaiter : public ZKAwaiter {
+  public:
+  CreateAwaiter(ZKClient &zk,
+                std::string path,
+                std::unique_ptr<folly::IOBuf> val,
+                ACL_vector *acl,
+                int flags)
+    : ZKAwaiter(zk)
+    , path_(std::move(path))
+    , val_(std::move(val))
+    , acl_(acl)
+    , flags_(flags) {}
+
+  bool await_suspend(folly::coro::coroutine_handle<> h) {
+    val_->coalesce();
+    return suspend(h, [this](const void *data) {
+      return zoo_acreate(zk_.zoo_, path_.c_str(), (const char *)val_->data(),
+                         val_->length(), acl_, flags_, &createdCb, data);
+    });
+  }
+
+  private:
+  static void createdCb(int rc, const char *value, const void *data) {
+    auto s = static_cast<CreateAwaiter *>(self(data));
+    s->result_ = ZKResult(rc);
+    if(value) {
+      s->result_.buff = folly::IOBuf::copyBuffer(value, std::strlen(value));
+      if(rc == ZOK && (s->flags_ & ZOO_EPHEMERAL)) {
+        s->zk_.trackEphemeral(value, s->path_,
+                              std::shared_ptr<folly::IOBuf>(s->val_->clone()),
+                              s->acl_, s->flags_);
+      }
+    }
+    s->handle_.resume();
+  }
+
+  std::string path_;
+  std::unique_ptr<folly::IOBuf> val_;
+  ACL_vector *acl_;
+  int flags_;
+};
+
+class DelAwaiter : public ZKAwaiter {
+  public:
+  DelAwaiter(ZKClient &zk, std::string path, int version)
+    : ZKAwaiter(zk), path_(std::move(path)), version_(version) {}
+
+  bool await_suspend(folly::coro::coroutine_handle<> h) {
+    return suspend(h, [this](const void *data) {
+      return zoo_adelete(zk_.zoo_, path_.c_str(), version_, &deletedCb, data);
+    });
+  }
+
+  private:
+  static void deletedCb(int rc, const void *data) {
+    auto s = static_cast<DelAwaiter *>(self(data));
+    if(rc == ZOK || rc == ZNONODE) {
+      s->zk_.untrackEphemeral(s->path_);
+    }
+    voidCb(rc, data);
+  }
+
+  std::string path_;
+  int version_;
+};
+
+inline GetAwaiter get(ZKClient &zk, std::string path, bool watch = false) {
+  return GetAwaiter(zk, std::move(path), watch);
+}
+
+inline ExistsAwaiter
+exists(ZKClient &zk, std::string path, bool watch = false) {
+  return ExistsAwaiter(zk, std::move(path), watch);
+}
+
+inline ChildrenAwaiter
+children(ZKClient &zk, std::string path, bool watch = false) {
+  return ChildrenAwaiter(zk, std::move(path), watch);
+}
+
+inline SetAwaiter set(ZKClient &zk,
+                      std::string path,
+                      std::unique_ptr<folly::IOBuf> val,
+                      int version = -1) {
+  return SetAwaiter(zk, std::move(path), std::move(val), version);
+}
+
+inline CreateAwaiter create(ZKClient &zk,
+                            std::string path,
+                            std::unique_ptr<folly::IOBuf> val,
+                            ACL_vector *acl,
+                            int flags) {
+  return CreateAwaiter(zk, std::move(path), std::move(val), acl, flags);
+}
+
+inline DelAwaiter del(ZKClient &zk, std::string path, int version = -1) {
+  return DelAwaiter(zk, std::move(path), version);
+}
+
+// Coroutine versions of the ZKLeader building blocks.
+
+// mkdir -p. Returns the first unexpected return code, ZOK otherwise.
+inline folly::coro::Task<int> touchPath(ZKClient &zk, std::string nestedPath) {
+  std::vector<std::string> parts;
+  boost::split(parts, nestedPath, boost::is_any_of("/"));
+  std::string path;
+  for(auto &p : parts) {
+    if(p.empty()) {
+      continue;
+    }
+    path += "/" + p;
+    auto ret = co_await exists(zk, path);
+    if(ret.result == ZNONODE) {
+      ret = co_await create(zk, path, std::make_unique<folly::IOBuf>(),
+                            &ZOO_OPEN_ACL_UNSAFE, 0);
+      // lost a race with another candidate, fine
+      if(ret.result == ZNODEEXISTS) {
+        continue;
+      }
+    }
+    if(ret.result != ZOK) {
+      co_return ret.result;
+    }
+  }
+  co_return ZOK;
+}
+
+// Creates the election directory if needed and our sequential ephemeral in
+// it. Returns the full path of our node.
+inline folly::coro::Task<std::string>
+registerCandidate(ZKClient &zk, std::string electionDir, std::string name) {
+  auto rc = co_await touchPath(zk, electionDir);
+  if(rc != ZOK) {
+    throw std::runtime_error("Failed to create election path: "
+                             + electionDir + ", ret: " + std::to_string(rc));
+  }
+  auto ret = co_await create(zk, electionDir + "/" + name + "_n_",
+                             std::make_unique<folly::IOBuf>(),
+                             &ZOO_OPEN_ACL_UNSAFE,
+                             ZOO_SEQUENCE | ZOO_EPHEMERAL);
+  if(!ret.ok()) {
+    throw std::runtime_error("Couldn't create election node, ret: "
+                             + std::to_string(ret.result));
+  }
+  co_return std::string((const char *)ret.data(), ret.buff->length());
+}
+
+// One election pass: are we the lowest candidate? Re-arms the children
+// watch, so the next change shows up on the client's watch callback. Reads
+// the listing exactly like ZKLeader does.
+inline folly::coro::Task<bool> isLowestCandidate(ZKClient &zk,
+                                                 std::string electionDir,
+                                                 std::string ourNode) {
+  auto ourId = ZKLeader::extractIdFromEphemeralPath(ourNode);
+  if(!ourId) {
+    co_return false;
+  }
+  auto ret = co_await children(zk, electionDir, true);
+  if(!ret.ok()) {
+    co_return false;
+  }
+  auto candidates = ZKLeader::scanCandidates(ret.strings, *ourId);
+  co_return candidates.foundOurs && *ourId <= candidates.lowest;
+}
+
+// The election loop: completes once ourNode is the lowest candidate in
+// electionDir. Unlike ZKLeader, which re-lists the directory on every
+// change, each pass watches only the candidate right ahead of us, so a
+// release wakes one waiter. Throws if our node is gone (the session
+// expired) or the directory can't be listed; leadership is lost with the
+// node, watch it with exists() or a ZKLeader-style session listener.
+inline folly::coro::Task<void> awaitLeadership(ZKClient &zk,
+                                               std::string electionDir,
+                                               std::string ourNode) {
+  const auto ourName = ourNode.substr(ourNode.rfind('/') + 1);
+  const auto ourSeq = parseSequenceSuffix(ourName.data(), ourName.size());
+  if(ourSeq < 0) {
+    throw std::runtime_error("Not an election node: " + ourNode);
+  }
+  while(true) {
+    auto ret = co_await children(zk, electionDir);
+    if(!ret.ok()) {
+      throw std::runtime_error("Couldn't list " + electionDir
+                               + ", ret: " + std::to_string(ret.result));
+    }
+    bool found = false;
+    int64_t aheadSeq = -1;
+    const std::string *ahead = nullptr;
+    for(auto &child : ret.strings) {
+      auto seq = parseSequenceSuffix(child.data(), child.size());
+      if(seq < 0) {
+        continue;
+      }
+      found = found || child == ourName;
+      if(seq < ourSeq && seq > aheadSeq) {
+        aheadSeq = seq;
+        ahead = &child;
+      }
+    }
+    if(!found) {
+      throw std::runtime_error("Election node is gone: " + ourNode);
+    }
+    if(!ahead) {
+      co_return;
+    }
+    // the expiry wakes us too, the next listing won't find our node
+    auto gone = std::make_shared<folly::Promise<folly::Unit>>();
+    auto wake = gone->getSemiFuture();
+    auto watched = co_await zk.wget(
+      electionDir + "/" + *ahead,
+      [gone](int type, int state, std::string, ZKClient *) {
+        if((type != ZOO_SESSION_EVENT || state == ZOO_EXPIRED_SESSION_STATE)
+           && !gone->isFulfilled()) {
+          gone->setValue();
+        }
+      });
+    if(watched.result == ZNONODE) {
+      // went away in between, not armed
+      continue;
+    }
+    if(!watched.ok()) {
+      throw std::runtime_error("Couldn't watch " + *ahead
+                               + ", ret: " + std::to_string(watched.result));
+    }
+    co_await std::move(wake);
+  }
+}
+}
+}
+#endif
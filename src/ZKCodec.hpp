@@ -0,0 +1,127 @@
+#pragma once
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <folly/io/IOBuf.h>
+#include <folly/io/Cursor.h>
+#include <glog/logging.h>
+
+namespace bolt {
+// ZKCodec<T> maps a value to and from the bytes of a znode.
+//
+// decode() reads straight out of the IOBuf returned by ZKClient - no
+// std::string in between. encode() sizes the buffer once and writes into it.
+// encodeInto() lets hot paths reuse a preallocated IOBuf (it needs
+// size(val) bytes of tailroom).
+//
+// Out of the box: trivially copyable types (raw host byte order bytes),
+// std::string and protobuf-like messages (ByteSize/SerializeToArray/
+// ParseFromArray). Thrift and friends: specialize ZKCodec for your type.
+template <class T, class Enable = void> struct ZKCodec;
+
+namespace detail {
+template <class...> struct ZKVoid { typedef void type; };
+
+template <class T, class = void>
+struct IsProtobufLike : std::false_type {};
+
+template <class T>
+struct IsProtobufLike<
+  T,
+  typename ZKVoid<decltype(std::declval<const T &>().ByteSize()),
+                  decltype(std::declval<const T &>().SerializeToArray(
+                    (void *)nullptr, 0)),
+                  decltype(std::declval<T &>().ParseFromArray(
+                    (const void *)nullptr, 0))>::type> : std::true_type {};
+
+// Calls fn(const uint8_t*, size_t) with a contiguous view of buf. Buffers
+// from ZKClient are never chained, so the coalesce is the rare path.
+template <class F> auto withContiguous(const folly::IOBuf &buf, F &&fn) {
+  if(!buf.isChained()) {
+    return fn(buf.data(), buf.length());
+  }
+  auto flat = buf.clone();
+  flat->coalesce();
+  return fn(flat->data(), flat->length());
+}
+}
+
+template <class T>
+struct ZKCodec<T,
+               typename std::enable_if<
+                 std::is_trivially_copyable<T>::value
+                 && !detail::IsProtobufLike<T>::value>::type> {
+  static size_t size(const T &) { return sizeof(T); }
+
+  static void encodeInto(const T &val, folly::IOBuf &out) {
+    CHECK(out.tailroom() >= sizeof(T)) << "Not enough room to encode value";
+    std::memcpy(out.writableTail(), &val, sizeof(T));
+    out.append(sizeof(T));
+  }
+
+  static std::unique_ptr<folly::IOBuf> encode(const T &val) {
+    return folly::IOBuf::copyBuffer(&val, sizeof(T));
+  }
+
+  static bool decode(const folly::IOBuf &buf, T &out) {
+    if(buf.computeChainDataLength() != sizeof(T)) {
+      return false;
+    }
+    folly::io::Cursor cursor(&buf);
+    cursor.pull(&out, sizeof(T));
+    return true;
+  }
+};
+
+template <> struct ZKCodec<std::string> {
+  static size_t size(const std::string &val) { return val.size(); }
+
+  static void encodeInto(const std::string &val, folly::IOBuf &out) {
+    CHECK(out.tailroom() >= val.size()) << "Not enough room to encode value";
+    std::memcpy(out.writableTail(), val.data(), val.size());
+    out.append(val.size());
+  }
+
+  static std::unique_ptr<folly::IOBuf> encode(const std::string &val) {
+    return folly::IOBuf::copyBuffer(val.data(), val.size());
+  }
+
+  static bool decode(const folly::IOBuf &buf, std::string &out) {
+    out.clear();
+    out.reserve(buf.computeChainDataLength());
+    for(auto &range : buf) {
+      out.append(reinterpret_cast<const char *>(range.data()), range.size());
+    }
+    return true;
+  }
+};
+
+template <class T>
+struct ZKCodec<T,
+               typename std::enable_if<detail::IsProtobufLike<T>::value>::type> {
+  static size_t size(const T &val) { return val.ByteSize(); }
+
+  static void encodeInto(const T &val, folly::IOBuf &out) {
+    const size_t len = size(val);
+    CHECK(out.tailroom() >= len) << "Not enough room to encode value";
+    CHECK(val.SerializeToArray(out.writableTail(), len))
+      << "Failed to serialize message";
+    out.append(len);
+  }
+
+  static std::unique_ptr<folly::IOBuf> encode(const T &val) {
+    auto buf = folly::IOBuf::create(size(val));
+    encodeInto(val, *buf);
+    return buf;
+  }
+
+  static bool decode(const folly::IOBuf &buf, T &out) {
+    return detail::withContiguous(
+      buf, [&out](const uint8_t *data, size_t len) {
+        return len <= std::numeric_limits<int>::max()
+               && out.ParseFromArray(data, static_cast<int>(len));
+      });
+  }
+};
+}
@@ -0,0 +1,206 @@
+#include "bolt/zookeeper/ZKHedgedReader.hpp"
+#include <algorithm>
+#include <vector>
+#include <folly/String.h>
+
+namespace bolt {
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+
+// One read in flight on one or both sessions.
+struct ZKHedgedReader::Race {
+  explicit Race(Read r) : read(std::move(r)) {}
+
+  const Read read;
+  Promise<ZKResult> promise;
+  std::mutex lock;
+  bool done{false};
+  bool hedged{false};
+  // sides issued and not back yet
+  int pending{1};
+  // the hedge delay, cancelled once the race is decided
+  Future<Unit> timer{makeFuture()};
+};
+
+// Connection trouble, the other session may well do better. Any other
+// answer - ZNONODE included - is the answer.
+static bool failed(const Try<ZKResult> &t) {
+  return !t.hasValue() || ZKClient::retryable(t.value().result);
+}
+
+std::shared_ptr<ZKHedgedReader>
+ZKHedgedReader::create(std::shared_ptr<ZKClient> primary,
+                       std::shared_ptr<ZKClient> secondary,
+                       ZKHedgeOptions opts) {
+  CHECK(primary != secondary) << "Hedging on the same session";
+  return std::shared_ptr<ZKHedgedReader>(
+    new ZKHedgedReader(std::move(primary), std::move(secondary), opts));
+}
+
+std::shared_ptr<ZKHedgedReader>
+ZKHedgedReader::create(std::shared_ptr<ZKClient> primary,
+                       ZKHedgeOptions opts) {
+  const auto server = primary->health().server;
+  std::vector<std::string> hosts, others;
+  folly::split(',', primary->hosts(), hosts);
+  for(auto &h : hosts) {
+    if(h != server) {
+      others.push_back(h);
+    }
+  }
+  if(others.empty()) {
+    others = hosts;
+  }
+  auto secondary = std::make_shared<ZKClient>(
+    [](int, int, std::string, ZKClient *) {}, folly::join(',', others),
+    primary->timeout(), primary->flags(), false);
+  return create(std::move(primary), std::move(secondary), opts);
+}
+
+ZKHedgedReader::ZKHedgedReader(std::shared_ptr<ZKClient> primary,
+                               std::shared_ptr<ZKClient> secondary,
+                               ZKHedgeOptions opts)
+  : primary_(std::move(primary))
+  , secondary_(std::move(secondary))
+  , opts_(opts)
+  , delayUs_(opts.initialDelay.count())
+  , latencies_(100, 0, std::max<int64_t>(opts.maxDelay.count(), 100)) {}
+
+Future<ZKResult> ZKHedgedReader::get(std::string path) {
+  return hedge([path](ZKClient &zk, ZKConsistency c) {
+    return zk.get(path, false, c);
+  });
+}
+
+Future<ZKResult> ZKHedgedReader::children(std::string path) {
+  return hedge([path](ZKClient &zk, ZKConsistency c) {
+    return zk.children(path, false, c);
+  });
+}
+
+Future<ZKResult> ZKHedgedReader::exists(std::string path) {
+  return hedge([path](ZKClient &zk, ZKConsistency c) {
+    return zk.exists(path, false, c);
+  });
+}
+
+ZKHedgeStats ZKHedgedReader::stats() const {
+  ZKHedgeStats ret;
+  ret.reads = reads_;
+  ret.hedged = hedged_;
+  ret.hedgeWins = hedgeWins_;
+  ret.delay = microseconds(delayUs_.load());
+  return ret;
+}
+
+std::shared_ptr<ZKClient> ZKHedgedReader::primary() const { return primary_; }
+
+std::shared_ptr<ZKClient> ZKHedgedReader::secondary() const {
+  return secondary_;
+}
+
+Future<ZKResult> ZKHedgedReader::hedge(Read read) {
+  reads_++;
+  auto self = shared_from_this();
+  auto race = std::make_shared<Race>(std::move(read));
+  auto f = race->promise.getFuture();
+  const auto start = steady_clock::now();
+  race->read(*primary_, ZKConsistency::kSequential)
+    .then([self, race, start](Try<ZKResult> &&t) {
+      if(!failed(t)) {
+        self->sample(std::chrono::duration_cast<microseconds>(
+          steady_clock::now() - start));
+      }
+      self->finish(race, std::move(t), false);
+    });
+  {
+    std::lock_guard<std::mutex> lock(race->lock);
+    if(race->done) {
+      // answered inline, typically not connected
+      return f;
+    }
+  }
+  auto timer =
+    folly::futures::sleep(microseconds(delayUs_.load())).then([self, race] {
+      self->issueHedge(race);
+    });
+  bool done;
+  {
+    std::lock_guard<std::mutex> lock(race->lock);
+    done = race->done;
+    if(!done) {
+      race->timer = std::move(timer);
+    }
+  }
+  if(done) {
+    timer.cancel();
+  }
+  return f;
+}
+
+void ZKHedgedReader::issueHedge(std::shared_ptr<Race> race) {
+  {
+    std::lock_guard<std::mutex> lock(race->lock);
+    if(race->done || race->hedged) {
+      return;
+    }
+    race->hedged = true;
+    race->pending++;
+  }
+  hedged_++;
+  auto self = shared_from_this();
+  const auto consistency = opts_.syncSecondary ? ZKConsistency::kLinearizable
+                                                : ZKConsistency::kSequential;
+  race->read(*secondary_, consistency)
+    .then([self, race](Try<ZKResult> &&t) {
+      self->finish(race, std::move(t), true);
+    });
+}
+
+void ZKHedgedReader::finish(std::shared_ptr<Race> race,
+                            Try<ZKResult> &&t,
+                            bool fromHedge) {
+  const bool fail = failed(t);
+  bool hedgeNow;
+  Future<Unit> timer = makeFuture();
+  {
+    std::lock_guard<std::mutex> lock(race->lock);
+    race->pending--;
+    if(race->done) {
+      return;
+    }
+    if(fail && race->pending > 0) {
+      // the other side may still answer
+      return;
+    }
+    // no need to wait out the delay behind a primary known to be in trouble
+    hedgeNow = fail && !race->hedged;
+    race->done = !hedgeNow;
+    if(race->done) {
+      timer = std::move(race->timer);
+    }
+  }
+  // drops the timer's callback, and its references, from the timekeeper
+  timer.cancel();
+  if(hedgeNow) {
+    issueHedge(race);
+    return;
+  }
+  if(fromHedge && !fail) {
+    hedgeWins_++;
+  }
+  race->promise.setTry(std::move(t));
+}
+
+void ZKHedgedReader::sample(microseconds latency) {
+  std::lock_guard<std::mutex> lock(lock_);
+  latencies_.addValue(latency.count());
+  if(++samples_ < opts_.window) {
+    return;
+  }
+  auto delay = microseconds(latencies_.getPercentileEstimate(opts_.percentile));
+  delayUs_ = std::min(std::max(delay, opts_.minDelay), opts_.maxDelay).count();
+  latencies_.clear();
+  samples_ = 0;
+}
+}
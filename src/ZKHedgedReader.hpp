@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <folly/futures/Future.h>
+#include <folly/stats/Histogram.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+
+namespace bolt {
+struct ZKHedgeOptions {
+  // hedge reads slower than this percentile of recent primary latencies
+  double percentile{0.99};
+  // primary reads per percentile update, the window then starts over
+  size_t window{1024};
+  // until the first window is full
+  std::chrono::microseconds initialDelay{10000};
+  // bounds on the hedge delay: no hedging every other read on a fast, tight
+  // distribution, no waiting forever behind a stuck server
+  std::chrono::microseconds minDelay{1000};
+  std::chrono::microseconds maxDelay{100000};
+  // sync() the secondary before a hedge, see ZKHedgedReader
+  bool syncSecondary{false};
+};
+
+struct ZKHedgeStats {
+  uint64_t reads{0};
+  // reads reissued on the secondary session
+  uint64_t hedged{0};
+  // hedged reads answered by the secondary first
+  uint64_t hedgeWins{0};
+  std::chrono::microseconds delay{0};
+
+  double hedgeRate() const { return reads ? double(hedged) / reads : 0; }
+};
+
+// Hedged reads over two sessions, ideally on different servers.
+//
+// A read goes to the primary session. If it has not completed after the
+// hedge delay - a percentile of the primary's recent latencies - it is
+// issued again on the secondary, and whichever answer comes first wins.
+// A connection error on one side waits for the other. Cuts the tail a
+// single server adds (GC pauses, a slow disk), for at most
+// 1 - percentile extra reads.
+//
+// ZooKeeper only orders reads after writes within a session: a hedge
+// answered by the secondary may miss a write made on the primary, ours
+// included, and read an older value. With syncSecondary the hedge syncs
+// the secondary first (a linearizable read, one more round trip on the
+// hedge only) and sees every write completed before the read was issued.
+//
+// Only reads: writes, watches and ephemerals stay on the primary.
+// Hold it in a shared_ptr (see create()): pending reads keep it alive.
+class ZKHedgedReader : public std::enable_shared_from_this<ZKHedgedReader> {
+  public:
+  static std::shared_ptr<ZKHedgedReader>
+  create(std::shared_ptr<ZKClient> primary,
+         std::shared_ptr<ZKClient> secondary,
+         ZKHedgeOptions opts = ZKHedgeOptions());
+
+  // Opens the secondary session on primary's hosts minus the server the
+  // primary is connected to. Best effort: hosts given by name can't be
+  // matched against it, the secondary may then pick the same server.
+  static std::shared_ptr<ZKHedgedReader>
+  create(std::shared_ptr<ZKClient> primary,
+         ZKHedgeOptions opts = ZKHedgeOptions());
+
+  Future<ZKResult> get(std::string path);
+  Future<ZKResult> children(std::string path);
+  Future<ZKResult> exists(std::string path);
+
+  ZKHedgeStats stats() const;
+  std::shared_ptr<ZKClient> primary() const;
+  std::shared_ptr<ZKClient> secondary() const;
+
+  private:
+  ZKHedgedReader(std::shared_ptr<ZKClient> primary,
+                 std::shared_ptr<ZKClient> secondary,
+                 ZKHedgeOptions opts);
+  typedef std::function<Future<ZKResult>(ZKClient &, ZKConsistency)> Read;
+  struct Race;
+  Future<ZKResult> hedge(Read read);
+  void issueHedge(std::shared_ptr<Race> race);
+  void finish(std::shared_ptr<Race> race, Try<ZKResult> &&t, bool fromHedge);
+  void sample(std::chrono::microseconds latency);
+
+  const std::shared_ptr<ZKClient> primary_;
+  const std::shared_ptr<ZKClient> secondary_;
+  const ZKHedgeOptions opts_;
+
+  std::atomic<int64_t> delayUs_;
+  std::atomic<uint64_t> reads_{0};
+  std::atomic<uint64_t> hedged_{0};
+  std::atomic<uint64_t> hedgeWins_{0};
+
+  mutable std::mutex lock_;
+  // 100us buckets up to maxDelay
+  folly::Histogram<int64_t> latencies_;
+  size_t samples_{0};
+};
+}
@@ -1,6 +1,8 @@
-#include <boost/regex.hpp>
+#include <algorithm>
+#include <limits>
 #include <boost/algorithm/string.hpp>
 #include "bolt/zookeeper/ZKLeader.hpp"
+#include "bolt/zookeeper/zookeeper_utils.hpp"
 #include "bolt/utils/url_utils.hpp"
 #include "bolt/utils/string_utils.hpp"
 
@@ -13,15 +15,73 @@ std::shared_ptr<ZKClient> ZKLeader::client() const { return zk_; }
 ZKLeader::ZKLeader(folly::Uri zkUri,
                    std::function<void(ZKLeader *)> leaderfn,
                    std::function<void(int, int, std::string, ZKClient *)> zkcb)
-  : zkUri_(zkUri), leadercb_(leaderfn), zkcb_(zkcb) {
-  using namespace std::placeholders;
-  auto cb = std::bind(&ZKLeader::zkCbWrapper, this, _1, _2, _3, _4);
-  const auto baseElectionPath = zkUri_.path().toStdString() + "/election";
-  const auto baseElectionId = baseElectionPath + "/" + uuid() + "_n_";
-  zk_ = std::make_shared<ZKClient>(cb, zookeeperHostsFromUrl(zkUri_), 500, 0,
-                                   true /*yield until connected*/);
+  : ZKLeader(zkUri, leaderfn, [](ZKLeader *) {}, zkcb) {}
+
+ZKLeader::ZKLeader(folly::Uri zkUri,
+                   std::function<void(ZKLeader *)> leaderfn,
+                   std::function<void(ZKLeader *)> lostfn,
+                   std::function<void(int, int, std::string, ZKClient *)> zkcb)
+  : ZKLeader(std::make_shared<ZKClient>(zkcb, zookeeperHostsFromUrl(zkUri),
+                                        500, 0,
+                                        true /*yield until connected*/),
+             true,
+             zkUri,
+             leaderfn,
+             lostfn,
+             zkcb) {
+  startSync();
+}
+
+ZKLeader::ZKLeader(std::shared_ptr<ZKClient> zk,
+                   folly::Uri zkUri,
+                   std::function<void(ZKLeader *)> leaderfn,
+                   std::function<void(ZKLeader *)> lostfn,
+                   std::function<void(int, int, std::string, ZKClient *)> zkcb)
+  : ZKLeader(std::move(zk), false, zkUri, leaderfn, lostfn, zkcb) {
+  startSync();
+}
+
+Future<std::shared_ptr<ZKLeader>> ZKLeader::create(
+  std::shared_ptr<ZKClient> zk,
+  folly::Uri zkUri,
+  std::function<void(ZKLeader *)> leaderfn,
+  std::function<void(ZKLeader *)> lostfn,
+  std::function<void(int, int, std::string, ZKClient *)> zkcb) {
+  return start(std::shared_ptr<ZKLeader>(
+    new ZKLeader(std::move(zk), false, zkUri, leaderfn, lostfn, zkcb)));
+}
+
+Future<std::shared_ptr<ZKLeader>> ZKLeader::create(
+  folly::Uri zkUri,
+  std::function<void(ZKLeader *)> leaderfn,
+  std::function<void(ZKLeader *)> lostfn,
+  std::function<void(int, int, std::string, ZKClient *)> zkcb) {
+  auto zk = std::make_shared<ZKClient>(zkcb, zookeeperHostsFromUrl(zkUri), 500,
+                                       0, false /*see connected()*/);
+  return start(std::shared_ptr<ZKLeader>(
+    new ZKLeader(std::move(zk), true, zkUri, leaderfn, lostfn, zkcb)));
+}
+
+ZKLeader::ZKLeader(std::shared_ptr<ZKClient> zk,
+                   bool ownsClient,
+                   folly::Uri zkUri,
+                   std::function<void(ZKLeader *)> leaderfn,
+                   std::function<void(ZKLeader *)> lostfn,
+                   std::function<void(int, int, std::string, ZKClient *)> zkcb)
+  : zkUri_(zkUri)
+  , leadercb_(leaderfn)
+  , lostcb_(lostfn)
+  , zkcb_(zkcb)
+  , guard_(std::make_shared<Guard>())
+  , zk_(std::move(zk))
+  , ownsClient_(ownsClient) {
+  guard_->leader = this;
+}
+
+void ZKLeader::startSync() {
+  const auto baseElectionPath = electionDir();
   LOG(INFO) << "Watching: " << baseElectionPath;
-  auto zkret = zk_->existsSync(baseElectionPath, true);
+  auto zkret = zk_->existsSync(baseElectionPath);
 
   if(zkret.result == ZNONODE) {
     touchZKPathSync(baseElectionPath);
@@ -30,19 +90,321 @@ ZKLeader::ZKLeader(folly::Uri zkUri,
       << "Failed to watch the directory ret code: " << zkret.result;
   }
 
+  CHECK(registerCandidate() == ZOK)
+    << "Couldn't register for election in " << baseElectionPath;
+  joined_ = true;
+  listen();
+  leaderElect(0, 0, "");
+}
+
+Future<std::shared_ptr<ZKLeader>>
+ZKLeader::start(std::shared_ptr<ZKLeader> leader) {
+  auto zk = leader->zk_;
+  const auto dir = leader->electionDir();
+  // before our node exists, so an expiry from here on is seen
+  leader->listen();
+  return zk->connected()
+    .then([zk, dir] { return touchPath(zk, dir); })
+    .then([leader, dir](int rc) {
+      if(rc != ZOK) {
+        throw std::runtime_error("Failed to create election path: " + dir
+                                 + ", ret: " + std::to_string(rc));
+      }
+      return join(leader);
+    })
+    .then([leader] {
+      leader->electionWatchArmed_ = true;
+      return leader->zk_->wchildren(leader->electionDir(),
+                                    leader->electionWatcher());
+    })
+    .then([leader](ZKResult &&r) {
+      std::lock_guard<std::recursive_mutex> lock(leader->guard_->lock);
+      if(r.result != ZOK) {
+        leader->electionWatchArmed_ = false;
+      }
+      leader->tally(r, "");
+      return leader;
+    });
+}
+
+Future<Unit> ZKLeader::join(std::shared_ptr<ZKLeader> leader) {
+  return leader->zk_
+    ->create(leader->electionDir() + "/" + uuid() + "_n_",
+             std::make_unique<IOBuf>(), &ZOO_OPEN_ACL_UNSAFE,
+             ZOO_SEQUENCE | ZOO_EPHEMERAL)
+    .then([leader](ZKResult &&r) {
+      if(!r.ok() || !r.buff) {
+        throw std::runtime_error("Couldn't create election node, ret: "
+                                 + std::to_string(r.result));
+      }
+      return settle(leader, std::string((char *)r.data(), r.buff->length()));
+    });
+}
+
+Future<Unit> ZKLeader::settle(std::shared_ptr<ZKLeader> leader,
+                              std::string path) {
+  {
+    std::lock_guard<std::recursive_mutex> lock(leader->guard_->lock);
+    auto it = leader->startRenames_.find(path);
+    if(it != leader->startRenames_.end()) {
+      // recreated under a new name by recovery, or not at all
+      path = it->second;
+      leader->startRenames_.erase(it);
+    }
+  }
+  if(path.empty()) {
+    return join(leader);
+  }
+  return leader->zk_->exists(path).then(
+    [leader, path](ZKResult &&r) -> Future<Unit> {
+      std::lock_guard<std::recursive_mutex> lock(leader->guard_->lock);
+      if(leader->startRenames_.count(path)) {
+        // expired after the stat was served
+        return settle(leader, path);
+      }
+      if(r.result == ZNONODE) {
+        // gone with its session before recovery knew about it
+        return join(leader);
+      }
+      if(r.result != ZOK || !r.status) {
+        throw std::runtime_error("Couldn't stat election node: " + path
+                                 + ", ret: " + std::to_string(r.result));
+      }
+      leader->setEphemeralPath(path);
+      leader->fencingToken_ = r.status->czxid;
+      leader->joined_ = true;
+      return makeFuture();
+    });
+}
+
+Future<int> ZKLeader::touchPath(std::shared_ptr<ZKClient> zk,
+                                const std::string &nestedPath) {
+  std::vector<std::string> paths;
+  boost::split(paths, nestedPath, boost::is_any_of("/"));
+  auto f = makeFuture<int>(ZOK);
+  std::string path = "";
+  for(auto &p : paths) {
+    if(p.empty()) {
+      continue;
+    }
+    path += "/" + p;
+    f = std::move(f).then([zk, path](int rc) {
+      if(rc != ZOK) {
+        return makeFuture(rc);
+      }
+      return zk->exists(path).then([zk, path](ZKResult &&r) {
+        if(r.result != ZNONODE) {
+          return makeFuture(r.result);
+        }
+        return zk->create(path, std::make_unique<IOBuf>(),
+                          &ZOO_OPEN_ACL_UNSAFE, 0)
+          .then([](ZKResult &&r) {
+            // lost a race with another candidate, fine
+            return r.result == ZNODEEXISTS ? ZOK : r.result;
+          });
+      });
+    });
+  }
+  return f;
+}
+
+void ZKLeader::listen() {
+  auto guard = guard_;
+  sessionListenerId_ = zk_->addSessionListener(
+    [guard](int, int state, std::string, ZKClient *cli) {
+      std::lock_guard<std::recursive_mutex> lock(guard->lock);
+      if(guard->leader) {
+        guard->leader->sessionEvent(state, cli);
+      }
+    });
+  recoveredCbId_ = zk_->addSessionRecoveredCb(
+    [guard](ZKClient *, const std::map<std::string, std::string> &renamed) {
+      std::lock_guard<std::recursive_mutex> lock(guard->lock);
+      if(guard->leader) {
+        guard->leader->sessionRecovered(renamed);
+      }
+    });
+  listening_ = true;
+}
+
+ZKLeader::~ZKLeader() {
+  {
+    std::lock_guard<std::recursive_mutex> lock(guard_->lock);
+    guard_->leader = nullptr;
+  }
+  if(listening_) {
+    zk_->removeSessionListener(sessionListenerId_);
+    zk_->removeSessionRecoveredCb(recoveredCbId_);
+  }
+  if(!ownsClient_ && !electionPath_.empty() && zk_->ready) {
+    // don't hold up the election until the shared session goes away
+    zk_->del(electionPath_);
+  }
+}
+
+std::string ZKLeader::electionDir() const {
+  return zkUri_.path().toStdString() + "/election";
+}
+
+ZKWatchCb ZKLeader::electionWatcher() {
+  auto guard = guard_;
+  return [guard](int type, int state, std::string path, ZKClient *cli) {
+    // the session listener gets those
+    if(type == ZOO_SESSION_EVENT) {
+      return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(guard->lock);
+    if(guard->leader) {
+      guard->leader->electionWatchArmed_ = false;
+      guard->leader->zkCbWrapper(type, state, path, cli);
+    }
+  };
+}
+
+int ZKLeader::registerCandidate() {
+  const auto baseElectionId = electionDir() + "/" + uuid() + "_n_";
   LOG(INFO) << "Creating election node: " << baseElectionId;
-  zkret = zk_->createSync(baseElectionId, std::make_unique<IOBuf>(),
-                          &ZOO_OPEN_ACL_UNSAFE, ZOO_SEQUENCE | ZOO_EPHEMERAL);
-  CHECK(zkret.result == ZOK)
-    << "Couldn't create election path: " << baseElectionId
-    << ", ret: " << zkret.result;
-  std::string ephemeral((char *)zkret.data(), zkret.buff->length());
+  auto zkret =
+    zk_->createSync(baseElectionId, std::make_unique<IOBuf>(),
+                    &ZOO_OPEN_ACL_UNSAFE, ZOO_SEQUENCE | ZOO_EPHEMERAL);
+  if(zkret.result != ZOK || !zkret.buff) {
+    LOG(ERROR) << "Couldn't create election path: " << baseElectionId
+               << ", ret: " << zkret.result;
+    return zkret.result == ZOK ? ZAPIERROR : zkret.result;
+  }
+  return adoptEphemeralPath(
+    std::string((char *)zkret.data(), zkret.buff->length()));
+}
+
+void ZKLeader::setEphemeralPath(std::string ephemeral) {
   LOG(INFO) << "Ephemeral node: " << ephemeral;
   electionPath_ = std::move(ephemeral);
   auto optId = extractIdFromEphemeralPath(electionPath_);
   CHECK(optId) << "Could not parse id from ephemeral path";
   id_ = optId.get();
-  LOG(INFO) << "Leader election id: " << id_;
+}
+
+int ZKLeader::adoptEphemeralPath(std::string ephemeral) {
+  setEphemeralPath(std::move(ephemeral));
+  auto zkret = zk_->existsSync(electionPath_);
+  if(zkret.result != ZOK || !zkret.status) {
+    LOG(ERROR) << "Couldn't stat election path: " << electionPath_
+               << ", ret: " << zkret.result;
+    return zkret.result == ZOK ? ZAPIERROR : zkret.result;
+  }
+  fencingToken_ = zkret.status->czxid;
+  LOG(INFO) << "Leader election id: " << id_
+            << ", fencing token: " << fencingToken_;
+  return ZOK;
+}
+
+void ZKLeader::becomeLeader() {
+  LOG(INFO) << "LEADER! - ONE ID TO RULE THEM ALL: " << id_;
+  auto prev = state_.exchange(State::kLeader);
+  if(prev == State::kFollower) {
+    leadercb_(this);
+  } else if(prev == State::kSuspended) {
+    LOG(INFO) << "Reconnected in time, still leader [MYID: " << id_ << "]";
+  }
+}
+
+void ZKLeader::loseLeadership(const char *reason) {
+  {
+    // cancel any pending step down timer
+    std::lock_guard<std::recursive_mutex> lock(guard_->lock);
+    guard_->epoch++;
+  }
+  if(state_.exchange(State::kFollower) != State::kFollower) {
+    LOG(ERROR) << "Lost leadership [MYID: " << id_ << "]: " << reason;
+    lostcb_(this);
+  }
+}
+
+void ZKLeader::suspend() {
+  auto expected = State::kLeader;
+  if(!state_.compare_exchange_strong(expected, State::kSuspended)) {
+    return;
+  }
+  auto timeout = stepDownTimeout();
+  LOG(ERROR) << "Connection lost, leadership suspended [MYID: " << id_
+             << "], stepping down in " << timeout.count() << "ms";
+  uint64_t epoch;
+  {
+    std::lock_guard<std::recursive_mutex> lock(guard_->lock);
+    epoch = ++guard_->epoch;
+  }
+  folly::futures::sleep(timeout).then([guard = guard_, epoch]() {
+    std::lock_guard<std::recursive_mutex> lock(guard->lock);
+    if(guard->leader && guard->epoch == epoch) {
+      auto leader = guard->leader;
+      auto expected = State::kSuspended;
+      if(leader->state_.compare_exchange_strong(expected, State::kFollower)) {
+        LOG(ERROR) << "Lost leadership [MYID: " << leader->id_
+                   << "]: suspended past the step down timeout";
+        leader->lostcb_(leader);
+      }
+    }
+  });
+}
+
+void ZKLeader::resume() {
+  {
+    std::lock_guard<std::recursive_mutex> lock(guard_->lock);
+    guard_->epoch++;
+  }
+  // the election pass that follows decides whether we are still leader
+}
+
+std::chrono::milliseconds ZKLeader::stepDownTimeout() const {
+  auto ms = stepDownTimeoutMs_.load();
+  if(ms < 0) {
+    ms = zk_->negotiatedTimeout() / 3;
+  }
+  return std::chrono::milliseconds(ms);
+}
+
+void ZKLeader::setStepDownTimeout(std::chrono::milliseconds timeout) {
+  stepDownTimeoutMs_ = timeout.count();
+}
+
+void ZKLeader::sessionRecovered(
+  const std::map<std::string, std::string> &renamed) {
+  // The old session took our election node with it. ZKClient recreated it
+  // (at the back of the queue), so whatever we were, we are a fresh
+  // candidate now.
+  loseLeadership("session expired");
+  // per-call watches are not replayed on the new session
+  electionWatchArmed_ = false;
+  if(!joined_) {
+    // start() is still registering, it looks our node up in these
+    const auto dir = electionDir() + "/";
+    for(auto &r : renamed) {
+      if(r.first.compare(0, dir.size(), dir) == 0) {
+        startRenames_[r.first] = r.second;
+      }
+    }
+    return;
+  }
+  auto it = renamed.find(electionPath_);
+  rejoin(it != renamed.end() ? it->second : "");
+}
+
+void ZKLeader::rejoin(std::string path) {
+  int rc = path.empty() ? ZNONODE : adoptEphemeralPath(std::move(path));
+  if(rc == ZNONODE) {
+    rc = registerCandidate();
+  }
+  if(rc != ZOK) {
+    // electionPath_ is kept when only the stat failed: the node is ours,
+    // the retry adopts it instead of queueing a second one
+    LOG(ERROR) << "Couldn't rejoin the election [MYID: " << id_
+               << "], ret: " << rc << ", retrying once connected";
+    loseLeadership("couldn't rejoin the election");
+    rejoinPending_ = true;
+    id_ = -1;
+    return;
+  }
+  rejoinPending_ = false;
   leaderElect(0, 0, "");
 }
 
@@ -75,12 +437,20 @@ void ZKLeader::touchZKPathSync(const std::string &nestedPath) {
 
 void ZKLeader::leaderElect(int type, int state, std::string path) {
 
-  const std::string baseElectionPath =
-    zkUri_.path().toStdString() + "/election";
+  const std::string baseElectionPath = electionDir();
 
-  auto zkret = zk_->childrenSync(baseElectionPath, true);
+  const bool arm = !electionWatchArmed_.exchange(true);
+  auto zkret = arm ? zk_->wchildrenSync(baseElectionPath, electionWatcher())
+                   : zk_->childrenSync(baseElectionPath);
   auto retcode = zkret.result;
+  if(arm && retcode != ZOK) {
+    electionWatchArmed_ = false;
+  }
+  tally(zkret, path);
+}
 
+void ZKLeader::tally(const ZKResult &zkret, const std::string &path) {
+  const auto retcode = zkret.result;
   if(retcode == -1 || retcode == ZCLOSING || retcode == ZSESSIONEXPIRED) {
     LOG(ERROR) << "Zookeeper not ready|closing|expired socket [MYID: " << id_
                << "] ";
@@ -89,67 +459,107 @@ void ZKLeader::leaderElect(int type, int state, std::string path) {
 
   if(!(retcode == ZOK || retcode == ZNONODE)) {
     LOG(ERROR) << "[MYID " << id_ << "] "
-               << "No children: " << baseElectionPath
+               << "No children: " << electionDir()
                << ", retcode: " << zkret.result;
     return;
   }
 
-  std::set<int32_t> runningLeaders;
-
-  for(auto &s : zkret.strings) {
-    LOG(INFO) << "Running for election: [MYID: " << id_ << "] " << s
+  auto candidates = scanCandidates(zkret.strings, id_);
+  if(VLOG_IS_ON(2)) {
+    for(auto &s : zkret.strings) {
+      VLOG(2) << "Running for election: [MYID: " << id_ << "] " << s
               << ", base path: " << path;
-    runningLeaders.insert(extractIdFromEphemeralPath(s).get());
+    }
+  }
+  // once per change of hands, not once per candidate and notification
+  if(candidates.count > 0 && candidates.lowest != lastLowest_) {
+    LOG(INFO) << "Election [MYID: " << id_ << "]: " << candidates.count
+              << " candidates, lowest id: " << candidates.lowest;
+    lastLowest_ = candidates.lowest;
   }
 
-  if(!runningLeaders.empty()) {
+  if(candidates.count > 0) {
     if(id_ >= 0) {
-      if(runningLeaders.find(id_) == runningLeaders.end()) {
-        CHECK(!isLeader_)
-          << "Cannot be leader and then not leader. Doesn't work. exit";
-        isLeader_ = false;
+      if(!candidates.foundOurs) {
         LOG(ERROR) << "Could not find my id [MYID: " << id_
                    << "]. out of sync w/ zookeeper";
-      } else if(id_ <= *runningLeaders.begin()) {
-        LOG(INFO) << "LEADER! - ONE ID TO RULE THEM ALL: " << id_;
-        if(!isLeader_) {
-          // ONLY CALL ONCE
-          leadercb_(this);
-        }
-        isLeader_ = true;
+        loseLeadership("election node is gone");
+      } else if(id_ <= candidates.lowest) {
+        becomeLeader();
+      } else {
+        loseLeadership("a lower id is running");
       }
     }
   }
 }
 
+void ZKLeader::sessionEvent(int state, ZKClient *cli) {
+  LOG(INFO) << "Session event[MYID: " << id_
+            << "]. state: " << ZKClient::printZookeeperState(state);
+
+  if(state == ZOO_CONNECTING_STATE) {
+    suspend();
+  } else if(state == ZOO_CONNECTED_STATE) {
+    resume();
+    if(rejoinPending_) {
+      rejoin(electionPath_);
+    } else if(id_ >= 0) {
+      leaderElect(ZOO_SESSION_EVENT, state, "");
+    }
+  } else if(state == ZOO_EXPIRED_SESSION_STATE) {
+    // sessionRecovered() re-runs the election once the new session is up
+    loseLeadership("session expired");
+  }
+  // our own client hands session events to zkcb_ directly
+  if(!ownsClient_) {
+    zkcb_(ZOO_SESSION_EVENT, state, "", cli);
+  }
+}
+
 void ZKLeader::zkCbWrapper(int type,
                            int state,
                            std::string path,
                            ZKClient *cli) {
-  LOG(INFO) << "Notification received[MYID: " << id_
-            << "]. type: " << ZKClient::printZookeeperEventType(type)
-            << ", state: " << ZKClient::printZookeeperState(state)
-            << ", path: " << path;
+  // node events can come in at a high rate
+  VLOG(1) << "Notification received[MYID: " << id_
+          << "]. type: " << ZKClient::printZookeeperEventType(type)
+          << ", state: " << ZKClient::printZookeeperState(state)
+          << ", path: " << path;
 
-  if(id_ > 0) {
+  if(id_ >= 0) {
     leaderElect(type, state, path);
   }
   zkcb_(type, state, path, cli);
 }
-bool ZKLeader::isLeader() const { return isLeader_; }
+bool ZKLeader::isLeader() const { return state_ == State::kLeader; }
+ZKLeader::State ZKLeader::state() const { return state_; }
+int64_t ZKLeader::fencingToken() const { return fencingToken_; }
 int32_t ZKLeader::id() const { return id_; }
 std::string ZKLeader::ephemeralPath() const { return electionPath_; }
 boost::optional<int32_t>
 ZKLeader::extractIdFromEphemeralPath(const std::string &path) {
   // zookeeper ephemeral ids are always guaranteed to end in 10
   // monotonically increasing digits by the C api - see zookeeper.h
-  static const boost::regex zkid(".*(\\d{10})$");
-  boost::smatch what;
-
-  if(boost::regex_search(path, what, zkid)) {
-    return std::stoi(what[1].str());
+  auto id = parseSequenceSuffix(path.data(), path.size());
+  if(id < 0 || id > std::numeric_limits<int32_t>::max()) {
+    return boost::none;
   }
+  return int32_t(id);
+}
 
-  return boost::none;
+ZKLeader::Candidates
+ZKLeader::scanCandidates(const std::vector<std::string> &children,
+                         int32_t ourId) {
+  Candidates ret;
+  for(auto &child : children) {
+    auto id = parseSequenceSuffix(child.data(), child.size());
+    if(id < 0 || id > std::numeric_limits<int32_t>::max()) {
+      continue;
+    }
+    ret.count++;
+    ret.lowest = std::min(ret.lowest, int32_t(id));
+    ret.foundOurs |= id == ourId;
+  }
+  return ret;
 }
 }
@@ -2,37 +2,166 @@
 #include <memory>
 #include <boost/optional.hpp>
 #include <atomic>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <vector>
+#include <mutex>
 #include <folly/Uri.h>
 #include "bolt/zookeeper/ZKClient.hpp"
 namespace bolt {
 class ZKLeader {
   public:
+  // kSuspended: we were leader and lost the connection. The session (and so
+  // our election node) may still be alive; act as if we were not leader
+  // until we reconnect, or step down for good once stepDownTimeout() passes.
+  enum class State { kFollower, kLeader, kSuspended };
+
   // utility functions
   static boost::optional<int32_t>
   extractIdFromEphemeralPath(const std::string &path);
 
+  // One pass over an election listing, no set built: the lowest id and
+  // whether ourId is running. Names without an id are skipped.
+  struct Candidates {
+    size_t count{0};
+    int32_t lowest{std::numeric_limits<int32_t>::max()};
+    bool foundOurs{false};
+  };
+  static Candidates scanCandidates(const std::vector<std::string> &children,
+                                   int32_t ourId);
+  // Creates the missing persistent nodes along nestedPath. ZOK once they
+  // all exist, lost races with other creators included.
+  static Future<int> touchPath(std::shared_ptr<ZKClient> zk,
+                               const std::string &nestedPath);
+
   // Note that this is a very simple leader election.
   // it is prone to the herd effect. Since our scheduler list will be small
   // this is considered OK behavior.
   ZKLeader(folly::Uri zkUri,
            std::function<void(ZKLeader *)> leaderfn,
            std::function<void(int, int, std::string, ZKClient *)> zkcb);
+
+  // lostfn is called when we stop being leader: our node is gone, the
+  // session expired or we were suspended for longer than stepDownTimeout().
+  // It may be followed by leaderfn again if we win a later election.
+  ZKLeader(folly::Uri zkUri,
+           std::function<void(ZKLeader *)> leaderfn,
+           std::function<void(ZKLeader *)> lostfn,
+           std::function<void(int, int, std::string, ZKClient *)> zkcb);
+  // Runs the election on a session shared with other elections and recipes,
+  // instead of opening one per leader. Election watches are routed to this
+  // instance only, the client's own watch callback never sees them; zkcb
+  // gets the election and session events. Our election node is deleted when
+  // we are destroyed, the session may live on for a long time.
+  ZKLeader(std::shared_ptr<ZKClient> zk,
+           folly::Uri zkUri,
+           std::function<void(ZKLeader *)> leaderfn,
+           std::function<void(ZKLeader *)> lostfn,
+           std::function<void(int, int, std::string, ZKClient *)> zkcb);
+  ~ZKLeader();
+
+  // The constructors block until connected, registered and through a first
+  // election pass. These do the same without blocking, so many elections
+  // can come up at once. Fail if the election node can't be created.
+  static Future<std::shared_ptr<ZKLeader>>
+  create(std::shared_ptr<ZKClient> zk,
+         folly::Uri zkUri,
+         std::function<void(ZKLeader *)> leaderfn,
+         std::function<void(ZKLeader *)> lostfn,
+         std::function<void(int, int, std::string, ZKClient *)> zkcb);
+  // opens its own session, without waiting for it
+  static Future<std::shared_ptr<ZKLeader>>
+  create(folly::Uri zkUri,
+         std::function<void(ZKLeader *)> leaderfn,
+         std::function<void(ZKLeader *)> lostfn,
+         std::function<void(int, int, std::string, ZKClient *)> zkcb);
+
   bool isLeader() const;
+  State state() const;
+  // czxid of our election node. Strictly greater than the token of any
+  // previous leader of this election; pass it along with writes so the
+  // downstream can reject a stale leader.
+  int64_t fencingToken() const;
+  // Defaults to a third of the negotiated session timeout: by the time the
+  // client reports the connection lost, the server may be that close to
+  // expiring the session and electing someone else.
+  std::chrono::milliseconds stepDownTimeout() const;
+  void setStepDownTimeout(std::chrono::milliseconds timeout);
   int32_t id() const;
   std::string ephemeralPath() const;
   const folly::Uri &uri() const;
   std::shared_ptr<ZKClient> client() const;
 
   private:
+  ZKLeader(std::shared_ptr<ZKClient> zk,
+           bool ownsClient,
+           folly::Uri zkUri,
+           std::function<void(ZKLeader *)> leaderfn,
+           std::function<void(ZKLeader *)> lostfn,
+           std::function<void(int, int, std::string, ZKClient *)> zkcb);
+  static Future<std::shared_ptr<ZKLeader>>
+  start(std::shared_ptr<ZKLeader> leader);
+  // start()'s registration: creates our node, then settles on it
+  static Future<Unit> join(std::shared_ptr<ZKLeader> leader);
+  // stats `path`, following renames from an expiry meanwhile
+  static Future<Unit> settle(std::shared_ptr<ZKLeader> leader,
+                             std::string path);
+  void startSync();
+  void listen();
+  std::string electionDir() const;
+  ZKWatchCb electionWatcher();
+  void sessionEvent(int state, ZKClient *);
   void zkCbWrapper(int type, int state, std::string path, ZKClient *);
   void touchZKPathSync(const std::string &path);
   void leaderElect(int type, int state, std::string path);
+  void tally(const ZKResult &zkret, const std::string &path);
+  // ZOK, or the error of the create or the stat
+  int registerCandidate();
+  void sessionRecovered(const std::map<std::string, std::string> &renamed);
+  // Back in the election after an expiry, on `path` if it survived. A
+  // failure leaves us out of it until the next connected event.
+  void rejoin(std::string path);
+  void setEphemeralPath(std::string path);
+  int adoptEphemeralPath(std::string path);
+  void becomeLeader();
+  void loseLeadership(const char *reason);
+  void suspend();
+  void resume();
+
+  // outlives us in pending step down timers and in the callbacks we leave
+  // behind on the client. Held while calling into the leader.
+  struct Guard {
+    std::recursive_mutex lock;
+    ZKLeader *leader;
+    // bumped to cancel pending step down timers
+    uint64_t epoch{0};
+  };
+
   folly::Uri zkUri_;
   std::function<void(ZKLeader *)> leadercb_;
+  std::function<void(ZKLeader *)> lostcb_;
   std::function<void(int, int, std::string, ZKClient *)> zkcb_;
-  std::atomic<bool> isLeader_{false};
+  std::atomic<State> state_{State::kFollower};
+  std::atomic<int64_t> fencingToken_{-1};
+  std::atomic<int64_t> stepDownTimeoutMs_{-1};
+  std::shared_ptr<Guard> guard_;
   int32_t id_{-1};
+  // lowest id seen by the last election pass, for logging
+  int32_t lastLowest_{-1};
   std::shared_ptr<ZKClient> zk_;
+  const bool ownsClient_;
+  uint64_t sessionListenerId_{0};
+  uint64_t recoveredCbId_{0};
+  bool listening_{false};
+  // rejoin() failed, retried once connected
+  bool rejoinPending_{false};
+  // registered: until then start() handles session recovery, with the
+  // renames of our election nodes kept here
+  bool joined_{false};
+  std::map<std::string, std::string> startRenames_;
+  // one pending election watch at most, however many passes we run
+  std::atomic<bool> electionWatchArmed_{false};
   std::string electionPath_;
 };
 }
@@ -0,0 +1,442 @@
+#include "bolt/zookeeper/ZKPartitioner.hpp"
+#include <algorithm>
+#include <folly/hash/Hash.h>
+#include "bolt/zookeeper/ZKLeader.hpp"
+
+namespace bolt {
+// back off while disconnected
+static const std::chrono::milliseconds kRetryDelay(50);
+
+Future<std::shared_ptr<ZKPartitioner>>
+ZKPartitioner::create(std::shared_ptr<ZKClient> zk,
+                      std::string root,
+                      std::string member,
+                      std::vector<std::string> shards,
+                      GainedCb gained,
+                      LostCb lost) {
+  CHECK(member.find('/') == std::string::npos) << "Bad member: " << member;
+  for(auto &s : shards) {
+    CHECK(s.find('/') == std::string::npos) << "Bad shard: " << s;
+  }
+  return start(std::shared_ptr<ZKPartitioner>(
+    new ZKPartitioner(std::move(zk), std::move(root), std::move(member),
+                      std::move(shards), std::move(gained), std::move(lost))));
+}
+
+ZKPartitioner::ZKPartitioner(std::shared_ptr<ZKClient> zk,
+                             std::string root,
+                             std::string member,
+                             std::vector<std::string> shards,
+                             GainedCb gained,
+                             LostCb lost)
+  : zk_(std::move(zk))
+  , root_(std::move(root))
+  , member_(std::move(member))
+  , shards_(std::move(shards))
+  , gained_(std::move(gained))
+  , lost_(std::move(lost)) {}
+
+ZKPartitioner::~ZKPartitioner() {
+  // detached first: the other callbacks only hold weak pointers to us
+  zk_->removeSessionRecoveredCb(recoveredCbId_);
+  std::set<std::string> owned;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(left_) {
+      return;
+    }
+    left_ = true;
+    owned.swap(owned_);
+  }
+  // no handoff, whoever is next takes over right away
+  for(auto &s : owned) {
+    zk_->del(ownerPath(s));
+  }
+  zk_->del(membersDir() + "/" + member_);
+}
+
+Future<std::shared_ptr<ZKPartitioner>>
+ZKPartitioner::start(std::shared_ptr<ZKPartitioner> p) {
+  return p->zk_->connected()
+    .then([p] { return ZKLeader::touchPath(p->zk_, p->root_ + "/owners"); })
+    .then([p](int rc) {
+      if(rc != ZOK) {
+        throw std::runtime_error("Failed to create " + p->root_
+                                 + "/owners, ret: " + std::to_string(rc));
+      }
+      return ZKLeader::touchPath(p->zk_, p->membersDir());
+    })
+    .then([p](int rc) {
+      if(rc != ZOK) {
+        throw std::runtime_error("Failed to create " + p->membersDir()
+                                 + ", ret: " + std::to_string(rc));
+      }
+      return p->zk_->create(p->membersDir() + "/" + p->member_,
+                            std::make_unique<IOBuf>(), &ZOO_OPEN_ACL_UNSAFE,
+                            ZOO_EPHEMERAL);
+    })
+    .then([p](ZKResult &&r) {
+      if(r.result != ZOK) {
+        throw std::runtime_error("Couldn't join " + p->root_ + " as "
+                                 + p->member_ + ", ret: "
+                                 + std::to_string(r.result));
+      }
+      std::weak_ptr<ZKPartitioner> weak = p;
+      p->recoveredCbId_ = p->zk_->addSessionRecoveredCb(
+        [weak](ZKClient *, const std::map<std::string, std::string> &renamed) {
+          if(auto self = weak.lock()) {
+            self->sessionRecovered(renamed);
+          }
+        });
+      p->watchMembers();
+      return p;
+    });
+}
+
+std::string
+ZKPartitioner::rendezvousOwner(const std::string &shard,
+                               const std::vector<std::string> &members) {
+  const uint64_t shardHash = folly::hash::fnv64(shard);
+  const std::string *best = nullptr;
+  uint64_t bestScore = 0;
+  for(auto &m : members) {
+    auto score = folly::hash::hash_128_to_64(shardHash, folly::hash::fnv64(m));
+    if(!best || score > bestScore || (score == bestScore && m < *best)) {
+      best = &m;
+      bestScore = score;
+    }
+  }
+  return best ? *best : "";
+}
+
+const std::string &ZKPartitioner::member() const { return member_; }
+
+std::set<std::string> ZKPartitioner::owned() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return owned_;
+}
+
+std::vector<std::string> ZKPartitioner::members() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return members_;
+}
+
+std::map<std::string, std::string> ZKPartitioner::assignment() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::map<std::string, std::string> ret;
+  for(auto &s : shards_) {
+    ret[s] = rendezvousOwner(s, members_);
+  }
+  return ret;
+}
+
+uint64_t ZKPartitioner::rebalances() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return rebalances_;
+}
+
+std::string ZKPartitioner::membersDir() const { return root_ + "/members"; }
+
+std::string ZKPartitioner::ownerPath(const std::string &shard) const {
+  return root_ + "/owners/" + shard;
+}
+
+bool ZKPartitioner::wants(const std::string &shard) const {
+  return !left_ && rendezvousOwner(shard, members_) == member_;
+}
+
+void ZKPartitioner::watchMembers() {
+  std::weak_ptr<ZKPartitioner> weak = shared_from_this();
+  zk_->wchildren(membersDir(),
+                 [weak](int type, int, std::string, ZKClient *) {
+                   if(type == ZOO_SESSION_EVENT) {
+                     return;
+                   }
+                   if(auto self = weak.lock()) {
+                     self->watchMembers();
+                   }
+                 })
+    .then([weak](Try<ZKResult> &&t) {
+      auto self = weak.lock();
+      if(!self) {
+        return;
+      }
+      if(t.hasValue() && t.value().result == ZOK) {
+        self->rebalance(std::move(t.value().strings));
+        return;
+      }
+      // not armed, nobody else will call us
+      folly::futures::sleep(kRetryDelay).then([weak] {
+        if(auto self = weak.lock()) {
+          self->watchMembers();
+        }
+      });
+    });
+}
+
+void ZKPartitioner::rebalance(std::vector<std::string> members) {
+  std::sort(members.begin(), members.end());
+  std::vector<std::string> moved;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(left_) {
+      return;
+    }
+    members_ = members;
+    rebalances_++;
+    for(auto &s : owned_) {
+      if(!wants(s)) {
+        moved.push_back(s);
+      }
+    }
+  }
+  VLOG(1) << member_ << " rebalancing " << root_ << " over " << members.size()
+          << " members, handing off " << moved.size() << " shards";
+  for(auto &s : moved) {
+    release(s);
+  }
+  for(auto &s : shards_) {
+    acquire(s);
+  }
+  if(!members.empty() && members.front() == member_) {
+    publish(members);
+  }
+}
+
+void ZKPartitioner::acquire(const std::string &shard) {
+  uint64_t attempt;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(!wants(shard) || owned_.count(shard) || acquiring_.count(shard)
+       || releasing_.count(shard)) {
+      return;
+    }
+    attempt = nextAttempt_++;
+    acquiring_[shard] = attempt;
+  }
+  auto self = shared_from_this();
+  zk_->create(ownerPath(shard), IOBuf::copyBuffer(member_),
+              &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL)
+    .then([self, shard, attempt](Try<ZKResult> &&t) {
+      self->acquired(shard, attempt, t.hasValue() ? std::move(t.value())
+                                                  : ZKResult(ZCONNECTIONLOSS));
+    });
+}
+
+void ZKPartitioner::acquired(const std::string &shard,
+                             uint64_t attempt,
+                             ZKResult &&r) {
+  if(r.result == ZNODEEXISTS) {
+    waitForOwner(shard, attempt);
+    return;
+  }
+  if(r.result != ZOK) {
+    std::weak_ptr<ZKPartitioner> weak = shared_from_this();
+    folly::futures::sleep(kRetryDelay).then([weak, shard, attempt] {
+      if(auto self = weak.lock()) {
+        self->retry(shard, attempt);
+      }
+    });
+    return;
+  }
+  bool gained = false;
+  bool orphaned = false;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = acquiring_.find(shard);
+    if(it != acquiring_.end() && it->second == attempt) {
+      acquiring_.erase(it);
+      gained = wants(shard);
+      if(gained) {
+        owned_.insert(shard);
+      }
+    }
+    // a newer attempt adopts the node, otherwise nobody wants it
+    orphaned = !gained && !owned_.count(shard) && !acquiring_.count(shard);
+  }
+  if(gained) {
+    VLOG(1) << member_ << " gained " << root_ << " shard " << shard;
+    gained_(shard);
+  } else if(orphaned) {
+    zk_->del(ownerPath(shard));
+  }
+}
+
+void ZKPartitioner::waitForOwner(const std::string &shard, uint64_t attempt) {
+  std::weak_ptr<ZKPartitioner> weak = shared_from_this();
+  zk_->wget(ownerPath(shard),
+            [weak, shard, attempt](int type, int, std::string, ZKClient *) {
+              if(type == ZOO_SESSION_EVENT) {
+                return;
+              }
+              if(auto self = weak.lock()) {
+                self->retry(shard, attempt);
+              }
+            })
+    .then([weak, shard, attempt](Try<ZKResult> &&t) {
+      auto self = weak.lock();
+      if(!self) {
+        return;
+      }
+      int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+      if(rc == ZNONODE) {
+        // handed off in between
+        self->retry(shard, attempt);
+      } else if(rc != ZOK) {
+        self->acquired(shard, attempt, ZKResult(rc));
+      } else if(t.value().status->ephemeralOwner
+                == self->zk_->getSessionId()) {
+        // ours already: restored by session recovery
+        self->acquired(shard, attempt, ZKResult(ZOK));
+      }
+      // otherwise the watch tells us once its owner lets go
+    });
+}
+
+void ZKPartitioner::retry(const std::string &shard, uint64_t attempt) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = acquiring_.find(shard);
+    if(it == acquiring_.end() || it->second != attempt) {
+      return;
+    }
+    acquiring_.erase(it);
+  }
+  acquire(shard);
+}
+
+// The owner node must go even if we were disconnected when we let go:
+// session recovery would bring it back otherwise.
+static Future<Unit> deleteOwnerNode(std::weak_ptr<ZKPartitioner> weak,
+                                    std::shared_ptr<ZKClient> zk,
+                                    std::string path) {
+  return zk->del(path).then(
+    [weak, zk, path](Try<ZKResult> &&t) -> Future<Unit> {
+      int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+      if(rc == ZOK || rc == ZNONODE || !ZKClient::retryable(rc)
+         || weak.expired()) {
+        return makeFuture();
+      }
+      return folly::futures::sleep(kRetryDelay).then([weak, zk, path] {
+        return deleteOwnerNode(weak, zk, path);
+      });
+    });
+}
+
+Future<Unit> ZKPartitioner::release(const std::string &shard) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(!owned_.erase(shard)) {
+      return makeFuture();
+    }
+    releasing_.insert(shard);
+  }
+  VLOG(1) << member_ << " handing off " << root_ << " shard " << shard;
+  auto self = shared_from_this();
+  std::weak_ptr<ZKPartitioner> weak = self;
+  auto done = makeFuture();
+  try {
+    done = lost_(shard);
+  } catch(const std::exception &e) {
+    LOG(ERROR) << "lost() threw for shard " << shard << ": " << e.what();
+  }
+  return done
+    .then([self, weak, shard](Try<Unit> &&t) {
+      if(t.hasException()) {
+        LOG(ERROR) << "lost() failed for shard " << shard
+                   << ", handing it off anyway";
+      }
+      return deleteOwnerNode(weak, self->zk_, self->ownerPath(shard));
+    })
+    .then([self, shard] {
+      {
+        std::lock_guard<std::mutex> lock(self->lock_);
+        self->releasing_.erase(shard);
+      }
+      // back to us while we were letting go
+      self->acquire(shard);
+    });
+}
+
+void ZKPartitioner::publish(const std::vector<std::string> &members) {
+  std::string text;
+  for(auto &s : shards_) {
+    text += s + " " + rendezvousOwner(s, members) + "\n";
+  }
+  const auto path = root_ + "/assignment";
+  auto zk = zk_;
+  zk->set(path, IOBuf::copyBuffer(text))
+    .then([zk, path, text](Try<ZKResult> &&t) {
+      int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+      if(rc == ZNONODE) {
+        return zk
+          ->create(path, IOBuf::copyBuffer(text), &ZOO_OPEN_ACL_UNSAFE, 0)
+          .then([](ZKResult &&r) { return r.result; });
+      }
+      return makeFuture(rc);
+    })
+    .then([path](Try<int> &&t) {
+      int rc = t.hasValue() ? t.value() : ZCONNECTIONLOSS;
+      // a racing publisher wrote the same map
+      LOG_IF(WARNING, rc != ZOK && rc != ZNODEEXISTS)
+        << "Couldn't publish " << path << ", ret: " << rc;
+    });
+}
+
+void ZKPartitioner::sessionRecovered(
+  const std::map<std::string, std::string> &renamed) {
+  std::vector<std::string> lost;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    // their watches went with the old session
+    acquiring_.clear();
+    for(auto it = owned_.begin(); it != owned_.end();) {
+      auto r = renamed.find(ownerPath(*it));
+      if(r != renamed.end() && r->second.empty()) {
+        lost.push_back(*it);
+        it = owned_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  auto us = renamed.find(membersDir() + "/" + member_);
+  LOG_IF(ERROR, us != renamed.end() && us->second.empty())
+    << "Couldn't rejoin " << root_ << " as " << member_;
+  for(auto &s : lost) {
+    // taken over while we were gone, nothing to hand off
+    LOG(WARNING) << member_ << " lost " << root_ << " shard " << s
+                 << " with its session";
+    try {
+      lost_(s);
+    } catch(const std::exception &e) {
+      LOG(ERROR) << "lost() threw for shard " << s << ": " << e.what();
+    }
+  }
+  watchMembers();
+}
+
+Future<Unit> ZKPartitioner::leave() {
+  std::vector<std::string> owned;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(left_) {
+      return makeFuture();
+    }
+    left_ = true;
+    owned.assign(owned_.begin(), owned_.end());
+  }
+  auto self = shared_from_this();
+  // out of the member list first, so the next owners line up while we
+  // hand off
+  return zk_->del(membersDir() + "/" + member_)
+    .then([self, owned](Try<ZKResult> &&) {
+      std::vector<Future<Unit>> handoffs;
+      for(auto &s : owned) {
+        handoffs.push_back(self->release(s));
+      }
+      return collectAll(handoffs.begin(), handoffs.end());
+    })
+    .then([](std::vector<Try<Unit>> &&) {});
+}
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <folly/futures/Future.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+
+namespace bolt {
+// Spreads a fixed set of shards over the members of a group.
+//
+//   <root>/members/<member>  ephemeral, one per live member
+//   <root>/owners/<shard>    ephemeral, held by the shard's current owner
+//   <root>/assignment        "<shard> <member>" lines, the computed map
+//
+// Shards are assigned by rendezvous hashing over the member list: every
+// member computes the same map on its own, and a member joining or leaving
+// only moves the shards it gains or had, about 1/N of them.
+//
+// Handoff goes through the owner nodes, so a shard never has two owners:
+// the old owner gets lost(shard), finishes up, and its owner node is only
+// deleted once the returned future completes. The new owner waits for that
+// delete, creates the node and gets gained(shard). Each member only hears
+// about its own shards. Callbacks run on the zookeeper thread.
+//
+// Members sharing the client's session survive expiry: the client restores
+// the nodes, and shards whose owner node went to someone else meanwhile are
+// reported lost. The lowest member keeps <root>/assignment up to date.
+class ZKPartitioner : public std::enable_shared_from_this<ZKPartitioner> {
+  public:
+  typedef std::function<void(const std::string &shard)> GainedCb;
+  typedef std::function<Future<Unit>(const std::string &shard)> LostCb;
+
+  // Fails if `member` is already in the group.
+  static Future<std::shared_ptr<ZKPartitioner>>
+  create(std::shared_ptr<ZKClient> zk,
+         std::string root,
+         std::string member,
+         std::vector<std::string> shards,
+         GainedCb gained,
+         LostCb lost);
+
+  // Deletes our nodes without handing off, see leave().
+  ~ZKPartitioner();
+
+  // Hands every shard off through lost() and leaves the group.
+  Future<Unit> leave();
+
+  // Rendezvous hashing: the member with the highest hash(shard, member).
+  // Stable across processes and releases, empty without members.
+  static std::string rendezvousOwner(const std::string &shard,
+                                     const std::vector<std::string> &members);
+
+  const std::string &member() const;
+  std::set<std::string> owned() const;
+  std::vector<std::string> members() const;
+  // shard -> member, as computed from members()
+  std::map<std::string, std::string> assignment() const;
+  // member list changes handled
+  uint64_t rebalances() const;
+
+  private:
+  ZKPartitioner(std::shared_ptr<ZKClient> zk,
+                std::string root,
+                std::string member,
+                std::vector<std::string> shards,
+                GainedCb gained,
+                LostCb lost);
+  static Future<std::shared_ptr<ZKPartitioner>>
+  start(std::shared_ptr<ZKPartitioner> p);
+  std::string membersDir() const;
+  std::string ownerPath(const std::string &shard) const;
+  // under lock_
+  bool wants(const std::string &shard) const;
+
+  void watchMembers();
+  void rebalance(std::vector<std::string> members);
+  void acquire(const std::string &shard);
+  void acquired(const std::string &shard, uint64_t attempt, ZKResult &&r);
+  void waitForOwner(const std::string &shard, uint64_t attempt);
+  void retry(const std::string &shard, uint64_t attempt);
+  Future<Unit> release(const std::string &shard);
+  void publish(const std::vector<std::string> &members);
+  void sessionRecovered(const std::map<std::string, std::string> &renamed);
+
+  const std::shared_ptr<ZKClient> zk_;
+  const std::string root_;
+  const std::string member_;
+  const std::vector<std::string> shards_;
+  const GainedCb gained_;
+  const LostCb lost_;
+  uint64_t recoveredCbId_{0};
+
+  mutable std::mutex lock_;
+  bool left_{false};
+  std::vector<std::string> members_;
+  std::set<std::string> owned_;
+  // shard -> attempt, results of older attempts are ignored
+  std::map<std::string, uint64_t> acquiring_;
+  uint64_t nextAttempt_{0};
+  // lost() called, owner node not deleted yet
+  std::set<std::string> releasing_;
+  uint64_t rebalances_{0};
+};
+}
@@ -0,0 +1,121 @@
+#include "bolt/zookeeper/ZKRoutedClient.hpp"
+
+namespace bolt {
+ZKRoutedClient::ZKRoutedClient(std::shared_ptr<ZKClient> reads,
+                               std::shared_ptr<ZKClient> writes,
+                               bool syncAfterWrite)
+  : reads_(std::move(reads))
+  , writes_(std::move(writes))
+  , syncAfterWrite_(syncAfterWrite) {
+  CHECK(reads_ && writes_);
+}
+
+Future<Unit> ZKRoutedClient::connected() {
+  auto writes = writes_;
+  return reads_->connected().then([writes] { return writes->connected(); });
+}
+
+template <class F>
+Future<ZKResult> ZKRoutedClient::read(ZKConsistency asked, F &&issue) {
+  if(asked == ZKConsistency::kLinearizable || !syncAfterWrite_) {
+    return issue(asked);
+  }
+  // Reads are issued under syncLock_: none can be queued between the
+  // check of the flag and the sync it calls for. The flag is cleared
+  // before, so that a write completing meanwhile gets a sync of its own.
+  std::lock_guard<std::mutex> lock(syncLock_);
+  if(!dirty_->exchange(false)) {
+    return issue(asked);
+  }
+  syncedReads_++;
+  return issue(ZKConsistency::kLinearizable);
+}
+
+void ZKRoutedClient::catchUp(const std::string &path,
+                             ZKConsistency consistency) {
+  if(consistency == ZKConsistency::kLinearizable) {
+    // the read issued next waits for it, FIFO
+    reads_->sync(path);
+  }
+}
+
+template <class T> Future<T> ZKRoutedClient::wrote(Future<T> &&f) {
+  if(!syncAfterWrite_) {
+    return std::move(f);
+  }
+  auto dirty = dirty_;
+  // whatever the outcome: a connection loss may hide an applied write
+  return std::move(f).then([dirty](Try<T> &&t) {
+    *dirty = true;
+    return makeFuture(std::move(t));
+  });
+}
+
+Future<ZKResult> ZKRoutedClient::children(std::string path,
+                                          bool watch,
+                                          ZKConsistency consistency) {
+  return read(consistency, [&](ZKConsistency c) {
+    return reads_->children(path, watch, c);
+  });
+}
+
+Future<ZKResult>
+ZKRoutedClient::get(std::string path, bool watch, ZKConsistency consistency) {
+  return read(consistency,
+              [&](ZKConsistency c) { return reads_->get(path, watch, c); });
+}
+
+Future<ZKResult> ZKRoutedClient::exists(std::string path,
+                                        bool watch,
+                                        ZKConsistency consistency) {
+  return read(consistency,
+              [&](ZKConsistency c) { return reads_->exists(path, watch, c); });
+}
+
+Future<ZKResult> ZKRoutedClient::wget(std::string path, ZKWatchCb watcher) {
+  return read(ZKConsistency::kSequential, [&](ZKConsistency c) {
+    catchUp(path, c);
+    return reads_->wget(path, std::move(watcher));
+  });
+}
+
+Future<ZKResult> ZKRoutedClient::wexists(std::string path, ZKWatchCb watcher) {
+  return read(ZKConsistency::kSequential, [&](ZKConsistency c) {
+    catchUp(path, c);
+    return reads_->wexists(path, std::move(watcher));
+  });
+}
+
+Future<ZKResult> ZKRoutedClient::wchildren(std::string path,
+                                           ZKWatchCb watcher) {
+  return read(ZKConsistency::kSequential, [&](ZKConsistency c) {
+    catchUp(path, c);
+    return reads_->wchildren(path, std::move(watcher));
+  });
+}
+
+Future<ZKResult> ZKRoutedClient::sync(std::string path) {
+  return reads_->sync(std::move(path));
+}
+
+Future<ZKResult> ZKRoutedClient::set(std::string path,
+                                     std::unique_ptr<folly::IOBuf> &&val,
+                                     int version) {
+  return wrote(writes_->set(std::move(path), std::move(val), version));
+}
+
+Future<ZKResult> ZKRoutedClient::create(std::string path,
+                                        std::unique_ptr<folly::IOBuf> &&val,
+                                        ACL_vector *acl,
+                                        int flags) {
+  return wrote(writes_->create(std::move(path), std::move(val), acl, flags));
+}
+
+Future<ZKResult> ZKRoutedClient::del(std::string path, int version) {
+  return wrote(writes_->del(std::move(path), version));
+}
+
+Future<ZKMultiResult> ZKRoutedClient::multi(std::vector<ZKOp> ops) {
+  return wrote(writes_->multi(std::move(ops)));
+}
+}
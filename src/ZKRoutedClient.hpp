@@ -0,0 +1,117 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <folly/futures/Future.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+
+namespace bolt {
+// Two sessions: reads on a nearby host list (typically the local
+// observers), writes on the voting ensemble.
+//
+// get/children/exists and the one-shot watches go to the read session,
+// set/create/del/multi to the write session. An observer may lag the
+// leader: kLinearizable reads sync the read session first, which makes
+// them see every write committed before they were issued, ours included.
+// With syncAfterWrite the first read after each of our writes completes
+// is made linearizable, so a caller reads its own writes without asking.
+//
+// Ephemerals, session recovery and recipes that mix reads and writes
+// (locks, leaders...) belong on writes().
+class ZKRoutedClient {
+  public:
+  // block: return once both sessions are established
+  template <class F>
+  ZKRoutedClient(F &&watch,
+                 const std::string &readHosts,
+                 const std::string &writeHosts,
+                 int timeout = 30, // ms
+                 int flags = 0,
+                 bool block = true,
+                 bool syncAfterWrite = true)
+    : reads_(std::make_shared<ZKClient>(watch, readHosts, timeout, flags,
+                                        block))
+    , writes_(std::make_shared<ZKClient>(watch, writeHosts, timeout, flags,
+                                         block))
+    , syncAfterWrite_(syncAfterWrite) {}
+
+  ZKRoutedClient(std::shared_ptr<ZKClient> reads,
+                 std::shared_ptr<ZKClient> writes,
+                 bool syncAfterWrite = true);
+
+  // both sessions
+  Future<Unit> connected();
+
+  Future<ZKResult>
+  children(std::string path,
+           bool watch = false,
+           ZKConsistency consistency = ZKConsistency::kSequential);
+
+  Future<ZKResult>
+  get(std::string path,
+      bool watch = false,
+      ZKConsistency consistency = ZKConsistency::kSequential);
+
+  Future<ZKResult>
+  exists(std::string path,
+         bool watch = false,
+         ZKConsistency consistency = ZKConsistency::kSequential);
+
+  Future<ZKResult> wget(std::string path, ZKWatchCb watcher);
+  Future<ZKResult> wexists(std::string path, ZKWatchCb watcher);
+  Future<ZKResult> wchildren(std::string path, ZKWatchCb watcher);
+
+  // the read session catches up with the leader on path
+  Future<ZKResult> sync(std::string path);
+
+  Future<ZKResult>
+  set(std::string path, std::unique_ptr<folly::IOBuf> &&val, int version = -1);
+
+  Future<ZKResult> create(std::string path,
+                          std::unique_ptr<folly::IOBuf> &&val,
+                          ACL_vector *acl,
+                          int flags);
+
+  Future<ZKResult> del(std::string path, int version = -1);
+
+  Future<ZKMultiResult> multi(std::vector<ZKOp> ops);
+
+  template <class T>
+  Future<ZKTypedResult<T>> getAs(std::string path, bool watch = false) {
+    return get(std::move(path), watch).then([](ZKResult &&r) {
+      return ZKTypedResult<T>(std::move(r));
+    });
+  }
+
+  template <class T>
+  Future<ZKResult> setAs(std::string path, const T &val, int version = -1) {
+    return set(std::move(path), ZKCodec<T>::encode(val), version);
+  }
+
+  std::shared_ptr<ZKClient> reads() const { return reads_; }
+  std::shared_ptr<ZKClient> writes() const { return writes_; }
+
+  // reads made linearizable by syncAfterWrite
+  uint64_t syncedReads() const { return syncedReads_; }
+
+  private:
+  // issue(consistency) issues the read, made linearizable if one of our
+  // writes completed since the last read
+  template <class F> Future<ZKResult> read(ZKConsistency asked, F &&issue);
+  // for the one-shot watches, which take no consistency
+  void catchUp(const std::string &path, ZKConsistency consistency);
+  template <class T> Future<T> wrote(Future<T> &&f);
+
+  const std::shared_ptr<ZKClient> reads_;
+  const std::shared_ptr<ZKClient> writes_;
+  const bool syncAfterWrite_;
+  // one of our writes completed since the last read; shared with the
+  // completions of writes still in flight
+  const std::shared_ptr<std::atomic<bool>> dirty_{
+    std::make_shared<std::atomic<bool>>(false)};
+  std::atomic<uint64_t> syncedReads_{0};
+  std::mutex syncLock_;
+};
+}
@@ -0,0 +1,378 @@
+#include "bolt/zookeeper/ZKSemaphore.hpp"
+#include <algorithm>
+#include "bolt/zookeeper/ZKLeader.hpp"
+#include "bolt/zookeeper/zookeeper_utils.hpp"
+#include "bolt/utils/string_utils.hpp"
+
+namespace bolt {
+// back off while disconnected
+static const std::chrono::milliseconds kRetryDelay(50);
+
+// Our session may live on for a long time, a lease node left behind would
+// hold the lease until it ends. Gone with the session otherwise.
+static Future<Unit> deleteLeaseNode(std::shared_ptr<ZKClient> zk,
+                                    std::string path,
+                                    std::shared_ptr<std::atomic<bool>> valid) {
+  return zk->del(path).then(
+    [zk, path, valid](Try<ZKResult> &&t) -> Future<Unit> {
+      int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+      if(rc == ZOK || rc == ZNONODE || !ZKClient::retryable(rc) || !*valid) {
+        return makeFuture();
+      }
+      return folly::futures::sleep(kRetryDelay).then([zk, path, valid] {
+        return deleteLeaseNode(zk, path, valid);
+      });
+    });
+}
+
+ZKSemaphore::Lease::Lease(std::shared_ptr<ZKSemaphore> sem,
+                          std::string path,
+                          std::shared_ptr<std::atomic<bool>> valid)
+  : sem_(std::move(sem)), path_(std::move(path)), valid_(std::move(valid)) {}
+
+ZKSemaphore::Lease::~Lease() { release(); }
+
+bool ZKSemaphore::Lease::valid() const { return !released_ && *valid_; }
+
+const std::string &ZKSemaphore::Lease::path() const { return path_; }
+
+Future<Unit> ZKSemaphore::Lease::release() {
+  if(released_) {
+    return makeFuture();
+  }
+  released_ = true;
+  {
+    std::lock_guard<std::mutex> lock(sem_->lock_);
+    sem_->held_.erase(valid_);
+  }
+  return deleteLeaseNode(sem_->zk_, path_, valid_);
+}
+
+std::shared_ptr<ZKSemaphore> ZKSemaphore::create(std::shared_ptr<ZKClient> zk,
+                                                 std::string path,
+                                                 uint32_t leases) {
+  CHECK(leases > 0) << "A semaphore without leases: " << path;
+  std::shared_ptr<ZKSemaphore> sem(
+    new ZKSemaphore(std::move(zk), std::move(path), leases));
+  sem->start();
+  return sem;
+}
+
+ZKSemaphore::ZKSemaphore(std::shared_ptr<ZKClient> zk,
+                         std::string path,
+                         uint32_t leases)
+  : zk_(std::move(zk)), path_(std::move(path)), leases_(leases) {}
+
+ZKSemaphore::~ZKSemaphore() {
+  zk_->removeSessionListener(sessionListenerId_);
+  // leases hold on to us, only waiters can be left
+  std::map<uint64_t, std::shared_ptr<Waiter>> waiters;
+  std::vector<std::string> nodes;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    waiters.swap(waiters_);
+    for(auto &w : waiters) {
+      w.second->done = true;
+      if(!w.second->node.empty()) {
+        nodes.push_back(w.second->node);
+      }
+    }
+  }
+  for(auto &node : nodes) {
+    zk_->del(node);
+  }
+  for(auto &w : waiters) {
+    w.second->promise.setException(
+      std::runtime_error("Semaphore destroyed: " + path_));
+  }
+}
+
+void ZKSemaphore::start() {
+  std::weak_ptr<ZKSemaphore> weak = shared_from_this();
+  sessionListenerId_ =
+    zk_->addSessionListener([weak](int, int state, std::string, ZKClient *) {
+      if(auto self = weak.lock()) {
+        self->sessionEvent(state);
+      }
+    });
+}
+
+const std::string &ZKSemaphore::path() const { return path_; }
+
+uint32_t ZKSemaphore::leases() const { return leases_; }
+
+uint64_t ZKSemaphore::wakeups() const { return wakeups_; }
+
+Future<std::unique_ptr<ZKSemaphore::Lease>>
+ZKSemaphore::acquire(std::chrono::milliseconds timeout) {
+  auto w = std::make_shared<Waiter>();
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    w->id = nextWaiterId_++;
+    waiters_[w->id] = w;
+  }
+  auto f = w->promise.getFuture();
+  auto self = shared_from_this();
+  enqueue(w, path_ + "/" + uuid() + "_l_");
+
+  std::weak_ptr<ZKSemaphore> weak = self;
+  folly::futures::sleep(timeout).then([weak, w] {
+    auto self = weak.lock();
+    if(!self) {
+      return;
+    }
+    std::string node;
+    {
+      std::lock_guard<std::mutex> lock(self->lock_);
+      if(!self->finish(*w)) {
+        return;
+      }
+      node = w->node;
+    }
+    // not queued yet: deleted once it is
+    if(!node.empty()) {
+      self->zk_->del(node);
+    }
+    w->promise.setException(folly::FutureTimeout());
+  });
+  return f;
+}
+
+bool ZKSemaphore::finish(Waiter &w) {
+  if(w.done) {
+    return false;
+  }
+  w.done = true;
+  waiters_.erase(w.id);
+  return true;
+}
+
+void ZKSemaphore::enqueue(std::shared_ptr<Waiter> w, std::string prefix) {
+  auto self = shared_from_this();
+  const auto session = zk_->getSessionId();
+  auto queue = [self, prefix] {
+    return self->zk_->create(prefix, std::make_unique<IOBuf>(),
+                             &ZOO_OPEN_ACL_UNSAFE,
+                             ZOO_SEQUENCE | ZOO_EPHEMERAL);
+  };
+  queue()
+    .then([self, queue](ZKResult &&r) -> Future<ZKResult> {
+      if(r.result != ZNONODE) {
+        return makeFuture(std::move(r));
+      }
+      // first one here
+      return ZKLeader::touchPath(self->zk_, self->path_).then([queue](int) {
+        return queue();
+      });
+    })
+    .then([self, w, prefix, session](Try<ZKResult> &&t) {
+      int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+      if(rc == ZOK && t.value().buff) {
+        auto &r = t.value();
+        self->queued(w, std::string((const char *)r.data(), r.buff->length()));
+      } else if(ZKClient::retryable(rc)) {
+        // the create may have reached the server all the same
+        self->findQueued(w, prefix, session);
+      } else {
+        self->fail(w, std::runtime_error("Couldn't queue on " + self->path_
+                                         + ", ret: " + std::to_string(rc)));
+      }
+    });
+}
+
+void ZKSemaphore::findQueued(std::shared_ptr<Waiter> w,
+                             std::string prefix,
+                             int64_t session) {
+  auto self = shared_from_this();
+  zk_->children(path_).then([self, w, prefix, session](Try<ZKResult> &&t) {
+    int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+    if(rc == ZOK) {
+      const auto name = prefix.substr(self->path_.size() + 1);
+      for(auto &child : t.value().strings) {
+        if(child.compare(0, name.size(), name) == 0) {
+          self->queued(w, self->path_ + "/" + child);
+          return;
+        }
+      }
+    } else if(rc != ZNONODE) {
+      bool done;
+      {
+        std::lock_guard<std::mutex> lock(self->lock_);
+        done = w->done;
+      }
+      // a node of an expired session is gone, no one is waiting on it
+      if(done && self->zk_->getSessionId() != session) {
+        return;
+      }
+      folly::futures::sleep(kRetryDelay).then([self, w, prefix, session] {
+        self->findQueued(w, prefix, session);
+      });
+      return;
+    }
+    // the create never made it
+    bool done;
+    {
+      std::lock_guard<std::mutex> lock(self->lock_);
+      done = w->done;
+    }
+    if(!done) {
+      self->enqueue(w, prefix);
+    }
+  });
+}
+
+void ZKSemaphore::queued(std::shared_ptr<Waiter> w, std::string node) {
+  zk_->untrackEphemeral(node);
+  bool timedOut;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    w->node = node;
+    timedOut = w->done;
+  }
+  if(timedOut) {
+    zk_->del(node);
+    return;
+  }
+  check(w);
+}
+
+void ZKSemaphore::fail(std::shared_ptr<Waiter> w, folly::exception_wrapper ex) {
+  std::string node;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(!finish(*w)) {
+      return;
+    }
+    node = w->node;
+  }
+  if(!node.empty()) {
+    zk_->del(node);
+  }
+  w->promise.setException(std::move(ex));
+}
+
+void ZKSemaphore::check(std::shared_ptr<Waiter> w) {
+  wakeups_++;
+  auto self = shared_from_this();
+  zk_->children(path_).then([self, w](Try<ZKResult> &&t) {
+    int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+    if(rc != ZOK) {
+      // an expired session fails us through sessionEvent()
+      std::weak_ptr<ZKSemaphore> weak = self;
+      folly::futures::sleep(kRetryDelay).then([weak, w] {
+        if(auto self = weak.lock()) {
+          self->check(w);
+        }
+      });
+      return;
+    }
+    std::vector<std::pair<int64_t, const std::string *>> queue;
+    for(auto &name : t.value().strings) {
+      auto seq = parseSequenceSuffix(name.data(), name.size());
+      if(seq >= 0) {
+        queue.emplace_back(seq, &name);
+      }
+    }
+    std::sort(queue.begin(), queue.end());
+    const auto ours = w->node.substr(w->node.rfind('/') + 1);
+    auto it = std::find_if(queue.begin(), queue.end(),
+                           [&ours](const std::pair<int64_t,
+                                                   const std::string *> &q) {
+                             return *q.second == ours;
+                           });
+    if(it == queue.end()) {
+      self->fail(w, std::runtime_error("Lost our place in " + self->path_));
+      return;
+    }
+    const size_t pos = it - queue.begin();
+    if(pos < self->leases_) {
+      auto valid = std::make_shared<std::atomic<bool>>(true);
+      {
+        std::lock_guard<std::mutex> lock(self->lock_);
+        if(!self->finish(*w)) {
+          return;
+        }
+        self->held_.insert(valid);
+      }
+      w->promise.setValue(
+        std::unique_ptr<Lease>(new Lease(self, w->node, valid)));
+      return;
+    }
+    std::vector<std::string> predecessors;
+    for(auto p = it - self->leases_; p != it; ++p) {
+      predecessors.push_back(*p->second);
+    }
+    self->watchPredecessors(w, std::move(predecessors));
+  });
+}
+
+void ZKSemaphore::watchPredecessors(std::shared_ptr<Waiter> w,
+                                    std::vector<std::string> predecessors) {
+  std::vector<std::string> arm;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(w->done) {
+      return;
+    }
+    for(auto &p : predecessors) {
+      if(w->watched.insert(p).second) {
+        arm.push_back(p);
+      }
+    }
+  }
+  std::weak_ptr<ZKSemaphore> weak = shared_from_this();
+  auto wake = [weak, w](const std::string &p) {
+    auto self = weak.lock();
+    if(!self) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(self->lock_);
+      w->watched.erase(p);
+      if(w->done) {
+        return;
+      }
+    }
+    self->check(w);
+  };
+  for(auto &p : arm) {
+    // a data watch, unlike exists() it is not left behind on a node that
+    // is gone already
+    zk_->wget(path_ + "/" + p,
+              [wake, p](int type, int, std::string, ZKClient *) {
+                if(type != ZOO_SESSION_EVENT) {
+                  wake(p);
+                }
+              })
+      .then([wake, p](Try<ZKResult> &&t) {
+        if(!t.hasValue() || t.value().result != ZOK) {
+          // released in between, or not armed: look again
+          wake(p);
+        }
+      });
+  }
+}
+
+void ZKSemaphore::sessionEvent(int state) {
+  if(state != ZOO_EXPIRED_SESSION_STATE) {
+    return;
+  }
+  std::vector<std::shared_ptr<Waiter>> failed;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for(auto &w : waiters_) {
+      w.second->done = true;
+      failed.push_back(w.second);
+    }
+    waiters_.clear();
+    for(auto &valid : held_) {
+      *valid = false;
+    }
+    held_.clear();
+  }
+  for(auto &w : failed) {
+    w->promise.setException(
+      std::runtime_error("Session expired waiting on " + path_));
+  }
+}
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <folly/futures/Future.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+
+namespace bolt {
+// Counting semaphore: at most `leases` holders across all processes.
+//
+// Every acquire() queues a sequential ephemeral node under the semaphore's
+// path; the first `leases` nodes hold a lease. A waiter watches the
+// `leases` nodes right ahead of it, the only ones whose going away can let
+// it in, so a release wakes at most `leases` waiters however long the
+// queue is, and waiters get in in queue order.
+//
+// Leases are lost with the session: the server drops the nodes, pending
+// acquires fail and held leases report !valid(). Lease nodes are not
+// restored by session recovery, they would go to the back of the queue.
+class ZKSemaphore : public std::enable_shared_from_this<ZKSemaphore> {
+  public:
+  // Released when destroyed.
+  class Lease {
+    public:
+    ~Lease();
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+
+    // false once the session that held it expired
+    bool valid() const;
+    const std::string &path() const;
+    Future<Unit> release();
+
+    private:
+    friend class ZKSemaphore;
+    Lease(std::shared_ptr<ZKSemaphore> sem,
+          std::string path,
+          std::shared_ptr<std::atomic<bool>> valid);
+
+    std::shared_ptr<ZKSemaphore> sem_;
+    const std::string path_;
+    std::shared_ptr<std::atomic<bool>> valid_;
+    bool released_{false};
+  };
+
+  static std::shared_ptr<ZKSemaphore>
+  create(std::shared_ptr<ZKClient> zk, std::string path, uint32_t leases);
+  ~ZKSemaphore();
+
+  // Fails with folly::FutureTimeout if no lease freed up in time (the queue
+  // node is deleted), with std::runtime_error if the session expired or
+  // the queue node could not be created.
+  Future<std::unique_ptr<Lease>> acquire(std::chrono::milliseconds timeout);
+
+  const std::string &path() const;
+  uint32_t leases() const;
+  // queue listings done by waiters, a measure of how often they woke up
+  uint64_t wakeups() const;
+
+  private:
+  struct Waiter {
+    uint64_t id;
+    std::string node;
+    Promise<std::unique_ptr<Lease>> promise;
+    bool done{false};
+    // predecessors with a watch pending
+    std::set<std::string> watched;
+  };
+
+  ZKSemaphore(std::shared_ptr<ZKClient> zk, std::string path, uint32_t leases);
+  void start();
+  // creates w's queue node, named prefix + sequence number
+  void enqueue(std::shared_ptr<Waiter> w, std::string prefix);
+  // A create lost to a connection loss may have queued a node all the
+  // same, that would hold a lease nobody waits for: look it up by its
+  // prefix, queue again if it is not there.
+  void findQueued(std::shared_ptr<Waiter> w,
+                  std::string prefix,
+                  int64_t session);
+  void queued(std::shared_ptr<Waiter> w, std::string node);
+  void check(std::shared_ptr<Waiter> w);
+  void watchPredecessors(std::shared_ptr<Waiter> w,
+                         std::vector<std::string> predecessors);
+  // done with the waiter, under lock_
+  bool finish(Waiter &w);
+  void fail(std::shared_ptr<Waiter> w, folly::exception_wrapper ex);
+  void sessionEvent(int state);
+
+  const std::shared_ptr<ZKClient> zk_;
+  const std::string path_;
+  const uint32_t leases_;
+  uint64_t sessionListenerId_{0};
+
+  std::mutex lock_;
+  std::map<uint64_t, std::shared_ptr<Waiter>> waiters_;
+  uint64_t nextWaiterId_{0};
+  // valid flags of the leases held, cleared on expiry
+  std::set<std::shared_ptr<std::atomic<bool>>> held_;
+  std::atomic<uint64_t> wakeups_{0};
+};
+}
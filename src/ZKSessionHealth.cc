@@ -0,0 +1,58 @@
+#include "bolt/zookeeper/ZKSessionHealth.hpp"
+#include <algorithm>
+#include <zookeeper/zookeeper.h>
+
+namespace bolt {
+ZKSessionHealth::ZKSessionHealth() : since_(Clock::now()) {}
+
+void ZKSessionHealth::sessionEvent(int state) {
+  std::lock_guard<std::mutex> lock(lock_);
+  const auto now = Clock::now();
+  timeInState_[state_] += now - since_;
+  since_ = now;
+  state_ = state;
+  if(state == ZOO_CONNECTED_STATE) {
+    connects_++;
+  } else if(state == ZOO_EXPIRED_SESSION_STATE) {
+    expirations_++;
+  }
+}
+
+void ZKSessionHealth::probed(std::chrono::microseconds rtt, bool ok) {
+  std::lock_guard<std::mutex> lock(lock_);
+  probes_++;
+  if(!ok) {
+    probeFailures_++;
+    return;
+  }
+  lastRtt_ = rtt;
+  rttMax_ = std::max(rttMax_, rtt);
+  rtt_.addValue(rtt.count());
+}
+
+ZKHealthSnapshot ZKSessionHealth::snapshot() const {
+  using std::chrono::duration_cast;
+  using std::chrono::milliseconds;
+  using std::chrono::microseconds;
+  std::lock_guard<std::mutex> lock(lock_);
+  ZKHealthSnapshot ret;
+  const auto now = Clock::now();
+  ret.state = state_;
+  ret.inState = duration_cast<milliseconds>(now - since_);
+  for(auto &t : timeInState_) {
+    ret.timeInState[t.first] = duration_cast<milliseconds>(t.second);
+  }
+  ret.timeInState[state_] += ret.inState;
+  ret.reconnects = connects_ > 0 ? connects_ - 1 : 0;
+  ret.expirations = expirations_;
+  ret.probes = probes_;
+  ret.probeFailures = probeFailures_;
+  ret.lastRtt = lastRtt_;
+  ret.rttMax = rttMax_;
+  if(probes_ > probeFailures_) {
+    ret.rttP50 = microseconds(rtt_.getPercentileEstimate(0.5));
+    ret.rttP99 = microseconds(rtt_.getPercentileEstimate(0.99));
+  }
+  return ret;
+}
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <folly/stats/Histogram.h>
+
+namespace bolt {
+struct ZKHealthSnapshot {
+  // ZOO_*_STATE as last reported to the watch callback, 0 before that
+  int state{0};
+  // how long we have been in it
+  std::chrono::milliseconds inState{0};
+  // total time per state since the client started, current one included
+  std::map<int, std::chrono::milliseconds> timeInState;
+  // "host:port" of the server we are connected to, empty when not connected
+  std::string server;
+  // connected again after losing the connection or the session
+  uint64_t reconnects{0};
+  uint64_t expirations{0};
+
+  // round trip probes, see ZKClient::startHealthProbes()
+  uint64_t probes{0};
+  uint64_t probeFailures{0};
+  std::chrono::microseconds lastRtt{0};
+  std::chrono::microseconds rttP50{0};
+  std::chrono::microseconds rttP99{0};
+  std::chrono::microseconds rttMax{0};
+};
+
+// Session health bookkeeping for ZKClient: state durations and transitions
+// from the session events, round trip times from the probes.
+class ZKSessionHealth {
+  public:
+  typedef std::chrono::steady_clock Clock;
+
+  ZKSessionHealth();
+
+  void sessionEvent(int state);
+  void probed(std::chrono::microseconds rtt, bool ok);
+  // server is filled in by the client
+  ZKHealthSnapshot snapshot() const;
+
+  private:
+  mutable std::mutex lock_;
+  int state_{0};
+  Clock::time_point since_;
+  std::map<int, Clock::duration> timeInState_;
+  uint64_t connects_{0};
+  uint64_t expirations_{0};
+  uint64_t probes_{0};
+  uint64_t probeFailures_{0};
+  std::chrono::microseconds lastRtt_{0};
+  std::chrono::microseconds rttMax_{0};
+  // 100us buckets up to 100ms, slower probes land in the overflow bucket
+  folly::Histogram<int64_t> rtt_{100, 0, 100000};
+};
+}
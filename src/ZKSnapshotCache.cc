@@ -0,0 +1,398 @@
+#include "bolt/zookeeper/ZKSnapshotCache.hpp"
+#include "bolt/zookeeper/zookeeper_utils.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <tuple>
+#include <vector>
+
+namespace bolt {
+// File layout, native byte order:
+//   "ZKSNAP01" uint64 count
+//   count x { uint32 pathLen, uint32 dataLen, int64 mzxid, int64 pzxid,
+//             int32 version, path, data }
+static const char kMagic[8] = {'Z', 'K', 'S', 'N', 'A', 'P', '0', '1'};
+static const size_t kHeaderSize = sizeof(kMagic) + sizeof(uint64_t);
+static const size_t kRecordHeaderSize =
+  2 * sizeof(uint32_t) + 2 * sizeof(int64_t) + sizeof(int32_t);
+
+static std::string bytes(const ZKResult &r) {
+  return r.buff ? std::string((const char *)r.data(), r.buff->length()) : "";
+}
+
+static Future<Unit> allDone(std::vector<Future<Unit>> &fs) {
+  return collectAll(fs.begin(), fs.end()).then([](std::vector<Try<Unit>> &&) {
+  });
+}
+
+std::shared_ptr<ZKSnapshotCache> ZKSnapshotCache::create(
+  std::shared_ptr<ZKClient> zk, std::string root, std::string file) {
+  return std::shared_ptr<ZKSnapshotCache>(
+    new ZKSnapshotCache(std::move(zk), std::move(root), std::move(file)));
+}
+
+ZKSnapshotCache::ZKSnapshotCache(std::shared_ptr<ZKClient> zk,
+                                 std::string root,
+                                 std::string file)
+  : zk_(std::move(zk)), root_(std::move(root)), file_(std::move(file)) {}
+
+size_t ZKSnapshotCache::load() {
+  int fd = ::open(file_.c_str(), O_RDONLY);
+  if(fd < 0) {
+    PLOG_IF(ERROR, errno != ENOENT) << "Can't open snapshot: " << file_;
+    return 0;
+  }
+  struct stat st;
+  if(::fstat(fd, &st) != 0 || size_t(st.st_size) < kHeaderSize) {
+    ::close(fd);
+    LOG(ERROR) << "Ignoring truncated snapshot: " << file_;
+    return 0;
+  }
+  const size_t size = st.st_size;
+  void *base = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(base == MAP_FAILED) {
+    PLOG(ERROR) << "Can't map snapshot: " << file_;
+    return 0;
+  }
+
+  const char *p = static_cast<const char *>(base);
+  const char *end = p + size;
+  auto take = [&p, end](void *out, size_t n) {
+    if(size_t(end - p) < n) {
+      return false;
+    }
+    std::memcpy(out, p, n);
+    p += n;
+    return true;
+  };
+  std::map<std::string, Entry> loaded;
+  char magic[sizeof(kMagic)];
+  uint64_t count = 0;
+  bool ok = take(magic, sizeof(magic))
+            && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0
+            && take(&count, sizeof(count));
+  for(uint64_t i = 0; ok && i < count; ++i) {
+    uint32_t pathLen, dataLen;
+    Entry e;
+    ok = take(&pathLen, sizeof(pathLen)) && take(&dataLen, sizeof(dataLen))
+         && take(&e.mzxid, sizeof(e.mzxid)) && take(&e.pzxid, sizeof(e.pzxid))
+         && take(&e.version, sizeof(e.version))
+         && size_t(end - p) >= size_t(pathLen) + dataLen;
+    if(ok) {
+      std::string path(p, pathLen);
+      e.data.assign(p + pathLen, dataLen);
+      p += size_t(pathLen) + dataLen;
+      loaded.emplace(std::move(path), std::move(e));
+    }
+  }
+  ::munmap(base, size);
+  if(!ok) {
+    LOG(ERROR) << "Ignoring corrupt snapshot: " << file_;
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(lock_);
+  entries_.swap(loaded);
+  LOG(INFO) << "Loaded " << entries_.size() << " nodes from " << file_;
+  return entries_.size();
+}
+
+bool ZKSnapshotCache::persist() {
+  std::map<std::string, Entry> entries;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    entries = entries_;
+  }
+  size_t size = kHeaderSize;
+  for(auto &e : entries) {
+    size += kRecordHeaderSize + e.first.size() + e.second.data.size();
+  }
+
+  // written next to it and renamed over it: readers see old or new
+  const std::string tmp = file_ + ".tmp";
+  int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    PLOG(ERROR) << "Can't create snapshot: " << tmp;
+    return false;
+  }
+  if(::ftruncate(fd, size) != 0) {
+    PLOG(ERROR) << "Can't size snapshot: " << tmp;
+    ::close(fd);
+    return false;
+  }
+  void *base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(base == MAP_FAILED) {
+    PLOG(ERROR) << "Can't map snapshot: " << tmp;
+    return false;
+  }
+
+  char *p = static_cast<char *>(base);
+  auto put = [&p](const void *in, size_t n) {
+    std::memcpy(p, in, n);
+    p += n;
+  };
+  const uint64_t count = entries.size();
+  put(kMagic, sizeof(kMagic));
+  put(&count, sizeof(count));
+  for(auto &e : entries) {
+    const uint32_t pathLen = e.first.size();
+    const uint32_t dataLen = e.second.data.size();
+    put(&pathLen, sizeof(pathLen));
+    put(&dataLen, sizeof(dataLen));
+    put(&e.second.mzxid, sizeof(e.second.mzxid));
+    put(&e.second.pzxid, sizeof(e.second.pzxid));
+    put(&e.second.version, sizeof(e.second.version));
+    put(e.first.data(), pathLen);
+    put(e.second.data.data(), dataLen);
+  }
+  bool ok = ::msync(base, size, MS_SYNC) == 0;
+  PLOG_IF(ERROR, !ok) << "Can't sync snapshot: " << tmp;
+  ::munmap(base, size);
+  if(ok && std::rename(tmp.c_str(), file_.c_str()) != 0) {
+    PLOG(ERROR) << "Can't replace snapshot: " << file_;
+    ok = false;
+  }
+  return ok;
+}
+
+// The cached nodes a reconcile() checks, a window of them at a time.
+struct ZKSnapshotCache::CheckRun {
+  std::mutex lock;
+  std::vector<std::tuple<std::string, int64_t, int64_t>> cached;
+  size_t next{0};
+  size_t pending{0};
+  bool finished{false};
+  Promise<Unit> done;
+};
+
+Future<Unit> ZKSnapshotCache::reconcile(size_t maxInFlight) {
+  CHECK(maxInFlight > 0) << "reconcile() without any checks in flight";
+  auto self = shared_from_this();
+  auto run = std::make_shared<CheckRun>();
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for(auto &e : entries_) {
+      run->cached.emplace_back(e.first, e.second.mzxid, e.second.pzxid);
+    }
+  }
+  if(run->cached.empty()) {
+    return fetchTree(root_).then([self] {});
+  }
+  auto f = run->done.getFuture();
+  const auto window = std::min(maxInFlight, run->cached.size());
+  for(size_t i = 0; i < window; ++i) {
+    nextCheck(run);
+  }
+  return f.then([self] {});
+}
+
+void ZKSnapshotCache::nextCheck(std::shared_ptr<CheckRun> run) {
+  std::tuple<std::string, int64_t, int64_t> c;
+  bool finish = false;
+  {
+    std::lock_guard<std::mutex> lock(run->lock);
+    if(run->next == run->cached.size()) {
+      if(run->pending > 0 || run->finished) {
+        return;
+      }
+      run->finished = finish = true;
+    } else {
+      c = std::move(run->cached[run->next++]);
+      run->pending++;
+    }
+  }
+  if(finish) {
+    run->done.setValue();
+    return;
+  }
+  auto self = shared_from_this();
+  check(std::get<0>(c), std::get<1>(c), std::get<2>(c))
+    .then([self, run](Try<Unit> &&) {
+      {
+        std::lock_guard<std::mutex> lock(run->lock);
+        run->pending--;
+      }
+      self->nextCheck(run);
+    });
+}
+
+Future<Unit> ZKSnapshotCache::check(const std::string &path,
+                                    int64_t mzxid,
+                                    int64_t pzxid) {
+  auto self = shared_from_this();
+  checked_++;
+  return zk_->exists(path).then(
+    [self, path, mzxid, pzxid](Try<ZKResult> &&t) -> Future<Unit> {
+      if(t.hasValue() && t.value().result == ZNONODE) {
+        self->removeTree(path);
+        return makeFuture();
+      }
+      if(!t.hasValue() || t.value().result != ZOK || !t.value().status) {
+        self->failures_++;
+        return makeFuture();
+      }
+      auto &stat = *t.value().status;
+      std::vector<Future<Unit>> more;
+      if(stat.mzxid != mzxid) {
+        more.push_back(self->fetchData(path));
+      }
+      if(stat.pzxid != pzxid) {
+        more.push_back(self->fetchChildren(path));
+      }
+      return allDone(more);
+    });
+}
+
+Future<Unit> ZKSnapshotCache::fetchData(const std::string &path) {
+  auto self = shared_from_this();
+  return zk_->get(path).then([self, path](Try<ZKResult> &&t) {
+    if(t.hasValue() && t.value().result == ZNONODE) {
+      self->removeTree(path);
+      return;
+    }
+    if(!t.hasValue() || t.value().result != ZOK || !t.value().status) {
+      self->failures_++;
+      return;
+    }
+    std::lock_guard<std::mutex> lock(self->lock_);
+    auto it = self->entries_.find(path);
+    if(it == self->entries_.end()) {
+      // removed meanwhile, don't bring it back empty
+      return;
+    }
+    auto &e = it->second;
+    e.data = bytes(t.value());
+    e.mzxid = t.value().status->mzxid;
+    e.version = t.value().status->version;
+    self->refetched_++;
+  });
+}
+
+Future<Unit> ZKSnapshotCache::fetchChildren(const std::string &path) {
+  auto self = shared_from_this();
+  return zk_->children(path).then(
+    [self, path](Try<ZKResult> &&t) -> Future<Unit> {
+      if(!t.hasValue() || t.value().result != ZOK || !t.value().status) {
+        self->failures_++;
+        return makeFuture();
+      }
+      std::set<std::string> listed;
+      for(auto &c : t.value().strings) {
+        listed.insert(childPath(path, c));
+      }
+      std::vector<std::string> gone;
+      {
+        std::lock_guard<std::mutex> lock(self->lock_);
+        auto entry = self->entries_.find(path);
+        if(entry == self->entries_.end()) {
+          // removed by a check meanwhile, and its subtree with it
+          return makeFuture();
+        }
+        entry->second.pzxid = t.value().status->pzxid;
+        const auto prefix = childPath(path, "");
+        for(auto it = self->entries_.lower_bound(prefix);
+            it != self->entries_.end()
+            && it->first.compare(0, prefix.size(), prefix) == 0;
+            ++it) {
+          if(it->first.find('/', prefix.size()) == std::string::npos) {
+            if(!listed.erase(it->first)) {
+              gone.push_back(it->first);
+            }
+          }
+        }
+      }
+      for(auto &g : gone) {
+        self->removeTree(g);
+      }
+      // what is left is new to us
+      std::vector<Future<Unit>> added;
+      for(auto &child : listed) {
+        added.push_back(self->fetchTree(child));
+      }
+      return allDone(added);
+    });
+}
+
+Future<Unit> ZKSnapshotCache::fetchTree(const std::string &path) {
+  auto self = shared_from_this();
+  // pipelined, no waiting in between
+  auto data = zk_->get(path);
+  auto kids = zk_->children(path);
+  return collectAll(data, kids).then(
+    [self, path](std::tuple<Try<ZKResult>, Try<ZKResult>> &&t) -> Future<Unit> {
+      auto &d = std::get<0>(t);
+      auto &k = std::get<1>(t);
+      if(d.hasValue() && d.value().result == ZNONODE) {
+        self->removeTree(path);
+        return makeFuture();
+      }
+      if(!d.hasValue() || !k.hasValue() || d.value().result != ZOK
+         || k.value().result != ZOK || !d.value().status
+         || !k.value().status) {
+        self->failures_++;
+        return makeFuture();
+      }
+      Entry e;
+      e.data = bytes(d.value());
+      e.mzxid = d.value().status->mzxid;
+      e.version = d.value().status->version;
+      e.pzxid = k.value().status->pzxid;
+      {
+        std::lock_guard<std::mutex> lock(self->lock_);
+        if(self->entries_.find(path) == self->entries_.end()) {
+          self->added_++;
+        }
+        self->entries_[path] = std::move(e);
+      }
+      std::vector<Future<Unit>> children;
+      for(auto &c : k.value().strings) {
+        children.push_back(self->fetchTree(childPath(path, c)));
+      }
+      return allDone(children);
+    });
+}
+
+void ZKSnapshotCache::removeTree(const std::string &path) {
+  std::lock_guard<std::mutex> lock(lock_);
+  removed_ += entries_.erase(path);
+  const auto prefix = childPath(path, "");
+  auto it = entries_.lower_bound(prefix);
+  while(it != entries_.end()
+        && it->first.compare(0, prefix.size(), prefix) == 0) {
+    it = entries_.erase(it);
+    removed_++;
+  }
+}
+
+boost::optional<ZKSnapshotCache::Entry>
+ZKSnapshotCache::get(const std::string &path) const {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto it = entries_.find(path);
+  if(it == entries_.end()) {
+    return boost::none;
+  }
+  return it->second;
+}
+
+size_t ZKSnapshotCache::size() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return entries_.size();
+}
+
+ZKSnapshotCache::ReconcileStats ZKSnapshotCache::reconcileStats() const {
+  ReconcileStats ret;
+  ret.checked = checked_;
+  ret.refetched = refetched_;
+  ret.added = added_;
+  ret.removed = removed_;
+  ret.failures = failures_;
+  return ret;
+}
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <boost/optional.hpp>
+#include <folly/futures/Future.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+
+namespace bolt {
+// Local copy of a subtree (data, mzxid, pzxid and version of every node)
+// that survives restarts.
+//
+// load() maps the snapshot file written by the last persist() and serves
+// from it right away. reconcile() then brings it up to date in the
+// background: one exists() per cached node, pipelined a window at a time,
+// and only nodes whose mzxid changed are read again. Children listings are
+// only read for nodes whose pzxid changed, which is how created and deleted
+// nodes are found.
+// With nothing loaded, reconcile() reads the whole subtree.
+//
+// Hold it in a shared_ptr (see create()): reconcile() keeps it alive.
+class ZKSnapshotCache : public std::enable_shared_from_this<ZKSnapshotCache> {
+  public:
+  struct Entry {
+    std::string data;
+    int64_t mzxid{0};
+    int64_t pzxid{0};
+    int32_t version{0};
+  };
+
+  struct ReconcileStats {
+    // exists() calls
+    uint64_t checked{0};
+    // changed nodes read again
+    uint64_t refetched{0};
+    // nodes new to the cache
+    uint64_t added{0};
+    uint64_t removed{0};
+    // calls that failed, their nodes keep the cached value
+    uint64_t failures{0};
+  };
+
+  static std::shared_ptr<ZKSnapshotCache>
+  create(std::shared_ptr<ZKClient> zk, std::string root, std::string file);
+
+  // Number of nodes loaded. A missing, truncated or corrupt file loads
+  // nothing, reconcile() then starts from scratch.
+  size_t load();
+  // Atomically replaces the snapshot file. false (and logged) on IO errors.
+  bool persist();
+  // At most maxInFlight exists() calls outstanding at a time.
+  Future<Unit> reconcile(size_t maxInFlight = 256);
+
+  boost::optional<Entry> get(const std::string &path) const;
+  size_t size() const;
+  ReconcileStats reconcileStats() const;
+
+  private:
+  ZKSnapshotCache(std::shared_ptr<ZKClient> zk,
+                  std::string root,
+                  std::string file);
+  struct CheckRun;
+  // starts the next check of the run, or completes it
+  void nextCheck(std::shared_ptr<CheckRun> run);
+  Future<Unit> check(const std::string &path, int64_t mzxid, int64_t pzxid);
+  Future<Unit> fetchData(const std::string &path);
+  Future<Unit> fetchChildren(const std::string &path);
+  Future<Unit> fetchTree(const std::string &path);
+  void removeTree(const std::string &path);
+
+  const std::shared_ptr<ZKClient> zk_;
+  const std::string root_;
+  const std::string file_;
+
+  mutable std::mutex lock_;
+  std::map<std::string, Entry> entries_;
+
+  std::atomic<uint64_t> checked_{0};
+  std::atomic<uint64_t> refetched_{0};
+  std::atomic<uint64_t> added_{0};
+  std::atomic<uint64_t> removed_{0};
+  std::atomic<uint64_t> failures_{0};
+};
+}
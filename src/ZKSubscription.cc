@@ -0,0 +1,222 @@
+#include "bolt/zookeeper/ZKSubscription.hpp"
+
+namespace bolt {
+// back off while disconnected
+static const std::chrono::milliseconds kRetryDelay(50);
+
+std::shared_ptr<ZKSubscription>
+ZKSubscription::data(std::shared_ptr<ZKClient> zk, std::string path) {
+  std::shared_ptr<ZKSubscription> sub(
+    new ZKSubscription(std::move(zk), Kind::kData, std::move(path)));
+  sub->start();
+  return sub;
+}
+
+std::shared_ptr<ZKSubscription>
+ZKSubscription::children(std::shared_ptr<ZKClient> zk, std::string path) {
+  std::shared_ptr<ZKSubscription> sub(
+    new ZKSubscription(std::move(zk), Kind::kChildren, std::move(path)));
+  sub->start();
+  return sub;
+}
+
+ZKSubscription::ZKSubscription(std::shared_ptr<ZKClient> zk,
+                               Kind kind,
+                               std::string path)
+  : zk_(std::move(zk)), kind_(kind), path_(std::move(path)) {}
+
+ZKSubscription::~ZKSubscription() { cancel(); }
+
+void ZKSubscription::start() {
+  std::weak_ptr<ZKSubscription> weak = shared_from_this();
+  // per-call watches die with the session, read (and watch) again
+  recoveredCbId_ = zk_->addSessionRecoveredCb(
+    [weak](ZKClient *, const std::map<std::string, std::string> &) {
+      if(auto self = weak.lock()) {
+        self->changed();
+      }
+    });
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    reading_ = true;
+  }
+  read();
+}
+
+void ZKSubscription::cancel() {
+  std::unique_ptr<Promise<ZKResult>> waiter;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(cancelled_) {
+      return;
+    }
+    cancelled_ = true;
+    waiter = std::move(waiter_);
+  }
+  zk_->removeSessionRecoveredCb(recoveredCbId_);
+  if(waiter) {
+    waiter->setValue(ZKResult(ZCLOSING));
+  }
+}
+
+Future<ZKResult> ZKSubscription::next() {
+  std::lock_guard<std::mutex> lock(lock_);
+  if(cancelled_) {
+    return makeFuture(ZKResult(ZCLOSING));
+  }
+  if(latest_) {
+    auto f = makeFuture(std::move(*latest_));
+    latest_ = boost::none;
+    return f;
+  }
+  CHECK(!waiter_) << "Only one next() at a time on: " << path_;
+  waiter_ = std::make_unique<Promise<ZKResult>>();
+  return waiter_->getFuture();
+}
+
+ZKWatchCb ZKSubscription::watcher() {
+  std::weak_ptr<ZKSubscription> weak = shared_from_this();
+  return [weak](int type, int, std::string, ZKClient *) {
+    // session events: the client re-sends pending watches on reconnect,
+    // expiry is handled by the session recovered callback
+    if(type == ZOO_SESSION_EVENT) {
+      return;
+    }
+    if(auto self = weak.lock()) {
+      self->events_++;
+      self->changed();
+    }
+  };
+}
+
+void ZKSubscription::changed() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(cancelled_) {
+      return;
+    }
+    if(reading_) {
+      dirty_ = true;
+      return;
+    }
+    reading_ = true;
+  }
+  read();
+}
+
+void ZKSubscription::read() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(cancelled_) {
+      reading_ = false;
+      return;
+    }
+  }
+  reads_++;
+  std::weak_ptr<ZKSubscription> weak = shared_from_this();
+  auto f = kind_ == Kind::kData ? zk_->wget(path_, watcher())
+                                : zk_->wchildren(path_, watcher());
+  f.then([weak](Try<ZKResult> &&t) {
+    if(auto self = weak.lock()) {
+      self->readDone(std::move(t));
+    }
+  });
+}
+
+void ZKSubscription::readDone(Try<ZKResult> &&t) {
+  auto rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+  if(rc == ZOK) {
+    publish(std::move(t.value()));
+    readAgainIfDirty();
+  } else if(rc == ZNONODE) {
+    publish(std::move(t.value()));
+    // a failed read leaves no watch, wait for the node to come back
+    std::weak_ptr<ZKSubscription> weak = shared_from_this();
+    zk_->wexists(path_, watcher()).then([weak](Try<ZKResult> &&t) {
+      if(auto self = weak.lock()) {
+        self->existsDone(std::move(t));
+      }
+    });
+  } else {
+    retryLater();
+  }
+}
+
+void ZKSubscription::existsDone(Try<ZKResult> &&t) {
+  auto rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+  if(rc == ZOK) {
+    // created in between
+    read();
+  } else if(rc == ZNONODE) {
+    readAgainIfDirty();
+  } else {
+    retryLater();
+  }
+}
+
+void ZKSubscription::readAgainIfDirty() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(!dirty_ || cancelled_) {
+      reading_ = false;
+      return;
+    }
+    dirty_ = false;
+  }
+  read();
+}
+
+void ZKSubscription::retryLater() {
+  std::weak_ptr<ZKSubscription> weak = shared_from_this();
+  folly::futures::sleep(kRetryDelay).then([weak]() {
+    if(auto self = weak.lock()) {
+      self->read();
+    }
+  });
+}
+
+void ZKSubscription::publish(ZKResult &&r) {
+  std::unique_ptr<Promise<ZKResult>> waiter;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if(cancelled_) {
+      return;
+    }
+    if(r.result == ZNONODE) {
+      if(deleted_) {
+        return;
+      }
+      deleted_ = true;
+    } else {
+      int64_t version = 0;
+      if(r.status) {
+        version =
+          kind_ == Kind::kData ? r.status->mzxid : r.status->pzxid;
+      }
+      // same or older than what we already have, e.g. a read that raced
+      // with an event, or a lagging server after a session change
+      if(version <= version_ && !deleted_) {
+        return;
+      }
+      version_ = version;
+      deleted_ = false;
+    }
+    if(waiter_) {
+      waiter = std::move(waiter_);
+    } else {
+      if(latest_) {
+        skipped_++;
+      }
+      latest_ = std::move(r);
+      return;
+    }
+  }
+  waiter->setValue(std::move(r));
+}
+
+const std::string &ZKSubscription::path() const { return path_; }
+ZKSubscription::Kind ZKSubscription::kind() const { return kind_; }
+uint64_t ZKSubscription::events() const { return events_; }
+uint64_t ZKSubscription::reads() const { return reads_; }
+uint64_t ZKSubscription::skipped() const { return skipped_; }
+}
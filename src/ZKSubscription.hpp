@@ -0,0 +1,102 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <boost/optional.hpp>
+#include <folly/Portability.h>
+#include <folly/futures/Future.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+
+#if FOLLY_HAS_COROUTINES
+#include <folly/experimental/coro/AsyncGenerator.h>
+#endif
+
+namespace bolt {
+// Latest-value stream of a znode's data (get) or children listing
+// (children2).
+//
+// Watches are re-armed internally with per-call watchers, so the client's
+// own callback never sees them. At most one read is in flight: events that
+// arrive meanwhile only mark the subscription dirty and cost one more read
+// once it completes. Values wait in a single slot, newer ones replace older
+// ones the consumer has not picked up yet, so a slow consumer skips to the
+// latest version instead of falling behind. Versions (mzxid for data, pzxid
+// for children) only ever go up; a deleted node shows up once, as ZNONODE.
+//
+// Survives disconnects and session expiry: reads are retried and the watch
+// set again on the new session.
+class ZKSubscription : public std::enable_shared_from_this<ZKSubscription> {
+  public:
+  enum class Kind { kData, kChildren };
+
+  static std::shared_ptr<ZKSubscription> data(std::shared_ptr<ZKClient> zk,
+                                              std::string path);
+  static std::shared_ptr<ZKSubscription>
+  children(std::shared_ptr<ZKClient> zk, std::string path);
+
+  ~ZKSubscription();
+
+  // Completes with the first value newer than the last one returned, right
+  // away if there is one. Single consumer: one next() pending at a time.
+  // Completes on the zookeeper thread, don't block in the continuation.
+  // Once cancelled, returns ZKResult(ZCLOSING).
+  Future<ZKResult> next();
+
+  void cancel();
+
+#if FOLLY_HAS_COROUTINES
+  // next() as an async stream, ends on cancel()
+  folly::coro::AsyncGenerator<ZKResult &&> stream() {
+    auto self = shared_from_this();
+    for(;;) {
+      auto r = co_await self->next();
+      if(r.result == ZCLOSING) {
+        co_return;
+      }
+      co_yield std::move(r);
+    }
+  }
+#endif
+
+  const std::string &path() const;
+  Kind kind() const;
+  // watch events received
+  uint64_t events() const;
+  // reads issued, retries included
+  uint64_t reads() const;
+  // values replaced in the slot before the consumer got to them
+  uint64_t skipped() const;
+
+  private:
+  ZKSubscription(std::shared_ptr<ZKClient> zk, Kind kind, std::string path);
+  void start();
+  void read();
+  void readDone(Try<ZKResult> &&t);
+  void existsDone(Try<ZKResult> &&t);
+  void readAgainIfDirty();
+  void retryLater();
+  void changed();
+  void publish(ZKResult &&r);
+  ZKWatchCb watcher();
+
+  const std::shared_ptr<ZKClient> zk_;
+  const Kind kind_;
+  const std::string path_;
+  uint64_t recoveredCbId_{0};
+
+  std::mutex lock_;
+  bool cancelled_{false};
+  bool reading_{false};
+  bool dirty_{false};
+  // last version handed to publish(), -1 before the first one
+  int64_t version_{-1};
+  bool deleted_{false};
+  boost::optional<ZKResult> latest_;
+  std::unique_ptr<Promise<ZKResult>> waiter_;
+
+  std::atomic<uint64_t> events_{0};
+  std::atomic<uint64_t> reads_{0};
+  std::atomic<uint64_t> skipped_{0};
+};
+}
@@ -0,0 +1,362 @@
+#include "bolt/zookeeper/ZKTreeArchive.hpp"
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace bolt {
+// File layout, native byte order:
+//   "ZKTREE01"
+//   per node { uint32 pathLen, uint32 dataLen, uint8 ephemeral, int64 czxid,
+//              int64 mzxid, int64 ctime, int64 mtime, int64 pzxid,
+//              int64 ephemeralOwner, int32 version, int32 cversion,
+//              int32 aversion, path, data }
+//   uint32 kEnd, uint64 count
+// Paths are relative to the exported root, "" being the root itself.
+static const char kMagic[8] = {'Z', 'K', 'T', 'R', 'E', 'E', '0', '1'};
+static const uint32_t kEnd = 0xFFFFFFFF;
+// zookeeper's own limits, anything past them is corruption
+static const uint32_t kMaxPathLen = 1 << 16;
+static const uint32_t kMaxDataLen = 1 << 20;
+
+namespace {
+struct Record {
+  std::string path;
+  std::string data;
+  bool ephemeral{false};
+  struct Stat stat;
+};
+
+struct Writer {
+  explicit Writer(FILE *f) : out(f) {}
+
+  template <class T> void put(const T &v) { put(&v, sizeof(v)); }
+  void put(const void *p, size_t n) {
+    ok = ok && std::fwrite(p, 1, n, out) == n;
+  }
+
+  void record(const std::string &path, const ZKResult &r) {
+    const auto &st = *r.status;
+    const uint32_t pathLen = path.size();
+    const uint32_t dataLen = r.buff ? r.buff->length() : 0;
+    const uint8_t ephemeral = st.ephemeralOwner != 0;
+    put(pathLen);
+    put(dataLen);
+    put(ephemeral);
+    put(st.czxid);
+    put(st.mzxid);
+    put(st.ctime);
+    put(st.mtime);
+    put(st.pzxid);
+    put(st.ephemeralOwner);
+    put(st.version);
+    put(st.cversion);
+    put(st.aversion);
+    put(path.data(), pathLen);
+    if(dataLen) {
+      put(r.data(), dataLen);
+    }
+  }
+
+  FILE *out;
+  bool ok{true};
+};
+
+struct Reader {
+  explicit Reader(FILE *f) : in(f) {}
+
+  template <class T> bool take(T &v) { return take(&v, sizeof(v)); }
+  bool take(void *p, size_t n) {
+    if(std::fread(p, 1, n, in) != n) {
+      return false;
+    }
+    offset += n;
+    return true;
+  }
+
+  // false at the end marker or on errors, see done and count
+  bool next(Record &rec) {
+    uint32_t pathLen, dataLen;
+    if(!take(pathLen)) {
+      return false;
+    }
+    if(pathLen == kEnd) {
+      done = take(count);
+      return false;
+    }
+    uint8_t ephemeral;
+    auto &st = rec.stat;
+    if(!take(dataLen) || pathLen > kMaxPathLen || dataLen > kMaxDataLen
+       || !take(ephemeral) || !take(st.czxid) || !take(st.mzxid)
+       || !take(st.ctime) || !take(st.mtime) || !take(st.pzxid)
+       || !take(st.ephemeralOwner) || !take(st.version) || !take(st.cversion)
+       || !take(st.aversion)) {
+      return false;
+    }
+    rec.ephemeral = ephemeral;
+    rec.path.resize(pathLen);
+    rec.data.resize(dataLen);
+    return take(&rec.path[0], pathLen) && take(&rec.data[0], dataLen);
+  }
+
+  FILE *in;
+  uint64_t offset{0};
+  bool done{false};
+  uint64_t count{0};
+};
+
+// a multi() of creates and the records it was built from, to replay them
+struct Batch {
+  std::vector<Record> records;
+  // file offset right after the last record
+  uint64_t end;
+  Future<ZKMultiResult> result;
+};
+}
+
+static std::string relativePath(const std::string &root,
+                                const std::string &path) {
+  if(path == root) {
+    return "";
+  }
+  return root == "/" ? path : path.substr(root.size());
+}
+
+static std::string absolutePath(const std::string &root,
+                                const std::string &rel) {
+  if(rel.empty()) {
+    return root;
+  }
+  return root == "/" ? rel : root + rel;
+}
+
+ZKTreeArchiveStats ZKTreeArchive::exportTree(ZKClient &zk,
+                                             const std::string &root,
+                                             const std::string &file,
+                                             size_t parallelism) {
+  ZKTreeArchiveStats stats;
+  FILE *out = std::fopen(file.c_str(), "wb");
+  if(!out) {
+    PLOG(ERROR) << "Can't create archive: " << file;
+    stats.result = ZSYSTEMERROR;
+    return stats;
+  }
+  Writer w(out);
+  w.put(kMagic, sizeof(kMagic));
+
+  // Reads are issued from the walk, which visits parents first, and the
+  // session completes them in order: records come out parents first too.
+  std::mutex lock;
+  std::condition_variable cv;
+  uint64_t reading = 0;
+  int readError = ZOK;
+  auto walked = zk.walk(
+    root,
+    [&](const std::string &path, const ZKResult &) {
+      // the server's own subtree is not ours to move
+      if(root == "/" && path.compare(0, 10, "/zookeeper") == 0
+         && (path.size() == 10 || path[10] == '/')) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> l(lock);
+        reading++;
+      }
+      zk.get(path).then([&, path](Try<ZKResult> &&t) {
+        std::lock_guard<std::mutex> l(lock);
+        int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+        if(rc == ZOK) {
+          auto &r = t.value();
+          w.record(relativePath(root, path), r);
+          stats.nodes++;
+          stats.bytes += r.buff ? r.buff->length() : 0;
+          stats.ephemerals += r.status->ephemeralOwner != 0;
+        } else if(rc != ZNONODE && readError == ZOK) {
+          readError = rc;
+        }
+        reading--;
+        cv.notify_all();
+      });
+    },
+    parallelism);
+  stats.result = walked.get().result;
+  {
+    std::unique_lock<std::mutex> l(lock);
+    cv.wait(l, [&] { return reading == 0; });
+    if(stats.result == ZOK) {
+      stats.result = readError;
+    }
+  }
+
+  w.put(kEnd);
+  w.put(stats.nodes);
+  if(std::fclose(out) != 0 || !w.ok) {
+    PLOG(ERROR) << "Can't write archive: " << file;
+    stats.result = ZSYSTEMERROR;
+  }
+  LOG(INFO) << "Exported " << stats.nodes << " nodes of " << root << " to "
+            << file << ", ret: " << stats.result;
+  return stats;
+}
+
+// Creates the batch's nodes one at a time, skipping those that exist.
+// For a multi() that failed: an interrupted import got to some of them, or
+// the batch before it failed too and its parents were missing.
+static int replay(ZKClient &zk,
+                  const std::string &root,
+                  ACL_vector *acl,
+                  const Batch &b,
+                  ZKTreeArchiveStats &stats) {
+  std::vector<Future<ZKResult>> creates;
+  for(auto &rec : b.records) {
+    creates.push_back(zk.create(absolutePath(root, rec.path),
+                                folly::IOBuf::copyBuffer(rec.data), acl,
+                                0));
+  }
+  stats.replayed++;
+  int ret = ZOK;
+  for(auto &t : collectAll(creates.begin(), creates.end()).get()) {
+    int rc = t.hasValue() ? t.value().result : ZCONNECTIONLOSS;
+    if(rc != ZOK && rc != ZNODEEXISTS && ret == ZOK) {
+      ret = rc;
+    }
+  }
+  return ret;
+}
+
+static void saveProgress(const std::string &file, uint64_t offset) {
+  if(file.empty()) {
+    return;
+  }
+  // renamed over the old one, a crash never leaves a torn offset behind
+  const std::string tmp = file + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    out << offset << "\n";
+    if(!out.flush()) {
+      LOG(ERROR) << "Can't save import progress: " << tmp;
+      return;
+    }
+  }
+  if(std::rename(tmp.c_str(), file.c_str()) != 0) {
+    PLOG(ERROR) << "Can't save import progress: " << file;
+  }
+}
+
+static uint64_t loadProgress(const std::string &file) {
+  uint64_t offset = 0;
+  if(!file.empty()) {
+    std::ifstream in(file);
+    in >> offset;
+  }
+  return offset;
+}
+
+ZKTreeArchiveStats ZKTreeArchive::importTree(ZKClient &zk,
+                                             const std::string &file,
+                                             const std::string &root,
+                                             ZKImportOptions opts) {
+  CHECK(opts.batchSize > 0 && opts.maxInFlight > 0)
+    << "Importing with nothing in flight";
+  ZKTreeArchiveStats stats;
+  FILE *in = std::fopen(file.c_str(), "rb");
+  if(!in) {
+    PLOG(ERROR) << "Can't open archive: " << file;
+    stats.result = ZSYSTEMERROR;
+    return stats;
+  }
+  Reader r(in);
+  char magic[sizeof(kMagic)];
+  if(!r.take(magic, sizeof(magic))
+     || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+    LOG(ERROR) << "Not an archive: " << file;
+    std::fclose(in);
+    stats.result = ZSYSTEMERROR;
+    return stats;
+  }
+  auto resumeAt = loadProgress(opts.progressFile);
+  if(resumeAt > r.offset) {
+    if(std::fseek(in, resumeAt, SEEK_SET) != 0) {
+      PLOG(ERROR) << "Can't resume " << file << " at " << resumeAt;
+      std::fclose(in);
+      stats.result = ZSYSTEMERROR;
+      return stats;
+    }
+    r.offset = resumeAt;
+    LOG(INFO) << "Resuming import of " << file << " at " << resumeAt;
+  }
+
+  std::deque<Batch> window;
+  // waits for the oldest batch, in order, so progress only ever covers a
+  // prefix of the file that is all in
+  auto settle = [&] {
+    auto &b = window.front();
+    auto res = std::move(b.result).get();
+    int rc = res.result;
+    if(rc != ZOK) {
+      rc = replay(zk, root, opts.acl, b, stats);
+    }
+    if(rc == ZOK) {
+      stats.nodes += b.records.size();
+      saveProgress(opts.progressFile, b.end);
+    } else if(stats.result == ZOK) {
+      stats.result = rc;
+    }
+    window.pop_front();
+  };
+
+  Batch batch;
+  Record rec;
+  auto issue = [&] {
+    std::vector<ZKOp> ops;
+    for(auto &queued : batch.records) {
+      ops.push_back(ZKOp::create(absolutePath(root, queued.path),
+                                 folly::IOBuf::copyBuffer(queued.data),
+                                 opts.acl, 0));
+    }
+    batch.end = r.offset;
+    batch.result = zk.multi(std::move(ops));
+    stats.batches++;
+    window.push_back(std::move(batch));
+    batch = Batch();
+    while(window.size() >= opts.maxInFlight) {
+      settle();
+    }
+  };
+  while(stats.result == ZOK && r.next(rec)) {
+    if(rec.ephemeral) {
+      stats.ephemerals++;
+      continue;
+    }
+    // the root of an import into "/" is there already
+    if(rec.path.empty() && root == "/") {
+      continue;
+    }
+    stats.bytes += rec.data.size();
+    batch.records.push_back(std::move(rec));
+    rec = Record();
+    if(batch.records.size() == opts.batchSize) {
+      issue();
+    }
+  }
+  if(stats.result == ZOK && !batch.records.empty()) {
+    issue();
+  }
+  while(!window.empty()) {
+    settle();
+  }
+  std::fclose(in);
+
+  if(stats.result == ZOK && !r.done) {
+    LOG(ERROR) << "Truncated or corrupt archive: " << file << " at "
+               << r.offset;
+    stats.result = ZSYSTEMERROR;
+  }
+  LOG(INFO) << "Imported " << stats.nodes << " nodes from " << file
+            << " into " << root << ", ret: " << stats.result;
+  return stats;
+}
+}
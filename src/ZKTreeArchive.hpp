@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include "bolt/zookeeper/ZKClient.hpp"
+
+namespace bolt {
+struct ZKTreeArchiveStats {
+  // ZOK, a zookeeper error, or ZSYSTEMERROR for file errors (logged)
+  int result{ZOK};
+  uint64_t nodes{0};
+  uint64_t bytes{0};
+  // export: flagged in the archive. import: skipped, their owner's session
+  // is gone
+  uint64_t ephemerals{0};
+  // import: multi()s issued, and those replayed one create at a time
+  uint64_t batches{0};
+  uint64_t replayed{0};
+};
+
+struct ZKImportOptions {
+  // creates per multi(), keep it under jute.maxbuffer worth of data
+  size_t batchSize{500};
+  size_t maxInFlight{16};
+  // ACLs are not exported, the imported nodes all get this one
+  ACL_vector *acl{&ZOO_OPEN_ACL_UNSAFE};
+  // Where the import records how far it got. An import given the progress
+  // file of an interrupted one skips what that one finished. Empty: none.
+  std::string progressFile;
+};
+
+// Moves subtrees between namespaces or ensembles through a file.
+//
+// exportTree() walks the subtree (see ZKClient::walk) and streams one record
+// per node, data, Stat and ephemeral flag, parents before children, to a
+// compact binary file. importTree() reads it back sequentially and creates
+// the nodes under another root in pipelined multi()s. Nodes that already
+// exist are left alone, so re-running an import is safe.
+//
+// Both block the calling thread, don't call them from the zookeeper thread.
+class ZKTreeArchive {
+  public:
+  static ZKTreeArchiveStats exportTree(ZKClient &zk,
+                                       const std::string &root,
+                                       const std::string &file,
+                                       size_t parallelism = 64);
+
+  static ZKTreeArchiveStats importTree(ZKClient &zk,
+                                       const std::string &file,
+                                       const std::string &root,
+                                       ZKImportOptions opts = ZKImportOptions());
+};
+}
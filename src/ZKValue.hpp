@@ -0,0 +1,164 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <folly/synchronization/Rcu.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/zookeeper/ZKCodec.hpp"
+#include "bolt/zookeeper/ZKSubscription.hpp"
+
+namespace bolt {
+// Live, typed value of one znode for hot read paths.
+//
+// Follows the node through a ZKSubscription, decodes each new version once
+// with ZKCodec<T> and publishes it as an immutable object behind an atomic
+// pointer. Readers take an RCU read lock (a thread local counter) and load
+// the pointer: no locks, no reference counting, no copies. Replaced
+// versions are reclaimed once the readers that may see them are done.
+//
+// Until the first version arrives readers see the default value, version
+// -1. A value that fails to decode, or the node going away, keeps the last
+// good value.
+template <class T> class ZKValue {
+  public:
+  struct Versioned {
+    T value;
+    // mzxid of the znode version it was decoded from
+    int64_t mzxid;
+    int32_t version;
+  };
+
+  // Keeps the value alive, don't hold on to it across blocking calls: that
+  // delays reclaiming every version published meanwhile.
+  class Snapshot {
+    public:
+    explicit Snapshot(const std::atomic<Versioned *> &current)
+      : v_(current.load(std::memory_order_acquire)) {}
+    const T &operator*() const { return v_->value; }
+    const T *operator->() const { return &v_->value; }
+    int64_t mzxid() const { return v_->mzxid; }
+    int32_t version() const { return v_->version; }
+
+    private:
+    // taken before the load, in the initializer order
+    folly::rcu_reader guard_;
+    const Versioned *v_;
+  };
+
+  typedef std::function<void(const T &, int32_t version)> ChangeCb;
+
+  ZKValue(std::shared_ptr<ZKClient> zk, std::string path, T defaultValue = T())
+    : current_(new Versioned{std::move(defaultValue), -1, -1})
+    , state_(std::make_shared<State>())
+    , sub_(ZKSubscription::data(std::move(zk), std::move(path))) {
+    state_->owner = this;
+    pump(state_, sub_);
+  }
+
+  // Snapshots must be gone by now.
+  ~ZKValue() {
+    {
+      std::lock_guard<std::mutex> lock(state_->lock);
+      state_->owner = nullptr;
+    }
+    sub_->cancel();
+    folly::synchronize_rcu();
+    delete current_.load();
+  }
+
+  ZKValue(const ZKValue &) = delete;
+  ZKValue &operator=(const ZKValue &) = delete;
+
+  Snapshot get() const { return Snapshot(current_); }
+
+  T copy() const { return *get(); }
+
+  // Called after each new version is published, from the zookeeper thread,
+  // with no lock held: callbacks may add or remove callbacks, or destroy
+  // the ZKValue. One that is being called may still be called once after
+  // removeOnChange() returns.
+  uint64_t addOnChange(ChangeCb cb) {
+    std::lock_guard<std::mutex> lock(state_->lock);
+    callbacks_.emplace(nextCallbackId_, std::move(cb));
+    return nextCallbackId_++;
+  }
+
+  void removeOnChange(uint64_t id) {
+    std::lock_guard<std::mutex> lock(state_->lock);
+    callbacks_.erase(id);
+  }
+
+  const std::string &path() const { return sub_->path(); }
+
+  private:
+  // outlives us in the subscription's continuations
+  struct State {
+    std::mutex lock;
+    ZKValue *owner{nullptr};
+  };
+
+  static void pump(std::shared_ptr<State> state,
+                   std::shared_ptr<ZKSubscription> sub) {
+    sub->next().then([state, sub](ZKResult &&r) {
+      if(r.result == ZCLOSING) {
+        return;
+      }
+      {
+        // copied out so the callbacks run outside any rcu_reader: one that
+        // destroys us would otherwise wait on itself in synchronize_rcu()
+        std::unique_ptr<Versioned> published;
+        std::vector<ChangeCb> callbacks;
+        {
+          std::lock_guard<std::mutex> lock(state->lock);
+          if(!state->owner) {
+            return;
+          }
+          auto next = state->owner->apply(std::move(r));
+          if(next && !state->owner->callbacks_.empty()) {
+            published.reset(new Versioned(*next));
+            for(auto &cb : state->owner->callbacks_) {
+              callbacks.push_back(cb.second);
+            }
+          }
+        }
+        for(auto &cb : callbacks) {
+          cb(published->value, published->version);
+        }
+      }
+      pump(state, sub);
+    });
+  }
+
+  // Under state_->lock. The new version, or nullptr if we keep the last one.
+  const Versioned *apply(ZKResult &&r) {
+    if(r.result != ZOK || !r.status) {
+      LOG(WARNING) << "Keeping the last value of " << path()
+                   << ", ret: " << r.result;
+      return nullptr;
+    }
+    T val;
+    bool decoded = r.buff ? ZKCodec<T>::decode(*r.buff, val)
+                          : ZKCodec<T>::decode(folly::IOBuf(), val);
+    if(!decoded) {
+      LOG(ERROR) << "Keeping the last value of " << path()
+                 << ", can't decode version: " << r.status->version;
+      return nullptr;
+    }
+    auto next = new Versioned{std::move(val), r.status->mzxid,
+                              r.status->version};
+    auto prev = current_.exchange(next, std::memory_order_acq_rel);
+    folly::rcu_retire(prev);
+    return next;
+  }
+
+  std::atomic<Versioned *> current_;
+  std::shared_ptr<State> state_;
+  std::map<uint64_t, ChangeCb> callbacks_;
+  uint64_t nextCallbackId_{0};
+  std::shared_ptr<ZKSubscription> sub_;
+};
+}
@@ -0,0 +1,145 @@
+#include "bolt/zookeeper/ZKWatchDebouncer.hpp"
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+namespace bolt {
+ZKWatchDebouncer::ZKWatchDebouncer(Dispatch dispatch, Now now)
+  : dispatch_(std::move(dispatch)), now_(std::move(now)) {}
+
+ZKWatchDebouncer::~ZKWatchDebouncer() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    running_ = false;
+    cv_.notify_all();
+  }
+  if(timer_.joinable()) {
+    timer_.join();
+  }
+}
+
+void ZKWatchDebouncer::setRule(const std::string &prefix,
+                               ZKDebounce debounce) {
+  std::lock_guard<std::mutex> lock(lock_);
+  rules_[prefix].debounce = debounce;
+  maxInterval_ = std::max(maxInterval_, debounce.minInterval);
+  // no thread until someone asks for debouncing
+  if(!timer_.joinable()) {
+    timer_ = std::thread([this] { loop(); });
+  }
+}
+
+std::map<std::string, ZKDebounceStats> ZKWatchDebouncer::stats() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::map<std::string, ZKDebounceStats> ret;
+  for(auto &r : rules_) {
+    ret[r.first] = r.second.stats;
+  }
+  return ret;
+}
+
+ZKWatchDebouncer::Rule *ZKWatchDebouncer::match(const std::string &path,
+                                                std::string *prefix) {
+  Rule *best = nullptr;
+  for(auto &r : rules_) {
+    auto &p = r.first;
+    if(path.compare(0, p.size(), p) != 0) {
+      continue;
+    }
+    // whole path components only: /a covers /a/b but not /ab
+    if(path.size() != p.size() && p.back() != '/' && path[p.size()] != '/') {
+      continue;
+    }
+    if(!best || p.size() > prefix->size()) {
+      best = &r.second;
+      *prefix = p;
+    }
+  }
+  return best;
+}
+
+bool ZKWatchDebouncer::offer(int type, int state, const std::string &path) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if(rules_.empty()) {
+    return false;
+  }
+  std::string prefix;
+  auto rule = match(path, &prefix);
+  if(!rule) {
+    return false;
+  }
+  const auto &debounce = rule->debounce;
+  auto key = std::make_pair(path, type);
+  auto it = pending_.find(key);
+  if(it != pending_.end()) {
+    it->second.state = state;
+    rule->stats.suppressed++;
+    return true;
+  }
+
+  const auto now = now_();
+  auto due = now + debounce.trailingDelay;
+  auto last = lastDelivered_.find(path);
+  if(last != lastDelivered_.end() && last->second + debounce.minInterval > due) {
+    due = last->second + debounce.minInterval;
+  }
+  if(due <= now) {
+    lastDelivered_[path] = now;
+    rule->stats.delivered++;
+    return false;
+  }
+  pending_.emplace(key, Pending{due, state, prefix});
+  cv_.notify_one();
+  return true;
+}
+
+void ZKWatchDebouncer::poke() {
+  std::lock_guard<std::mutex> lock(lock_);
+  cv_.notify_one();
+}
+
+void ZKWatchDebouncer::loop() {
+  std::unique_lock<std::mutex> lock(lock_);
+  while(running_) {
+    auto now = now_();
+    auto wakeup = now + std::chrono::seconds(1);
+    for(auto &p : pending_) {
+      wakeup = std::min(wakeup, p.second.due);
+    }
+    if(wakeup > now) {
+      cv_.wait_for(lock, wakeup - now);
+    }
+    if(!running_) {
+      return;
+    }
+
+    now = now_();
+    std::vector<std::tuple<int, int, std::string>> due;
+    for(auto it = pending_.begin(); it != pending_.end();) {
+      if(it->second.due > now) {
+        ++it;
+        continue;
+      }
+      auto &path = it->first.first;
+      due.emplace_back(it->first.second, it->second.state, path);
+      lastDelivered_[path] = now;
+      rules_[it->second.prefix].stats.delivered++;
+      it = pending_.erase(it);
+    }
+    // forget paths that are quiet for longer than any window
+    for(auto it = lastDelivered_.begin(); it != lastDelivered_.end();) {
+      if(now - it->second >= maxInterval_) {
+        it = lastDelivered_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    lock.unlock();
+    for(auto &e : due) {
+      dispatch_(std::get<0>(e), std::get<1>(e), std::get<2>(e));
+    }
+    lock.lock();
+  }
+}
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace bolt {
+// minInterval: at most one event per path and type in that window, the
+// first goes out right away, the rest fold into one at the window's end.
+// trailingDelay: hold events back that long and fold in whatever arrives
+// meanwhile. Not extended by later events, so delivery is never starved.
+// Both zero: no debouncing.
+struct ZKDebounce {
+  std::chrono::milliseconds minInterval{0};
+  std::chrono::milliseconds trailingDelay{0};
+};
+
+struct ZKDebounceStats {
+  // events handed to the watch callback, right away or later
+  uint64_t delivered{0};
+  // events folded into one already pending
+  uint64_t suppressed{0};
+};
+
+// Debounces node events in ZKClient's watch dispatch, per path prefix.
+// Delayed events are delivered from the debouncer's own thread.
+class ZKWatchDebouncer {
+  public:
+  typedef std::chrono::steady_clock Clock;
+  typedef std::function<void(int, int, const std::string &)> Dispatch;
+  typedef std::function<Clock::time_point()> Now;
+
+  // now: the clock windows are measured on, injectable for tests
+  explicit ZKWatchDebouncer(Dispatch dispatch, Now now = &Clock::now);
+  // pending events are dropped
+  ~ZKWatchDebouncer();
+
+  // Applies to `prefix` and everything under it, the longest prefix wins.
+  void setRule(const std::string &prefix, ZKDebounce debounce);
+  std::map<std::string, ZKDebounceStats> stats() const;
+
+  // false: not debounced, deliver it now. true: the debouncer took it.
+  bool offer(int type, int state, const std::string &path);
+  // Delivers what is due now. The timer thread only sleeps as long as the
+  // clock says; an injected clock that jumps ahead has to poke it.
+  void poke();
+
+  private:
+  struct Rule {
+    ZKDebounce debounce;
+    ZKDebounceStats stats;
+  };
+  struct Pending {
+    Clock::time_point due;
+    int state;
+    std::string prefix;
+  };
+
+  Rule *match(const std::string &path, std::string *prefix);
+  void loop();
+
+  const Dispatch dispatch_;
+  const Now now_;
+  mutable std::mutex lock_;
+  std::condition_variable cv_;
+  bool running_{true};
+  std::thread timer_;
+  std::map<std::string, Rule> rules_;
+  std::chrono::milliseconds maxInterval_{0};
+  std::map<std::pair<std::string, int>, Pending> pending_;
+  std::map<std::string, Clock::time_point> lastDelivered_;
+};
+}
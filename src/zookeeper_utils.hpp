@@ -1,4 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <zookeeper/zookeeper.h>
 namespace bolt {
 void failFastOnZooKeeperGet(int rc);
+
+// joins a child name onto its parent's path; the root has no trailing '/'
+inline std::string childPath(const std::string &parent,
+                             const std::string &child) {
+  return parent == "/" ? parent + child : parent + "/" + child;
+}
+
+// Sequential nodes end in exactly 10 digits (%010d, see zookeeper.h).
+// Fixed width and branch-free: always looks at the last 10 bytes, invalid
+// digits are OR-ed into a flag instead of bailing out early. Returns -1 if
+// the name is too short or the suffix is not all digits.
+inline int64_t parseSequenceSuffix(const char *name, size_t len) {
+  constexpr size_t kWidth = 10;
+  if(len < kWidth) {
+    return -1;
+  }
+  const unsigned char *p =
+    reinterpret_cast<const unsigned char *>(name + len - kWidth);
+  uint64_t value = 0;
+  uint32_t bad = 0;
+  for(size_t i = 0; i < kWidth; ++i) {
+    const uint32_t digit = uint32_t(p[i]) - '0';
+    bad |= digit > 9;
+    value = value * 10 + digit;
+  }
+  return bad ? -1 : int64_t(value);
+}
 }
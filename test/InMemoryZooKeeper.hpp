@@ -0,0 +1,1016 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+#include <zookeeper/zookeeper.h>
+
+namespace bolt {
+// In-process, in-memory stand-in for a single ZooKeeper server. It speaks the
+// client wire protocol on a local port, so the real C client (and ZKClient on
+// top) talks to it unmodified. Covers what the client library uses:
+// sessions w/ expiry, persistent/ephemeral/sequential nodes, data & child
+// watches, multi, sync and SetWatches on reconnect. No ACL enforcement, no
+// persistence, no quorum.
+//
+// All state lives on one event loop thread; the public methods hop onto it
+// and wait, so tests observe a consistent server.
+class InMemoryZooKeeper {
+  public:
+  // port 0 picks a free one. tickMs bounds the session timeouts like
+  // tickTime does for the real server: [2 * tick, 20 * tick].
+  explicit InMemoryZooKeeper(uint16_t port = 0, int tickMs = 10)
+    : tickMs_(tickMs) {
+    listenFd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    PCHECK(listenFd_ >= 0) << "socket";
+    int one = 1;
+    ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    PCHECK(::bind(listenFd_, (sockaddr *)&addr, sizeof(addr)) == 0) << "bind";
+    PCHECK(::listen(listenFd_, 128) == 0) << "listen";
+    socklen_t len = sizeof(addr);
+    PCHECK(::getsockname(listenFd_, (sockaddr *)&addr, &len) == 0);
+    port_ = ntohs(addr.sin_port);
+    setNonBlocking(listenFd_);
+    PCHECK(::pipe(wakeFds_) == 0) << "pipe";
+    setNonBlocking(wakeFds_[0]);
+
+    Node root;
+    nodes_.emplace("/", root);
+    Node zk;
+    nodes_["/"].children.insert("zookeeper");
+    nodes_.emplace("/zookeeper", zk);
+
+    loop_ = std::thread([this] { loop(); });
+  }
+
+  ~InMemoryZooKeeper() {
+    running_ = false;
+    wake();
+    loop_.join();
+    for(auto &c : conns_) {
+      ::close(c.first);
+    }
+    ::close(listenFd_);
+    ::close(wakeFds_[0]);
+    ::close(wakeFds_[1]);
+  }
+
+  uint16_t port() const { return port_; }
+  std::string hosts() const { return "127.0.0.1:" + std::to_string(port_); }
+
+  // Expire as if the session timed out: ephemerals go, watches fire, the
+  // connection is closed and the client learns about it on reconnect.
+  void expireSession(int64_t sessionId) {
+    runInLoop([this, sessionId] { expire(sessionId); });
+  }
+
+  void expireAllSessions() {
+    runInLoop([this] {
+      std::vector<int64_t> ids;
+      for(auto &s : sessions_) {
+        ids.push_back(s.first);
+      }
+      for(auto id : ids) {
+        expire(id);
+      }
+    });
+  }
+
+  // Close every client socket. Sessions survive until they time out.
+  void dropConnections() {
+    runInLoop([this] {
+      for(auto &c : conns_) {
+        c.second.closing = true;
+        c.second.out.clear();
+      }
+    });
+  }
+
+  size_t sessionCount() {
+    size_t count = 0;
+    runInLoop([this, &count] { count = sessions_.size(); });
+    return count;
+  }
+
+  bool exists(const std::string &path) {
+    bool found = false;
+    runInLoop([this, &path, &found] { found = nodes_.count(path) > 0; });
+    return found;
+  }
+
+  private:
+  enum OpCode {
+    kCreate = 1,
+    kDelete = 2,
+    kExists = 3,
+    kGetData = 4,
+    kSetData = 5,
+    kGetACL = 6,
+    kSetACL = 7,
+    kGetChildren = 8,
+    kSync = 9,
+    kPing = 11,
+    kGetChildren2 = 12,
+    kCheck = 13,
+    kMulti = 14,
+    kCreate2 = 15,
+    kAuth = 100,
+    kSetWatches = 101,
+    kCloseSession = -11,
+    kError = -1
+  };
+
+  struct Node {
+    std::string data;
+    int64_t czxid{0};
+    int64_t mzxid{0};
+    int64_t ctime{0};
+    int64_t mtime{0};
+    int32_t version{0};
+    int32_t cversion{0};
+    int32_t aversion{0};
+    int64_t ephemeralOwner{0};
+    int64_t pzxid{0};
+    std::set<std::string> children;
+  };
+
+  struct Session {
+    int64_t id;
+    int32_t timeoutMs;
+    std::string passwd;
+    std::chrono::steady_clock::time_point lastHeard;
+    int fd{-1};
+    std::set<std::string> ephemerals;
+  };
+
+  struct Conn {
+    std::string in;
+    std::string out;
+    int64_t session{0};
+    bool closing{false};
+  };
+
+  struct Trigger {
+    std::string path;
+    int type;
+  };
+
+  // jute, the ZooKeeper serialization format. Big endian, length prefixed.
+  struct JuteOut {
+    std::string buf;
+    void i32(int32_t v) {
+      uint32_t n = htonl(static_cast<uint32_t>(v));
+      buf.append((const char *)&n, 4);
+    }
+    void i64(int64_t v) {
+      i32(static_cast<int32_t>(static_cast<uint64_t>(v) >> 32));
+      i32(static_cast<int32_t>(v & 0xffffffff));
+    }
+    void boolean(bool v) { buf.push_back(v ? 1 : 0); }
+    void str(const std::string &s) {
+      i32(static_cast<int32_t>(s.size()));
+      buf.append(s);
+    }
+    void strs(const std::set<std::string> &v) {
+      i32(static_cast<int32_t>(v.size()));
+      for(auto &s : v) {
+        str(s);
+      }
+    }
+    void stat(const Node &n) {
+      i64(n.czxid);
+      i64(n.mzxid);
+      i64(n.ctime);
+      i64(n.mtime);
+      i32(n.version);
+      i32(n.cversion);
+      i32(n.aversion);
+      i64(n.ephemeralOwner);
+      i32(static_cast<int32_t>(n.data.size()));
+      i32(static_cast<int32_t>(n.children.size()));
+      i64(n.pzxid);
+    }
+  };
+
+  struct JuteIn {
+    JuteIn(const char *data, size_t len) : p(data), left(len) {}
+    const char *p;
+    size_t left;
+    bool ok{true};
+
+    bool need(size_t n) {
+      if(left < n) {
+        ok = false;
+      }
+      return ok;
+    }
+    int32_t i32() {
+      if(!need(4)) {
+        return 0;
+      }
+      uint32_t n;
+      std::memcpy(&n, p, 4);
+      p += 4;
+      left -= 4;
+      return static_cast<int32_t>(ntohl(n));
+    }
+    int64_t i64() {
+      uint64_t hi = static_cast<uint32_t>(i32());
+      uint64_t lo = static_cast<uint32_t>(i32());
+      return static_cast<int64_t>((hi << 32) | lo);
+    }
+    bool boolean() {
+      if(!need(1)) {
+        return false;
+      }
+      left--;
+      return *p++ != 0;
+    }
+    std::string str() {
+      int32_t len = i32();
+      if(len <= 0 || !need(len)) {
+        return "";
+      }
+      std::string s(p, len);
+      p += len;
+      left -= len;
+      return s;
+    }
+    std::vector<std::string> strs() {
+      std::vector<std::string> v;
+      int32_t count = i32();
+      for(int32_t i = 0; ok && i < count; ++i) {
+        v.push_back(str());
+      }
+      return v;
+    }
+    void acls() {
+      int32_t count = i32();
+      for(int32_t i = 0; ok && i < count; ++i) {
+        i32();
+        str();
+        str();
+      }
+    }
+  };
+
+  struct MultiOp {
+    int32_t type;
+    std::string path;
+    std::string data;
+    int32_t version{-1};
+    int32_t flags{0};
+  };
+
+  static void setNonBlocking(int fd) {
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+
+  static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+  }
+
+  static std::string parentOf(const std::string &path) {
+    auto pos = path.rfind('/');
+    return pos == 0 ? "/" : path.substr(0, pos);
+  }
+
+  static std::string nameOf(const std::string &path) {
+    return path.substr(path.rfind('/') + 1);
+  }
+
+  static bool validPath(const std::string &path) {
+    if(path.empty() || path[0] != '/') {
+      return false;
+    }
+    if(path.size() > 1 && path.back() == '/') {
+      return false;
+    }
+    return path.find("//") == std::string::npos;
+  }
+
+  void wake() {
+    char c = 0;
+    if(::write(wakeFds_[1], &c, 1) < 0) {
+      PLOG(ERROR) << "Failed to wake the zookeeper loop";
+    }
+  }
+
+  void runInLoop(std::function<void()> fn) {
+    if(std::this_thread::get_id() == loop_.get_id()) {
+      fn();
+      return;
+    }
+    std::packaged_task<void()> task(std::move(fn));
+    auto done = task.get_future();
+    {
+      std::lock_guard<std::mutex> lock(tasksMutex_);
+      tasks_.push_back(std::move(task));
+    }
+    wake();
+    done.get();
+  }
+
+  void loop() {
+    while(running_) {
+      std::vector<pollfd> fds;
+      fds.push_back(pollfd{listenFd_, POLLIN, 0});
+      fds.push_back(pollfd{wakeFds_[0], POLLIN, 0});
+      for(auto &c : conns_) {
+        short events = POLLIN;
+        if(!c.second.out.empty()) {
+          events |= POLLOUT;
+        }
+        fds.push_back(pollfd{c.first, events, 0});
+      }
+      ::poll(fds.data(), fds.size(), tickMs_);
+
+      if(fds[1].revents & POLLIN) {
+        char drain[64];
+        while(::read(wakeFds_[0], drain, sizeof(drain)) > 0) {
+        }
+      }
+      std::vector<std::packaged_task<void()>> tasks;
+      {
+        std::lock_guard<std::mutex> lock(tasksMutex_);
+        tasks.swap(tasks_);
+      }
+      for(auto &t : tasks) {
+        t();
+      }
+      if(fds[0].revents & POLLIN) {
+        acceptAll();
+      }
+      for(auto i = 2u; i < fds.size(); ++i) {
+        auto it = conns_.find(fds[i].fd);
+        if(it == conns_.end()) {
+          continue;
+        }
+        if(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+          readFrom(it->first, it->second);
+        }
+        if(!it->second.out.empty()) {
+          flush(it->first, it->second);
+        }
+      }
+      expireIdleSessions();
+      reapClosedConns();
+    }
+  }
+
+  void acceptAll() {
+    for(;;) {
+      int fd = ::accept(listenFd_, nullptr, nullptr);
+      if(fd < 0) {
+        return;
+      }
+      setNonBlocking(fd);
+      conns_[fd] = Conn();
+    }
+  }
+
+  void readFrom(int fd, Conn &c) {
+    char buf[16384];
+    for(;;) {
+      auto n = ::read(fd, buf, sizeof(buf));
+      if(n > 0) {
+        c.in.append(buf, n);
+        continue;
+      }
+      if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        c.closing = true;
+        c.out.clear();
+      }
+      break;
+    }
+    size_t off = 0;
+    while(!c.closing && c.in.size() - off >= 4) {
+      uint32_t len;
+      std::memcpy(&len, c.in.data() + off, 4);
+      len = ntohl(len);
+      if(len > (1 << 21)) {
+        LOG(ERROR) << "Oversized packet, closing connection";
+        c.closing = true;
+        break;
+      }
+      if(c.in.size() - off - 4 < len) {
+        break;
+      }
+      JuteIn in(c.in.data() + off + 4, len);
+      off += 4 + len;
+      if(c.session == 0) {
+        handleConnect(fd, c, in);
+      } else {
+        handleRequest(c, in);
+      }
+    }
+    c.in.erase(0, off);
+  }
+
+  void flush(int fd, Conn &c) {
+    while(!c.out.empty()) {
+      auto n = ::send(fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+      if(n <= 0) {
+        if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          c.closing = true;
+          c.out.clear();
+        }
+        return;
+      }
+      c.out.erase(0, n);
+    }
+  }
+
+  void reapClosedConns() {
+    for(auto it = conns_.begin(); it != conns_.end();) {
+      if(!it->second.closing || !it->second.out.empty()) {
+        ++it;
+        continue;
+      }
+      auto s = sessions_.find(it->second.session);
+      if(s != sessions_.end() && s->second.fd == it->first) {
+        detach(s->second);
+      }
+      ::close(it->first);
+      it = conns_.erase(it);
+    }
+  }
+
+  void send(Conn &c, const JuteOut &packet) {
+    uint32_t len = htonl(static_cast<uint32_t>(packet.buf.size()));
+    c.out.append((const char *)&len, 4);
+    c.out.append(packet.buf);
+  }
+
+  void reply(Conn &c, int32_t xid, int32_t err, const std::string &body) {
+    JuteOut out;
+    out.i32(xid);
+    out.i64(zxid_);
+    out.i32(err);
+    out.buf.append(body);
+    send(c, out);
+  }
+
+  void handleConnect(int fd, Conn &c, JuteIn &in) {
+    in.i32(); // protocolVersion
+    in.i64(); // lastZxidSeen
+    int32_t timeout = in.i32();
+    int64_t sessionId = in.i64();
+    std::string passwd = in.str();
+    // 3.5 clients send a trailing readOnly flag, older ones do not
+
+    Session *session = nullptr;
+    if(sessionId != 0) {
+      auto it = sessions_.find(sessionId);
+      if(it != sessions_.end() && it->second.passwd == passwd) {
+        session = &it->second;
+      }
+    } else if(in.ok) {
+      Session s;
+      s.id = nextSessionId_++;
+      s.timeoutMs = std::max(2 * tickMs_, std::min(20 * tickMs_, timeout));
+      s.passwd.resize(16);
+      for(auto &ch : s.passwd) {
+        ch = static_cast<char>(rand_());
+      }
+      session = &sessions_.emplace(s.id, s).first->second;
+    }
+
+    JuteOut out;
+    out.i32(0);
+    if(session == nullptr) {
+      // a zero timeout is how the server tells the client its session expired
+      out.i32(0);
+      out.i64(0);
+      out.str(std::string(16, '\0'));
+      out.boolean(false);
+      send(c, out);
+      c.session = -1;
+      c.closing = true;
+      return;
+    }
+    if(session->fd >= 0 && session->fd != fd) {
+      auto old = conns_.find(session->fd);
+      if(old != conns_.end()) {
+        old->second.closing = true;
+        old->second.out.clear();
+      }
+      detach(*session);
+    }
+    session->fd = fd;
+    session->lastHeard = std::chrono::steady_clock::now();
+    c.session = session->id;
+    out.i32(session->timeoutMs);
+    out.i64(session->id);
+    out.str(session->passwd);
+    out.boolean(false);
+    send(c, out);
+  }
+
+  void handleRequest(Conn &c, JuteIn &in) {
+    auto sit = sessions_.find(c.session);
+    if(sit == sessions_.end()) {
+      c.closing = true;
+      return;
+    }
+    Session &session = sit->second;
+    session.lastHeard = std::chrono::steady_clock::now();
+    const int32_t xid = in.i32();
+    const int32_t type = in.i32();
+    JuteOut body;
+    int32_t err = ZOK;
+    std::vector<Trigger> triggers;
+
+    switch(type) {
+    case kPing:
+    case kAuth:
+      break;
+    case kCloseSession:
+      reply(c, xid, ZOK, "");
+      c.closing = true;
+      expire(session.id);
+      return;
+    case kCreate:
+    case kCreate2: {
+      auto path = in.str();
+      auto data = in.str();
+      in.acls();
+      auto flags = in.i32();
+      std::string created;
+      err = create(session.id, path, data, flags, triggers, created);
+      if(err == ZOK) {
+        body.str(created);
+        if(type == kCreate2) {
+          body.stat(nodes_[created]);
+        }
+      }
+      break;
+    }
+    case kDelete: {
+      auto path = in.str();
+      err = remove(path, in.i32(), triggers);
+      break;
+    }
+    case kExists: {
+      auto path = in.str();
+      bool watch = in.boolean();
+      auto it = nodes_.find(path);
+      if(it == nodes_.end()) {
+        err = ZNONODE;
+      } else {
+        body.stat(it->second);
+      }
+      if(watch) {
+        dataWatches_[path].insert(session.id);
+      }
+      break;
+    }
+    case kGetData: {
+      auto path = in.str();
+      bool watch = in.boolean();
+      auto it = nodes_.find(path);
+      if(it == nodes_.end()) {
+        err = ZNONODE;
+        break;
+      }
+      body.str(it->second.data);
+      body.stat(it->second);
+      if(watch) {
+        dataWatches_[path].insert(session.id);
+      }
+      break;
+    }
+    case kSetData: {
+      auto path = in.str();
+      auto data = in.str();
+      err = setData(path, data, in.i32(), triggers);
+      if(err == ZOK) {
+        body.stat(nodes_[path]);
+      }
+      break;
+    }
+    case kGetChildren:
+    case kGetChildren2: {
+      auto path = in.str();
+      bool watch = in.boolean();
+      auto it = nodes_.find(path);
+      if(it == nodes_.end()) {
+        err = ZNONODE;
+        break;
+      }
+      body.strs(it->second.children);
+      if(type == kGetChildren2) {
+        body.stat(it->second);
+      }
+      if(watch) {
+        childWatches_[path].insert(session.id);
+      }
+      break;
+    }
+    case kSync:
+      body.str(in.str());
+      break;
+    case kGetACL: {
+      auto it = nodes_.find(in.str());
+      if(it == nodes_.end()) {
+        err = ZNONODE;
+        break;
+      }
+      body.i32(1);
+      body.i32(ZOO_PERM_ALL);
+      body.str("world");
+      body.str("anyone");
+      body.stat(it->second);
+      break;
+    }
+    case kSetACL: {
+      auto it = nodes_.find(in.str());
+      in.acls();
+      int32_t version = in.i32();
+      if(it == nodes_.end()) {
+        err = ZNONODE;
+      } else if(version != -1 && version != it->second.aversion) {
+        err = ZBADVERSION;
+      } else {
+        it->second.aversion++;
+        body.stat(it->second);
+      }
+      break;
+    }
+    case kCheck: {
+      auto path = in.str();
+      err = check(path, in.i32());
+      break;
+    }
+    case kMulti:
+      body.buf = multi(session.id, in, triggers);
+      break;
+    case kSetWatches:
+      setWatches(session, in);
+      break;
+    default:
+      LOG(ERROR) << "In memory zookeeper does not implement op: " << type;
+      err = ZUNIMPLEMENTED;
+    }
+
+    if(!in.ok) {
+      LOG(ERROR) << "Malformed request, op: " << type;
+      c.closing = true;
+      return;
+    }
+    reply(c, xid, err, err == ZOK ? body.buf : "");
+    fire(triggers);
+  }
+
+  int32_t create(int64_t owner,
+                 const std::string &path,
+                 const std::string &data,
+                 int32_t flags,
+                 std::vector<Trigger> &triggers,
+                 std::string &created) {
+    if(!validPath(path) || path == "/") {
+      return ZBADARGUMENTS;
+    }
+    auto parentPath = parentOf(path);
+    auto parent = nodes_.find(parentPath);
+    if(parent == nodes_.end()) {
+      return ZNONODE;
+    }
+    if(parent->second.ephemeralOwner != 0) {
+      return ZNOCHILDRENFOREPHEMERALS;
+    }
+    created = path;
+    if(flags & ZOO_SEQUENCE) {
+      char seq[16];
+      std::snprintf(seq, sizeof(seq), "%010d", parent->second.cversion);
+      created += seq;
+    }
+    if(nodes_.count(created)) {
+      return ZNODEEXISTS;
+    }
+    auto zxid = ++zxid_;
+    Node node;
+    node.data = data;
+    node.czxid = node.mzxid = node.pzxid = zxid;
+    node.ctime = node.mtime = nowMs();
+    if(flags & ZOO_EPHEMERAL) {
+      node.ephemeralOwner = owner;
+      sessions_[owner].ephemerals.insert(created);
+    }
+    nodes_.emplace(created, node);
+    parent->second.children.insert(nameOf(created));
+    parent->second.cversion++;
+    parent->second.pzxid = zxid;
+    triggers.push_back(Trigger{created, ZOO_CREATED_EVENT});
+    triggers.push_back(Trigger{parentPath, ZOO_CHILD_EVENT});
+    return ZOK;
+  }
+
+  int32_t
+  remove(const std::string &path, int32_t version, std::vector<Trigger> &t) {
+    if(!validPath(path) || path == "/") {
+      return ZBADARGUMENTS;
+    }
+    auto it = nodes_.find(path);
+    if(it == nodes_.end()) {
+      return ZNONODE;
+    }
+    if(version != -1 && version != it->second.version) {
+      return ZBADVERSION;
+    }
+    if(!it->second.children.empty()) {
+      return ZNOTEMPTY;
+    }
+    auto owner = sessions_.find(it->second.ephemeralOwner);
+    if(owner != sessions_.end()) {
+      owner->second.ephemerals.erase(path);
+    }
+    nodes_.erase(it);
+    auto parentPath = parentOf(path);
+    auto &parent = nodes_[parentPath];
+    parent.children.erase(nameOf(path));
+    parent.cversion++;
+    parent.pzxid = ++zxid_;
+    t.push_back(Trigger{path, ZOO_DELETED_EVENT});
+    t.push_back(Trigger{parentPath, ZOO_CHILD_EVENT});
+    return ZOK;
+  }
+
+  int32_t setData(const std::string &path,
+                  const std::string &data,
+                  int32_t version,
+                  std::vector<Trigger> &triggers) {
+    auto it = nodes_.find(path);
+    if(it == nodes_.end()) {
+      return ZNONODE;
+    }
+    if(version != -1 && version != it->second.version) {
+      return ZBADVERSION;
+    }
+    it->second.data = data;
+    it->second.version++;
+    it->second.mzxid = ++zxid_;
+    it->second.mtime = nowMs();
+    triggers.push_back(Trigger{path, ZOO_CHANGED_EVENT});
+    return ZOK;
+  }
+
+  int32_t check(const std::string &path, int32_t version) {
+    auto it = nodes_.find(path);
+    if(it == nodes_.end()) {
+      return ZNONODE;
+    }
+    if(version != -1 && version != it->second.version) {
+      return ZBADVERSION;
+    }
+    return ZOK;
+  }
+
+  // All or nothing: apply in order, roll back to a copy on the first error.
+  std::string multi(int64_t owner, JuteIn &in, std::vector<Trigger> &triggers) {
+    std::vector<MultiOp> ops;
+    for(;;) {
+      MultiOp op;
+      op.type = in.i32();
+      bool done = in.boolean();
+      in.i32(); // err
+      if(done || !in.ok) {
+        break;
+      }
+      op.path = in.str();
+      if(op.type == kCreate || op.type == kCreate2) {
+        op.data = in.str();
+        in.acls();
+        op.flags = in.i32();
+      } else if(op.type == kSetData) {
+        op.data = in.str();
+        op.version = in.i32();
+      } else {
+        op.version = in.i32();
+      }
+      ops.push_back(op);
+    }
+
+    auto nodesBackup = nodes_;
+    auto sessionsBackup = sessions_;
+    auto zxidBackup = zxid_;
+    std::vector<int32_t> errs(ops.size(), ZRUNTIMEINCONSISTENCY);
+    std::vector<std::string> bodies(ops.size());
+    bool failed = false;
+    for(auto i = 0u; i < ops.size() && !failed; ++i) {
+      auto &op = ops[i];
+      JuteOut body;
+      if(op.type == kCreate || op.type == kCreate2) {
+        std::string created;
+        errs[i] = create(owner, op.path, op.data, op.flags, triggers, created);
+        body.str(created);
+      } else if(op.type == kDelete) {
+        errs[i] = remove(op.path, op.version, triggers);
+      } else if(op.type == kSetData) {
+        errs[i] = setData(op.path, op.data, op.version, triggers);
+        if(errs[i] == ZOK) {
+          body.stat(nodes_[op.path]);
+        }
+      } else if(op.type == kCheck) {
+        errs[i] = check(op.path, op.version);
+      } else {
+        errs[i] = ZUNIMPLEMENTED;
+      }
+      bodies[i] = body.buf;
+      failed = errs[i] != ZOK;
+    }
+    if(failed) {
+      nodes_.swap(nodesBackup);
+      sessions_.swap(sessionsBackup);
+      zxid_ = zxidBackup;
+      triggers.clear();
+    }
+
+    JuteOut out;
+    for(auto i = 0u; i < ops.size(); ++i) {
+      if(failed) {
+        out.i32(kError);
+        out.boolean(false);
+        out.i32(errs[i]);
+        out.i32(errs[i]);
+      } else {
+        out.i32(ops[i].type);
+        out.boolean(false);
+        out.i32(ZOK);
+        out.buf.append(bodies[i]);
+      }
+    }
+    out.i32(-1);
+    out.boolean(true);
+    out.i32(-1);
+    return out.buf;
+  }
+
+  // The client re-registers its watches after a reconnect. Fire right away
+  // for anything that changed past the last zxid it saw.
+  void setWatches(Session &session, JuteIn &in) {
+    auto relZxid = in.i64();
+    auto data = in.strs();
+    auto exist = in.strs();
+    auto child = in.strs();
+    for(auto &p : data) {
+      auto it = nodes_.find(p);
+      if(it == nodes_.end()) {
+        sendEvent(session, ZOO_DELETED_EVENT, p);
+      } else if(it->second.mzxid > relZxid) {
+        sendEvent(session, ZOO_CHANGED_EVENT, p);
+      } else {
+        dataWatches_[p].insert(session.id);
+      }
+    }
+    for(auto &p : exist) {
+      if(nodes_.count(p)) {
+        sendEvent(session, ZOO_CREATED_EVENT, p);
+      } else {
+        dataWatches_[p].insert(session.id);
+      }
+    }
+    for(auto &p : child) {
+      auto it = nodes_.find(p);
+      if(it == nodes_.end()) {
+        sendEvent(session, ZOO_DELETED_EVENT, p);
+      } else if(it->second.pzxid > relZxid) {
+        sendEvent(session, ZOO_CHILD_EVENT, p);
+      } else {
+        childWatches_[p].insert(session.id);
+      }
+    }
+  }
+
+  void sendEvent(Session &session, int type, const std::string &path) {
+    auto c = conns_.find(session.fd);
+    if(c == conns_.end() || c->second.closing) {
+      return;
+    }
+    JuteOut out;
+    out.i32(-1); // xid of a notification
+    out.i64(-1);
+    out.i32(ZOK);
+    out.i32(type);
+    out.i32(ZOO_CONNECTED_STATE);
+    out.str(path);
+    send(c->second, out);
+  }
+
+  // Watches are one shot: collect the watchers, drop them, then notify.
+  void fire(const std::vector<Trigger> &triggers) {
+    for(auto &t : triggers) {
+      std::set<int64_t> watchers;
+      auto take = [&watchers, &t](std::map<std::string, std::set<int64_t>> &m) {
+        auto it = m.find(t.path);
+        if(it != m.end()) {
+          watchers.insert(it->second.begin(), it->second.end());
+          m.erase(it);
+        }
+      };
+      if(t.type == ZOO_CHILD_EVENT) {
+        take(childWatches_);
+      } else {
+        take(dataWatches_);
+      }
+      if(t.type == ZOO_DELETED_EVENT) {
+        take(childWatches_);
+      }
+      for(auto id : watchers) {
+        auto s = sessions_.find(id);
+        if(s != sessions_.end()) {
+          sendEvent(s->second, t.type, t.path);
+        }
+      }
+    }
+  }
+
+  // Watches belong to the connection; the client re-sends them on reconnect.
+  void detach(Session &session) {
+    session.fd = -1;
+    for(auto *m : {&dataWatches_, &childWatches_}) {
+      for(auto &w : *m) {
+        w.second.erase(session.id);
+      }
+    }
+  }
+
+  void expire(int64_t sessionId) {
+    auto it = sessions_.find(sessionId);
+    if(it == sessions_.end()) {
+      return;
+    }
+    LOG(INFO) << "Expiring session: " << sessionId;
+    auto ephemerals = it->second.ephemerals;
+    std::vector<Trigger> triggers;
+    for(auto &path : ephemerals) {
+      remove(path, -1, triggers);
+    }
+    auto c = conns_.find(it->second.fd);
+    if(c != conns_.end()) {
+      c->second.closing = true;
+    }
+    detach(it->second);
+    sessions_.erase(it);
+    fire(triggers);
+  }
+
+  void expireIdleSessions() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<int64_t> idle;
+    for(auto &s : sessions_) {
+      if(now - s.second.lastHeard
+         > std::chrono::milliseconds(s.second.timeoutMs)) {
+        idle.push_back(s.first);
+      }
+    }
+    for(auto id : idle) {
+      expire(id);
+    }
+  }
+
+  const int tickMs_;
+  uint16_t port_{0};
+  int listenFd_{-1};
+  int wakeFds_[2];
+  std::atomic<bool> running_{true};
+  std::thread loop_;
+  std::mutex tasksMutex_;
+  std::vector<std::packaged_task<void()>> tasks_;
+
+  // only touched from the loop thread
+  std::map<int, Conn> conns_;
+  std::map<int64_t, Session> sessions_;
+  std::map<std::string, Node> nodes_;
+  std::map<std::string, std::set<int64_t>> dataWatches_;
+  std::map<std::string, std::set<int64_t>> childWatches_;
+  int64_t zxid_{0};
+  int64_t nextSessionId_{0x100};
+  std::mt19937 rand_{std::random_device()()};
+};
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <gtest/gtest.h>
+#include <folly/Uri.h>
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+#include "bolt/testutils/ZooKeeperFaultProxy.hpp"
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/zookeeper/ZKLeader.hpp"
+
+namespace bolt {
+// Same fixtures as ZooKeeperHarness / ZooKeeperLeaderElectionHarness, backed
+// by an InMemoryZooKeeper instead of a JVM. Starts in milliseconds and gives
+// each test its own server on a free port.
+class InMemoryZooKeeperHarness : public ::testing::Test {
+  public:
+  virtual void SetUp() {
+    server = std::make_unique<InMemoryZooKeeper>();
+    zk = std::make_shared<ZKClient>([](int, int, std::string, ZKClient *) {},
+                                    server->hosts());
+  }
+  virtual void TearDown() {
+    zk = nullptr;
+    server = nullptr;
+  }
+
+  std::unique_ptr<InMemoryZooKeeper> server;
+  std::shared_ptr<ZKClient> zk;
+};
+
+// The client talks to the server through a ZooKeeperFaultProxy.
+class InMemoryZooKeeperFaultHarness : public ::testing::Test {
+  public:
+  virtual void SetUp() {
+    server = std::make_unique<InMemoryZooKeeper>();
+    proxy = std::make_unique<ZooKeeperFaultProxy>(server->port());
+    proxy->setExpireHook([this] { server->expireAllSessions(); });
+    zk = std::make_shared<ZKClient>([](int, int, std::string, ZKClient *) {},
+                                    proxy->hosts());
+  }
+  virtual void TearDown() {
+    zk = nullptr;
+    proxy = nullptr;
+    server = nullptr;
+  }
+
+  std::unique_ptr<InMemoryZooKeeper> server;
+  std::unique_ptr<ZooKeeperFaultProxy> proxy;
+  std::shared_ptr<ZKClient> zk;
+};
+
+class InMemoryZooKeeperLeaderElectionHarness : public ::testing::Test {
+  public:
+  virtual void SetUp() {
+    server = std::make_unique<InMemoryZooKeeper>();
+    zkUri = folly::Uri("zk:///bolt?host=" + server->hosts());
+
+    for(auto i = 0u; i < 3; ++i) {
+      leaders.push_back(std::make_shared<ZKLeader>(
+        zkUri, [](ZKLeader *) { LOG(INFO) << "harness leader cb"; },
+        [](int type, int state, std::string path, ZKClient *cli) {
+          LOG(INFO) << "harness zoo cb";
+        }));
+    }
+
+    CHECK(waitForLeader()) << "Could not get a single leader elected. FIXME NOW";
+  }
+  virtual void TearDown() {
+    leaders.clear();
+    server = nullptr;
+  }
+
+  std::shared_ptr<ZKLeader> waitForLeader() {
+    int maxTries = 100;
+    while(maxTries-- > 0) {
+      for(auto &ptr : leaders) {
+        if(ptr->isLeader()) {
+          return ptr;
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return nullptr;
+  }
+
+  std::unique_ptr<InMemoryZooKeeper> server;
+  folly::Uri zkUri{"zk:///bolt"};
+  std::deque<std::shared_ptr<ZKLeader>> leaders;
+};
+}
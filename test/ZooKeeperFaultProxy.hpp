@@ -0,0 +1,389 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+
+namespace bolt {
+// Local TCP proxy to put between a client and a ZooKeeper server (real or
+// InMemoryZooKeeper) to inject faults: latency, dropped or refused
+// connections, stalls and - through a hook into the server - session expiry.
+//
+// Faults can be flipped by hand or scripted with run(). For benchmarks,
+// lastRecoveryTime() reports how long the client took from heal()/drop() to
+// getting bytes back from the server on a fresh connection.
+class ZooKeeperFaultProxy {
+  public:
+  typedef std::chrono::steady_clock Clock;
+
+  // One step of a scenario: wait `after` (from the previous step), then act.
+  struct Step {
+    std::chrono::milliseconds after;
+    std::string name;
+    std::function<void(ZooKeeperFaultProxy &)> action;
+  };
+
+  static Step latency(std::chrono::milliseconds after,
+                      std::chrono::milliseconds delay) {
+    return Step{after, "latency",
+                [delay](ZooKeeperFaultProxy &p) { p.setLatency(delay); }};
+  }
+  static Step drop(std::chrono::milliseconds after) {
+    return Step{after, "drop",
+                [](ZooKeeperFaultProxy &p) { p.dropConnections(); }};
+  }
+  static Step stall(std::chrono::milliseconds after) {
+    return Step{after, "stall",
+                [](ZooKeeperFaultProxy &p) { p.setStalled(true); }};
+  }
+  static Step refuse(std::chrono::milliseconds after) {
+    return Step{after, "refuse",
+                [](ZooKeeperFaultProxy &p) { p.setRefusing(true); }};
+  }
+  static Step expire(std::chrono::milliseconds after) {
+    return Step{after, "expire",
+                [](ZooKeeperFaultProxy &p) { p.expireSessions(); }};
+  }
+  static Step heal(std::chrono::milliseconds after) {
+    return Step{after, "heal", [](ZooKeeperFaultProxy &p) { p.heal(); }};
+  }
+
+  explicit ZooKeeperFaultProxy(uint16_t upstreamPort,
+                               std::string upstreamHost = "127.0.0.1")
+    : upstreamHost_(std::move(upstreamHost)), upstreamPort_(upstreamPort) {
+    listenFd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    PCHECK(listenFd_ >= 0) << "socket";
+    int one = 1;
+    ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    PCHECK(::bind(listenFd_, (sockaddr *)&addr, sizeof(addr)) == 0) << "bind";
+    PCHECK(::listen(listenFd_, 128) == 0) << "listen";
+    socklen_t len = sizeof(addr);
+    PCHECK(::getsockname(listenFd_, (sockaddr *)&addr, &len) == 0);
+    port_ = ntohs(addr.sin_port);
+    ::fcntl(listenFd_, F_SETFL, ::fcntl(listenFd_, F_GETFL, 0) | O_NONBLOCK);
+    loop_ = std::thread([this] { loop(); });
+  }
+
+  ~ZooKeeperFaultProxy() {
+    running_ = false;
+    if(script_.joinable()) {
+      script_.join();
+    }
+    loop_.join();
+    for(auto &p : pipes_) {
+      ::close(p.first);
+      ::close(p.second.upstream);
+    }
+    ::close(listenFd_);
+  }
+
+  uint16_t port() const { return port_; }
+  std::string hosts() const { return "127.0.0.1:" + std::to_string(port_); }
+
+  // Added to every chunk, in both directions.
+  void setLatency(std::chrono::milliseconds delay) { latencyMs_ = delay.count(); }
+
+  // Stop moving bytes but keep the sockets open: the client only notices
+  // through its own timeouts, like with a partitioned or GC-paused server.
+  void setStalled(bool stalled) { stalled_ = stalled; }
+
+  // Accept and immediately close new connections.
+  void setRefusing(bool refusing) { refusing_ = refusing; }
+
+  // Close every proxied connection now.
+  void dropConnections() {
+    markFault();
+    dropAll_ = true;
+  }
+
+  // Session expiry needs the server's cooperation. With no hook set, stall
+  // until the ensemble gives up on the session yourself.
+  void setExpireHook(std::function<void()> hook) { expireHook_ = hook; }
+
+  void expireSessions() {
+    CHECK(expireHook_) << "No expire hook, stall past the session timeout";
+    markFault();
+    expireHook_();
+  }
+
+  void heal() {
+    latencyMs_ = 0;
+    stalled_ = false;
+    refusing_ = false;
+    markFault();
+  }
+
+  // Runs the steps on a background thread, in order.
+  void run(std::vector<Step> steps) {
+    if(script_.joinable()) {
+      script_.join();
+    }
+    script_ = std::thread([this, steps] {
+      for(auto &step : steps) {
+        std::this_thread::sleep_for(step.after);
+        if(!running_) {
+          return;
+        }
+        LOG(INFO) << "Fault proxy step: " << step.name;
+        step.action(*this);
+      }
+    });
+  }
+
+  void waitForScript() {
+    if(script_.joinable()) {
+      script_.join();
+    }
+  }
+
+  // Time from the last fault/heal to the first server bytes reaching the
+  // client over a connection opened after it. Zero until that happened.
+  std::chrono::nanoseconds lastRecoveryTime() const {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    return recovered_ ? recoveredAt_ - faultAt_ : std::chrono::nanoseconds(0);
+  }
+
+  uint64_t connectionsAccepted() const { return accepted_; }
+
+  // Requests of type `op` (ZOO_CREATE_OP, ZOO_SETDATA_OP...) clients sent
+  // through us. Counted as they are read, faults or not.
+  uint64_t requests(int32_t op) const {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    auto it = requests_.find(op);
+    return it == requests_.end() ? 0 : it->second;
+  }
+
+  private:
+  struct Chunk {
+    Clock::time_point due;
+    std::string bytes;
+  };
+
+  struct Pipe {
+    int upstream;
+    Clock::time_point openedAt;
+    std::deque<Chunk> toUpstream;
+    std::deque<Chunk> toClient;
+    bool closing{false};
+    // client bytes not framed yet; the first frame is the connect request
+    std::string framing;
+    bool handshaken{false};
+  };
+
+  void markFault() {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    faultAt_ = Clock::now();
+    recovered_ = false;
+  }
+
+  void markServerBytes(const Pipe &pipe) {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    if(!recovered_ && pipe.openedAt >= faultAt_
+       && faultAt_ != Clock::time_point()) {
+      recovered_ = true;
+      recoveredAt_ = Clock::now();
+    }
+  }
+
+  // Frames are a 4 byte length, then xid and op for everything but the
+  // connect request.
+  void countRequests(Pipe &pipe, const std::string &bytes) {
+    pipe.framing += bytes;
+    size_t at = 0;
+    while(pipe.framing.size() - at >= 4) {
+      uint32_t len;
+      std::memcpy(&len, pipe.framing.data() + at, 4);
+      len = ntohl(len);
+      if(pipe.framing.size() - at - 4 < len) {
+        break;
+      }
+      if(!pipe.handshaken) {
+        pipe.handshaken = true;
+      } else if(len >= 8) {
+        int32_t op;
+        std::memcpy(&op, pipe.framing.data() + at + 8, 4);
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        requests_[static_cast<int32_t>(ntohl(op))]++;
+      }
+      at += 4 + len;
+    }
+    pipe.framing.erase(0, at);
+  }
+
+  int connectUpstream() {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+      return -1;
+    }
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(upstreamPort_);
+    ::inet_pton(AF_INET, upstreamHost_.c_str(), &addr.sin_addr);
+    if(::connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static void setup(int fd) {
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+
+  void acceptAll() {
+    for(;;) {
+      int fd = ::accept(listenFd_, nullptr, nullptr);
+      if(fd < 0) {
+        return;
+      }
+      accepted_++;
+      int upstream = refusing_ ? -1 : connectUpstream();
+      if(upstream < 0) {
+        ::close(fd);
+        continue;
+      }
+      setup(fd);
+      setup(upstream);
+      Pipe pipe;
+      pipe.upstream = upstream;
+      pipe.openedAt = Clock::now();
+      pipes_.emplace(fd, std::move(pipe));
+    }
+  }
+
+  // false when the peer went away
+  bool pump(int from, std::deque<Chunk> &into) {
+    char buf[16384];
+    for(;;) {
+      auto n = ::read(from, buf, sizeof(buf));
+      if(n > 0) {
+        into.push_back(Chunk{Clock::now()
+                               + std::chrono::milliseconds(latencyMs_.load()),
+                             std::string(buf, n)});
+        continue;
+      }
+      return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+  }
+
+  // false on a write error
+  bool deliver(int to, std::deque<Chunk> &from, Clock::time_point now) {
+    while(!from.empty() && from.front().due <= now) {
+      auto &chunk = from.front();
+      auto n = ::send(to, chunk.bytes.data(), chunk.bytes.size(), MSG_NOSIGNAL);
+      if(n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      if(static_cast<size_t>(n) < chunk.bytes.size()) {
+        chunk.bytes.erase(0, n);
+        return true;
+      }
+      from.pop_front();
+    }
+    return true;
+  }
+
+  void loop() {
+    while(running_) {
+      if(dropAll_.exchange(false)) {
+        for(auto &p : pipes_) {
+          p.second.closing = true;
+        }
+      }
+      for(auto it = pipes_.begin(); it != pipes_.end();) {
+        if(it->second.closing) {
+          ::close(it->first);
+          ::close(it->second.upstream);
+          it = pipes_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+
+      const bool stalled = stalled_;
+      std::vector<pollfd> fds;
+      fds.push_back(pollfd{listenFd_, POLLIN, 0});
+      for(auto &p : pipes_) {
+        short events = stalled ? 0 : POLLIN;
+        fds.push_back(pollfd{p.first, events, 0});
+        fds.push_back(pollfd{p.second.upstream, events, 0});
+      }
+      // short timeout: latency queues and fault flags are checked each pass
+      ::poll(fds.data(), fds.size(), 1);
+
+      if(fds[0].revents & POLLIN) {
+        acceptAll();
+      }
+      if(stalled) {
+        continue;
+      }
+      auto now = Clock::now();
+      for(auto &p : pipes_) {
+        auto &pipe = p.second;
+        if(pipe.closing) {
+          continue;
+        }
+        const auto before = pipe.toClient.size();
+        const auto sent = pipe.toUpstream.size();
+        bool ok = pump(p.first, pipe.toUpstream)
+                  && pump(pipe.upstream, pipe.toClient);
+        for(auto i = sent; i < pipe.toUpstream.size(); ++i) {
+          countRequests(pipe, pipe.toUpstream[i].bytes);
+        }
+        if(pipe.toClient.size() > before) {
+          markServerBytes(pipe);
+        }
+        ok = ok && deliver(pipe.upstream, pipe.toUpstream, now)
+             && deliver(p.first, pipe.toClient, now);
+        pipe.closing = !ok;
+      }
+    }
+  }
+
+  const std::string upstreamHost_;
+  const uint16_t upstreamPort_;
+  uint16_t port_{0};
+  int listenFd_{-1};
+  std::atomic<bool> running_{true};
+  std::atomic<bool> stalled_{false};
+  std::atomic<bool> refusing_{false};
+  std::atomic<bool> dropAll_{false};
+  std::atomic<int64_t> latencyMs_{0};
+  std::atomic<uint64_t> accepted_{0};
+  std::function<void()> expireHook_;
+  std::thread loop_;
+  std::thread script_;
+
+  mutable std::mutex statsMutex_;
+  Clock::time_point faultAt_;
+  Clock::time_point recoveredAt_;
+  bool recovered_{false};
+  std::map<int32_t, uint64_t> requests_;
+
+  // only touched from the loop thread
+  std::map<int, Pipe> pipes_;
+};
+}
@@ -1,9 +1,11 @@
 #include <bolt/glog_init.hpp>
 #include <algorithm>
 #include <limits>
+#include <set>
 #include <gtest/gtest.h>
 #include <zookeeper/zookeeper.h>
 #include "bolt/testutils/ZooKeeperLeaderElectionHarness.hpp"
+#include "bolt/testutils/InMemoryZooKeeperHarness.hpp"
 #include "bolt/utils/Random.hpp"
 
 using namespace bolt;
@@ -113,6 +115,153 @@ TEST_F(ZooKeeperLeaderElectionHarness, randomPopingOrder) {
   }
 }
 
+TEST_F(ZooKeeperLeaderElectionHarness, fencingTokenGrowsWithEachLeader) {
+  int64_t lastToken = -1;
+  while(!leaders.empty()) {
+    auto leader = std::find_if(
+      leaders.begin(), leaders.end(),
+      [](std::shared_ptr<ZKLeader> l) { return l->isLeader(); });
+    int maxTries = 100;
+    while(leader == leaders.end() && maxTries-- > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      leader = std::find_if(
+        leaders.begin(), leaders.end(),
+        [](std::shared_ptr<ZKLeader> l) { return l->isLeader(); });
+    }
+    ASSERT_TRUE(leader != leaders.end());
+    EXPECT_EQ(ZKLeader::State::kLeader, (*leader)->state());
+    EXPECT_GT((*leader)->fencingToken(), lastToken);
+    lastToken = (*leader)->fencingToken();
+    leaders.erase(leader);
+  }
+}
+
+TEST_F(ZooKeeperLeaderElectionHarness, lostCallbackOnDeletedNode) {
+  std::atomic<int> elected{0}, lost{0};
+  auto leader = std::make_shared<ZKLeader>(
+    zkUri, [&elected](ZKLeader *) { elected++; },
+    [&lost](ZKLeader *) { lost++; },
+    [](int type, int state, std::string path, ZKClient *cli) {});
+  leaders.clear();
+  int maxTries = 100;
+  while(!leader->isLeader() && maxTries-- > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(leader->isLeader());
+  EXPECT_EQ(1, elected.load());
+
+  // somebody else removes our node: step down instead of crashing
+  leader->client()->delSync(leader->ephemeralPath());
+  maxTries = 100;
+  while(leader->isLeader() && maxTries-- > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_FALSE(leader->isLeader());
+  EXPECT_EQ(1, lost.load());
+}
+
+TEST_F(InMemoryZooKeeperLeaderElectionHarness, leaderSessionExpiry) {
+  auto leader = waitForLeader();
+  ASSERT_TRUE(leader != nullptr);
+  const auto token = leader->fencingToken();
+  const auto oldId = leader->id();
+
+  server->expireSession(leader->client()->getSessionId());
+  int maxTries = 100;
+  while(leader->id() == oldId && maxTries-- > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  // back in the race at the end of the queue, somebody else took over
+  EXPECT_NE(oldId, leader->id());
+  EXPECT_FALSE(leader->isLeader());
+  EXPECT_GT(leader->fencingToken(), token);
+  auto next = waitForLeader();
+  ASSERT_TRUE(next != nullptr);
+  EXPECT_NE(leader, next);
+  EXPECT_GT(next->fencingToken(), token);
+}
+
+TEST_F(InMemoryZooKeeperHarness, electionsShareOneSession) {
+  auto noop = [](int, int, std::string, ZKClient *) {};
+  std::vector<std::vector<std::unique_ptr<ZKLeader>>> shards(3);
+  for(auto i = 0u; i < shards.size(); ++i) {
+    folly::Uri uri("zk:///shards/" + std::to_string(i));
+    for(auto j = 0; j < 2; ++j) {
+      shards[i].push_back(std::make_unique<ZKLeader>(
+        zk, uri, [](ZKLeader *) {}, [](ZKLeader *) {}, noop));
+    }
+  }
+  EXPECT_EQ(1u, server->sessionCount());
+  for(auto &shard : shards) {
+    // lowest id wins, and the first one registered has it
+    EXPECT_TRUE(shard[0]->isLeader());
+    EXPECT_FALSE(shard[1]->isLeader());
+  }
+
+  // its node goes with it, the session stays
+  shards[1][0] = nullptr;
+  int maxTries = 100;
+  while(!shards[1][1]->isLeader() && maxTries-- > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_TRUE(shards[1][1]->isLeader());
+  EXPECT_TRUE(shards[0][0]->isLeader());
+  EXPECT_FALSE(shards[0][1]->isLeader());
+  EXPECT_TRUE(shards[2][0]->isLeader());
+}
+
+TEST_F(InMemoryZooKeeperHarness, asyncCreate) {
+  folly::Uri uri("zk:///async?host=" + server->hosts());
+  auto noop = [](int, int, std::string, ZKClient *) {};
+  std::vector<Future<std::shared_ptr<ZKLeader>>> pending;
+  for(auto i = 0; i < 5; ++i) {
+    pending.push_back(ZKLeader::create(
+      zk, uri, [](ZKLeader *) {}, [](ZKLeader *) {}, noop));
+    // with its own, not yet connected, session
+    pending.push_back(
+      ZKLeader::create(uri, [](ZKLeader *) {}, [](ZKLeader *) {}, noop));
+  }
+  auto all = collectAll(pending.begin(), pending.end())
+               .get(std::chrono::seconds(10));
+  std::set<int32_t> ids;
+  int leaders = 0;
+  for(auto &t : all) {
+    ASSERT_TRUE(t.hasValue());
+    ids.insert(t.value()->id());
+    leaders += t.value()->isLeader();
+  }
+  EXPECT_EQ(10u, ids.size());
+  EXPECT_EQ(1, leaders);
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, leaderWithIdZeroResumes) {
+  std::atomic<int> elected{0}, lost{0}, connecting{0};
+  // on a fresh election path the first candidate gets id 0
+  auto leader = std::make_shared<ZKLeader>(
+    zk, folly::Uri("zk:///fresh"), [&elected](ZKLeader *) { elected++; },
+    [&lost](ZKLeader *) { lost++; },
+    [&connecting](int type, int state, std::string, ZKClient *) {
+      if(type == ZOO_SESSION_EVENT && state == ZOO_CONNECTING_STATE) {
+        connecting++;
+      }
+    });
+  ASSERT_EQ(0, leader->id());
+  ASSERT_TRUE(leader->isLeader());
+  leader->setStepDownTimeout(std::chrono::seconds(30));
+
+  proxy->dropConnections();
+  int maxTries = 500;
+  while((connecting.load() == 0 || !leader->isLeader()) && maxTries-- > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_LT(0, connecting.load()) << "connection never dropped";
+  // the session survived: still the leader, and never told otherwise
+  EXPECT_TRUE(leader->isLeader());
+  EXPECT_EQ(ZKLeader::State::kLeader, leader->state());
+  EXPECT_EQ(1, elected.load());
+  EXPECT_EQ(0, lost.load());
+}
+
 TEST(ZookeeperLeaderEphemeralNode, id_parsing) {
   auto str = "asdfasdfasdf_70f7d1ad-6a4c-4ad4-b187-d33483ebd728_n_0000000002";
   auto ret = ZKLeader::extractIdFromEphemeralPath(str);
@@ -132,6 +281,23 @@ TEST(ZookeeperLeaderEphemeralNode, id_parsing_close_but_no_cigar) {
   ASSERT_EQ(boost::none, ret);
 }
 
+TEST(ZookeeperLeaderEphemeralNode, id_parsing_out_of_range) {
+  auto str = "asdfasdfasdf_70f7d1ad-6a4c-4ad4-b187-d33483ebd728_n_9999999999";
+  ASSERT_EQ(boost::none, ZKLeader::extractIdFromEphemeralPath(str));
+  ASSERT_EQ(boost::none, ZKLeader::extractIdFromEphemeralPath("_n_00000/0002"));
+}
+
+TEST(ZookeeperLeaderEphemeralNode, scan_candidates) {
+  std::vector<std::string> children{
+    "a_n_0000000007", "b_n_0000000003", "not_a_candidate", "c_n_0000000005"};
+  auto c = ZKLeader::scanCandidates(children, 5);
+  EXPECT_EQ(3u, c.count);
+  EXPECT_EQ(3, c.lowest);
+  EXPECT_TRUE(c.foundOurs);
+  EXPECT_FALSE(ZKLeader::scanCandidates(children, 4).foundOurs);
+  EXPECT_EQ(0u, ZKLeader::scanCandidates({}, 4).count);
+}
+
 int main(int argc, char **argv) {
   bolt::logging::glog_init(argv[0]);
   testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <folly/Benchmark.h>
+#include <zookeeper/zookeeper.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+
+using namespace bolt;
+
+// Counts every allocation in the process, the in-memory server's included:
+// both variants pay the same for the server, the difference is ours.
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if(void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+struct CompactBench {
+  CompactBench() : zk([](int, int, std::string, ZKClient *) {}, server.hosts()) {
+    zk.createSync("/compact", folly::IOBuf::copyBuffer("x"),
+                  &ZOO_OPEN_ACL_UNSAFE, 0);
+    for(auto i = 0; i < 8; ++i) {
+      zk.createSync("/compact/child-" + std::to_string(i),
+                    std::make_unique<folly::IOBuf>(), &ZOO_OPEN_ACL_UNSAFE,
+                    0);
+    }
+  }
+  InMemoryZooKeeper server;
+  ZKClient zk;
+};
+
+template <class R, class F>
+void run(uint32_t iters, const char *name, F &&op) {
+  folly::BenchmarkSuspender setup;
+  CompactBench b;
+  setup.dismiss();
+  const auto before = allocations.load();
+  for(auto i = 0u; i < iters; ++i) {
+    op(b.zk);
+  }
+  const auto allocs = allocations.load() - before;
+  setup.rehire();
+  LOG(INFO) << name << ": " << sizeof(R) << " bytes per result, "
+            << double(allocs) / std::max(iters, 1u)
+            << " allocations per request";
+}
+}
+
+// One request at a time; sizes are what every future moves around.
+BENCHMARK(getZKResult, iters) {
+  run<ZKResult>(iters, "get, ZKResult", [](ZKClient &zk) {
+    CHECK(zk.get("/compact").get().ok());
+  });
+}
+
+BENCHMARK_RELATIVE(getCompact, iters) {
+  run<ZKGetResult>(iters, "get, ZKGetResult", [](ZKClient &zk) {
+    CHECK(zk.getCompact("/compact").get().ok());
+  });
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(existsZKResult, iters) {
+  run<ZKResult>(iters, "exists, ZKResult", [](ZKClient &zk) {
+    CHECK(zk.exists("/compact").get().ok());
+  });
+}
+
+BENCHMARK_RELATIVE(existsCompact, iters) {
+  run<ZKStatResult>(iters, "exists, ZKStatResult", [](ZKClient &zk) {
+    CHECK(zk.existsCompact("/compact").get().ok());
+  });
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(childrenZKResult, iters) {
+  run<ZKResult>(iters, "children, ZKResult", [](ZKClient &zk) {
+    CHECK(zk.children("/compact").get().ok());
+  });
+}
+
+BENCHMARK_RELATIVE(childrenCompact, iters) {
+  run<ZKChildrenResult>(iters, "children, ZKChildrenResult", [](ZKClient &zk) {
+    CHECK(zk.childrenCompact("/compact").get().ok());
+  });
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(createFailsZKResult, iters) {
+  run<ZKResult>(iters, "failed create, ZKResult", [](ZKClient &zk) {
+    CHECK_EQ(ZNODEEXISTS,
+             zk.create("/compact", std::make_unique<folly::IOBuf>(),
+                       &ZOO_OPEN_ACL_UNSAFE, 0)
+               .get()
+               .result);
+  });
+}
+
+BENCHMARK_RELATIVE(createFailsCompact, iters) {
+  run<ZKCreateResult>(iters, "failed create, ZKCreateResult", [](ZKClient &zk) {
+    CHECK_EQ(ZNODEEXISTS,
+             zk.createCompact("/compact", std::make_unique<folly::IOBuf>(),
+                              &ZOO_OPEN_ACL_UNSAFE, 0)
+               .get()
+               .result);
+  });
+}
+
@@ -0,0 +1,72 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include <folly/Benchmark.h>
+#include <zookeeper/zookeeper.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+
+using namespace bolt;
+
+namespace {
+// /tenant with `nodes` leaves spread over 100 directories.
+void buildTenant(ZKClient &zk, size_t nodes) {
+  std::vector<ZKOp> ops;
+  auto flush = [&] {
+    CHECK(zk.multi(std::move(ops)).get().ok());
+    ops.clear();
+  };
+  ops.push_back(ZKOp::create("/tenant", std::make_unique<folly::IOBuf>(),
+                             &ZOO_OPEN_ACL_UNSAFE, 0));
+  for(auto d = 0u; d < 100; ++d) {
+    ops.push_back(ZKOp::create("/tenant/" + std::to_string(d),
+                               std::make_unique<folly::IOBuf>(),
+                               &ZOO_OPEN_ACL_UNSAFE, 0));
+  }
+  for(auto i = 0u; i < nodes; ++i) {
+    ops.push_back(ZKOp::create("/tenant/" + std::to_string(i % 100) + "/"
+                                 + std::to_string(i),
+                               std::make_unique<folly::IOBuf>(),
+                               &ZOO_OPEN_ACL_UNSAFE, 0));
+    if(ops.size() == 1000) {
+      flush();
+    }
+  }
+  flush();
+}
+
+// what callers wrote by hand: one blocking round trip per node
+void deleteOneByOne(ZKClient &zk, const std::string &path) {
+  auto r = zk.childrenSync(path);
+  for(auto &child : r.strings) {
+    deleteOneByOne(zk, path + "/" + child);
+  }
+  zk.delSync(path);
+}
+
+void teardown(uint32_t iters, size_t nodes, bool pipelined) {
+  for(auto i = 0u; i < iters; ++i) {
+    folly::BenchmarkSuspender setup;
+    InMemoryZooKeeper server;
+    ZKClient zk([](int, int, std::string, ZKClient *) {}, server.hosts());
+    buildTenant(zk, nodes);
+    setup.dismiss();
+    if(pipelined) {
+      CHECK_EQ(ZOK, zk.deleteRecursive("/tenant").get().result);
+    } else {
+      deleteOneByOne(zk, "/tenant");
+    }
+    setup.rehire();
+  }
+}
+
+void oneByOne(uint32_t iters, size_t nodes) { teardown(iters, nodes, false); }
+
+void pipelined(uint32_t iters, size_t nodes) { teardown(iters, nodes, true); }
+}
+
+BENCHMARK_PARAM(oneByOne, 1000)
+BENCHMARK_RELATIVE_PARAM(pipelined, 1000)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(oneByOne, 50000)
+BENCHMARK_RELATIVE_PARAM(pipelined, 50000)
@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+#include <boost/regex.hpp>
+#include <folly/Benchmark.h>
+#include "bolt/zookeeper/ZKLeader.hpp"
+
+using namespace bolt;
+
+namespace {
+const size_t kCandidates = 10000;
+
+std::vector<std::string> candidateNames() {
+  std::vector<std::string> names;
+  char seq[16];
+  for(auto i = 0u; i < kCandidates; ++i) {
+    snprintf(seq, sizeof(seq), "%010u", kCandidates - i);
+    names.push_back("70f7d1ad-6a4c-4ad4-b187-d33483ebd728_n_"
+                    + std::string(seq));
+  }
+  return names;
+}
+
+// what leaderElect used to do
+boost::optional<int32_t> regexId(const std::string &path) {
+  static const boost::regex zkid(".*(\\d{10})$");
+  boost::smatch what;
+  if(boost::regex_search(path, what, zkid)) {
+    return std::stoi(what[1].str());
+  }
+  return boost::none;
+}
+}
+
+BENCHMARK(regexAndSet, iters) {
+  folly::BenchmarkSuspender setup;
+  auto names = candidateNames();
+  setup.dismiss();
+  for(auto i = 0u; i < iters; ++i) {
+    std::set<int32_t> running;
+    for(auto &s : names) {
+      running.insert(regexId(s).get());
+    }
+    folly::doNotOptimizeAway(*running.begin());
+    folly::doNotOptimizeAway(running.count(42));
+  }
+}
+
+BENCHMARK_RELATIVE(scanCandidates, iters) {
+  folly::BenchmarkSuspender setup;
+  auto names = candidateNames();
+  setup.dismiss();
+  for(auto i = 0u; i < iters; ++i) {
+    auto c = ZKLeader::scanCandidates(names, 42);
+    folly::doNotOptimizeAway(c);
+  }
+}
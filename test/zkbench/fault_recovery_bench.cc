@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <folly/Benchmark.h>
+#include <zookeeper/zookeeper.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+#include "bolt/testutils/ZooKeeperFaultProxy.hpp"
+
+using namespace bolt;
+
+namespace {
+struct FaultBench {
+  FaultBench()
+    : proxy(server.port())
+    , zk([](int, int, std::string, ZKClient *) {}, proxy.hosts()) {
+    proxy.setExpireHook([this] { server.expireAllSessions(); });
+    zk.createSync("/bench", folly::IOBuf::copyBuffer("x"),
+                  &ZOO_OPEN_ACL_UNSAFE, 0);
+  }
+  InMemoryZooKeeper server;
+  ZooKeeperFaultProxy proxy;
+  ZKClient zk;
+};
+
+void printTail(const char *name, std::vector<int64_t> &us) {
+  if(us.empty()) {
+    return;
+  }
+  std::sort(us.begin(), us.end());
+  auto pct = [&us](double p) { return us[(us.size() - 1) * p]; };
+  LOG(INFO) << name << " latency us: p50=" << pct(0.5)
+            << " p99=" << pct(0.99) << " p999=" << pct(0.999)
+            << " max=" << us.back();
+}
+}
+
+// Time for a read to succeed again right after the connection is dropped.
+BENCHMARK(reconnectAfterDrop, iters) {
+  folly::BenchmarkSuspender setup;
+  FaultBench b;
+  std::vector<int64_t> recovery;
+  setup.dismiss();
+  for(auto i = 0u; i < iters; ++i) {
+    b.proxy.dropConnections();
+    CHECK(b.zk.getSync("/bench").ok());
+    recovery.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                         b.proxy.lastRecoveryTime())
+                         .count());
+  }
+  setup.rehire();
+  printTail("reconnectAfterDrop", recovery);
+}
+
+// Request tail latency while 1 in 50 requests runs into a dropped connection.
+BENCHMARK(getSyncUnderPeriodicDrops, iters) {
+  folly::BenchmarkSuspender setup;
+  FaultBench b;
+  std::vector<int64_t> latency;
+  setup.dismiss();
+  for(auto i = 0u; i < iters; ++i) {
+    if(i % 50 == 49) {
+      b.proxy.dropConnections();
+    }
+    auto start = std::chrono::steady_clock::now();
+    CHECK(b.zk.getSync("/bench").ok());
+    latency.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+  }
+  setup.rehire();
+  printTail("getSyncUnderPeriodicDrops", latency);
+}
+
+// Full expiry: new session, ephemerals and watches restored.
+BENCHMARK(recoverFromExpiry, iters) {
+  folly::BenchmarkSuspender setup;
+  FaultBench b;
+  b.zk.createSync("/bench/eph", std::make_unique<folly::IOBuf>(),
+                  &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL);
+  std::vector<int64_t> recovery;
+  setup.dismiss();
+  for(auto i = 0u; i < iters; ++i) {
+    auto session = b.zk.getSessionId();
+    auto start = std::chrono::steady_clock::now();
+    b.proxy.expireSessions();
+    while(b.zk.getSessionId() == session || !b.server.exists("/bench/eph")) {
+      std::this_thread::yield();
+    }
+    recovery.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count());
+  }
+  setup.rehire();
+  printTail("recoverFromExpiry", recovery);
+}
@@ -0,0 +1,80 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include <folly/Benchmark.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/zookeeper/ZKLeader.hpp"
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+
+using namespace bolt;
+
+namespace {
+auto noopZkCb = [](int, int, std::string, ZKClient *) {};
+
+folly::Uri shardUri(const InMemoryZooKeeper &server, size_t shard) {
+  return folly::Uri("zk:///startup/" + std::to_string(shard)
+                    + "?host=" + server.hosts());
+}
+
+// One session per election, constructed one after the other.
+void syncOwnSessions(uint32_t iters, size_t elections) {
+  for(auto i = 0u; i < iters; ++i) {
+    folly::BenchmarkSuspender setup;
+    InMemoryZooKeeper server;
+    std::vector<std::unique_ptr<ZKLeader>> leaders;
+    setup.dismiss();
+    for(auto j = 0u; j < elections; ++j) {
+      leaders.push_back(std::make_unique<ZKLeader>(
+        shardUri(server, j), [](ZKLeader *) {}, [](ZKLeader *) {}, noopZkCb));
+    }
+    setup.rehire();
+  }
+}
+
+// One session per election, all coming up at once.
+void asyncOwnSessions(uint32_t iters, size_t elections) {
+  for(auto i = 0u; i < iters; ++i) {
+    folly::BenchmarkSuspender setup;
+    InMemoryZooKeeper server;
+    std::vector<Future<std::shared_ptr<ZKLeader>>> pending;
+    setup.dismiss();
+    for(auto j = 0u; j < elections; ++j) {
+      pending.push_back(ZKLeader::create(
+        shardUri(server, j), [](ZKLeader *) {}, [](ZKLeader *) {}, noopZkCb));
+    }
+    auto leaders = collectAll(pending.begin(), pending.end()).get();
+    setup.rehire();
+  }
+}
+
+// All elections on one shared session, all coming up at once.
+void asyncSharedSession(uint32_t iters, size_t elections) {
+  for(auto i = 0u; i < iters; ++i) {
+    folly::BenchmarkSuspender setup;
+    InMemoryZooKeeper server;
+    setup.dismiss();
+    auto zk = std::make_shared<ZKClient>(noopZkCb, server.hosts(), 500, 0,
+                                         false);
+    std::vector<Future<std::shared_ptr<ZKLeader>>> pending;
+    for(auto j = 0u; j < elections; ++j) {
+      pending.push_back(ZKLeader::create(
+        zk, shardUri(server, j), [](ZKLeader *) {}, [](ZKLeader *) {},
+        noopZkCb));
+    }
+    auto leaders = collectAll(pending.begin(), pending.end()).get();
+    setup.rehire();
+  }
+}
+}
+
+BENCHMARK_PARAM(syncOwnSessions, 1)
+BENCHMARK_PARAM(syncOwnSessions, 100)
+BENCHMARK_PARAM(syncOwnSessions, 1000)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(asyncOwnSessions, 1)
+BENCHMARK_PARAM(asyncOwnSessions, 100)
+BENCHMARK_PARAM(asyncOwnSessions, 1000)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_PARAM(asyncSharedSession, 1)
+BENCHMARK_PARAM(asyncSharedSession, 100)
+BENCHMARK_PARAM(asyncSharedSession, 1000)
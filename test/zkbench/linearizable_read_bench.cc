@@ -0,0 +1,37 @@
+#include <folly/Benchmark.h>
+#include <zookeeper/zookeeper.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+
+using namespace bolt;
+
+namespace {
+struct ReadBench {
+  ReadBench() : zk([](int, int, std::string, ZKClient *) {}, server.hosts()) {
+    zk.createSync("/read", folly::IOBuf::copyBuffer("x"), &ZOO_OPEN_ACL_UNSAFE,
+                  0);
+  }
+  InMemoryZooKeeper server;
+  ZKClient zk;
+};
+
+void readLatency(uint32_t iters, ZKConsistency consistency) {
+  folly::BenchmarkSuspender setup;
+  ReadBench b;
+  setup.dismiss();
+  for(auto i = 0u; i < iters; ++i) {
+    CHECK(b.zk.get("/read", false, consistency).get().ok());
+  }
+  setup.rehire();
+}
+}
+
+// One read at a time, so whatever the pipelined sync costs shows in full.
+// Against a real ensemble run it from a client attached to a follower.
+BENCHMARK(sequentialGet, iters) {
+  readLatency(iters, ZKConsistency::kSequential);
+}
+
+BENCHMARK_RELATIVE(linearizableGet, iters) {
+  readLatency(iters, ZKConsistency::kLinearizable);
+}
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <folly/Benchmark.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/zookeeper/ZKSemaphore.hpp"
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+
+using namespace bolt;
+
+namespace {
+const size_t kWorkers = 32;
+
+// kWorkers workers, each on its own session, acquire and release in a loop
+// until `iters` leases were handed out in total. Each stops after its own
+// last release, so nothing is in flight once run() returns.
+struct Contention {
+  Contention(size_t leases) : counts(kWorkers) {
+    for(auto i = 0u; i < kWorkers; ++i) {
+      auto zk = std::make_shared<ZKClient>(
+        [](int, int, std::string, ZKClient *) {}, server.hosts());
+      sems.push_back(ZKSemaphore::create(zk, "/bench", leases));
+    }
+  }
+
+  void work(size_t worker) {
+    sems[worker]
+      ->acquire(std::chrono::seconds(30))
+      .then([this, worker](std::unique_ptr<ZKSemaphore::Lease> &&lease) {
+        counts[worker]++;
+        return lease->release();
+      })
+      .then([this, worker] {
+        if(++acquired < target) {
+          work(worker);
+        } else if(++stopped == kWorkers) {
+          done.setValue();
+        }
+      });
+  }
+
+  void run(uint32_t iters) {
+    target = iters;
+    auto f = done.getFuture();
+    for(auto i = 0u; i < kWorkers; ++i) {
+      work(i);
+    }
+    std::move(f).get();
+  }
+
+  // Jain's index over leases per worker: 1 is perfectly fair, 1/kWorkers
+  // is one worker getting everything
+  double fairness() const {
+    double sum = 0, squares = 0;
+    for(auto c : counts) {
+      sum += c;
+      squares += double(c) * c;
+    }
+    return squares == 0 ? 1 : sum * sum / (kWorkers * squares);
+  }
+
+  uint64_t wakeups() const {
+    uint64_t n = 0;
+    for(auto &s : sems) {
+      n += s->wakeups();
+    }
+    return n;
+  }
+
+  InMemoryZooKeeper server;
+  std::vector<std::shared_ptr<ZKSemaphore>> sems;
+  std::vector<std::atomic<uint64_t>> counts;
+  std::atomic<uint64_t> acquired{0};
+  std::atomic<size_t> stopped{0};
+  uint64_t target{0};
+  Promise<Unit> done;
+};
+
+void contended(uint32_t iters, size_t leases) {
+  folly::BenchmarkSuspender setup;
+  Contention c(leases);
+  setup.dismiss();
+  c.run(iters);
+  setup.rehire();
+  LOG(INFO) << leases << " leases, " << kWorkers
+            << " workers: fairness: " << c.fairness()
+            << ", queue listings per lease: "
+            << double(c.wakeups()) / std::max<uint64_t>(c.acquired, 1);
+}
+}
+
+BENCHMARK_PARAM(contended, 1)
+BENCHMARK_PARAM(contended, 4)
+BENCHMARK_PARAM(contended, 20)
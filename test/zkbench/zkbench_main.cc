@@ -0,0 +1,12 @@
+#include <folly/Benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+// Benchmarks register themselves from the other files in this directory and
+// run against an InMemoryZooKeeper, so numbers do not depend on a JVM.
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  folly::runBenchmarks();
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <folly/Benchmark.h>
+#include <zookeeper/zookeeper.h>
+#include "bolt/zookeeper/ZKClient.hpp"
+#include "bolt/zookeeper/ZKValue.hpp"
+#include "bolt/testutils/InMemoryZooKeeper.hpp"
+
+using namespace bolt;
+
+namespace {
+// The node is rewritten in a loop for the whole run, so readers race with
+// a new version being published every few microseconds.
+struct UpdateBench {
+  UpdateBench()
+    : zk(std::make_shared<ZKClient>([](int, int, std::string, ZKClient *) {},
+                                    server.hosts())) {
+    zk->createSync("/value", ZKCodec<int64_t>::encode(0), &ZOO_OPEN_ACL_UNSAFE,
+                   0);
+    value = std::make_unique<ZKValue<int64_t>>(zk, "/value");
+    writer = std::thread([this] {
+      int64_t i = 0;
+      while(running) {
+        zk->setAsSync<int64_t>("/value", ++i);
+        std::lock_guard<std::mutex> lock(mutex);
+        locked = std::make_shared<const int64_t>(i);
+      }
+    });
+  }
+
+  ~UpdateBench() {
+    running = false;
+    writer.join();
+  }
+
+  InMemoryZooKeeper server;
+  std::shared_ptr<ZKClient> zk;
+  std::unique_ptr<ZKValue<int64_t>> value;
+  // what one would write by hand: a mutex around the current pointer
+  std::mutex mutex;
+  std::shared_ptr<const int64_t> locked{std::make_shared<const int64_t>(0)};
+  std::atomic<bool> running{true};
+  std::thread writer;
+};
+}
+
+BENCHMARK(mutexSharedPtrRead, iters) {
+  folly::BenchmarkSuspender setup;
+  UpdateBench b;
+  setup.dismiss();
+  int64_t sum = 0;
+  for(auto i = 0u; i < iters; ++i) {
+    std::shared_ptr<const int64_t> v;
+    {
+      std::lock_guard<std::mutex> lock(b.mutex);
+      v = b.locked;
+    }
+    sum += *v;
+  }
+  folly::doNotOptimizeAway(sum);
+  setup.rehire();
+}
+
+BENCHMARK_RELATIVE(zkValueRead, iters) {
+  folly::BenchmarkSuspender setup;
+  UpdateBench b;
+  setup.dismiss();
+  int64_t sum = 0;
+  for(auto i = 0u; i < iters; ++i) {
+    sum += *b.value->get();
+  }
+  folly::doNotOptimizeAway(sum);
+  setup.rehire();
+}
@@ -1,9 +1,30 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <set>
 #include <thread>
+#include <vector>
+#include <unistd.h>
 #include <zookeeper/zookeeper.h>
 #include "bolt/zookeeper/ZKClient.hpp"
 #include "bolt/testutils/ZooKeeperHarness.hpp"
+#include "bolt/testutils/InMemoryZooKeeperHarness.hpp"
+#include "bolt/zookeeper/ZKClientCoro.hpp"
+#include "bolt/zookeeper/ZKHedgedReader.hpp"
+#include "bolt/zookeeper/ZKPartitioner.hpp"
+#include "bolt/zookeeper/ZKRoutedClient.hpp"
+#include "bolt/zookeeper/ZKSemaphore.hpp"
+#include "bolt/zookeeper/ZKSnapshotCache.hpp"
+#include "bolt/zookeeper/ZKSubscription.hpp"
+#include "bolt/zookeeper/ZKTreeArchive.hpp"
+#include "bolt/zookeeper/ZKValue.hpp"
+#if FOLLY_HAS_COROUTINES
+#include <folly/executors/GlobalExecutor.h>
+#include <folly/experimental/coro/BlockingWait.h>
+#endif
 
 using namespace bolt;
 
@@ -44,6 +65,798 @@ TEST_F(ZooKeeperHarness, createNode) {
   EXPECT_TRUE(delResult.ok());
 }
 
+TEST_F(ZooKeeperHarness, TypedSetAndGet) {
+  struct Config {
+    int32_t shards;
+    double ratio;
+  };
+  zk->createSync("/typed", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL);
+  EXPECT_TRUE(zk->setAsSync("/typed", Config{16, 0.5}).ok());
+  auto result = zk->getAsSync<Config>("/typed");
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(16, result.value->shards);
+  EXPECT_EQ(0.5, result.value->ratio);
+
+  EXPECT_TRUE(zk->setAs("/typed", std::string("not a config")).get().ok());
+  EXPECT_FALSE(zk->getAs<Config>("/typed").get().ok());
+  auto str = zk->getAs<std::string>("/typed").get();
+  ASSERT_TRUE(str.ok());
+  EXPECT_EQ("not a config", *str.value);
+}
+
+TEST(ZKCodec, EncodeIntoPreallocatedBuffer) {
+  auto buf = folly::IOBuf::create(64);
+  ZKCodec<uint64_t>::encodeInto(42, *buf);
+  ZKCodec<std::string>::encodeInto("abc", *buf);
+  EXPECT_EQ(sizeof(uint64_t) + 3, buf->length());
+  buf->trimEnd(3);
+  uint64_t out = 0;
+  ASSERT_TRUE(ZKCodec<uint64_t>::decode(*buf, out));
+  EXPECT_EQ(42u, out);
+}
+
+TEST_F(InMemoryZooKeeperHarness, CreateSetGetDelete) {
+  auto result = zk->createSync("/foobar", folly::IOBuf::copyBuffer("thingo"),
+                               &ZOO_OPEN_ACL_UNSAFE, 0);
+  EXPECT_TRUE(result.ok());
+  EXPECT_TRUE(zk->setSync("/foobar", folly::IOBuf::copyBuffer("asdf")).ok());
+  auto node = zk->getSync("/foobar");
+  ASSERT_TRUE(node.ok());
+  EXPECT_EQ("asdf", std::string((char *)node.data(), node.buff->length()));
+  EXPECT_EQ(1, node.status->version);
+  EXPECT_TRUE(zk->delSync("/foobar").ok());
+  EXPECT_EQ(ZNONODE, zk->existsSync("/foobar").result);
+}
+
+TEST_F(InMemoryZooKeeperHarness, SessionExpiryRestoresEphemerals) {
+  std::promise<std::map<std::string, std::string>> recovered;
+  zk->addSessionRecoveredCb(
+    [&recovered](ZKClient *, const std::map<std::string, std::string> &m) {
+      recovered.set_value(m);
+    });
+  zk->createSync("/dir", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, 0);
+  zk->createSync("/dir/eph", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL);
+  auto seq = zk->createSync("/dir/seq_", std::make_unique<folly::IOBuf>(),
+                            &ZOO_OPEN_ACL_UNSAFE,
+                            ZOO_EPHEMERAL | ZOO_SEQUENCE);
+  const std::string seqPath((char *)seq.data(), seq.buff->length());
+  const auto oldSession = zk->getSessionId();
+
+  server->expireSession(oldSession);
+  auto done = recovered.get_future();
+  ASSERT_EQ(std::future_status::ready,
+            done.wait_for(std::chrono::seconds(5)));
+  auto renamed = done.get();
+  EXPECT_NE(oldSession, zk->getSessionId());
+  EXPECT_EQ("/dir/eph", renamed["/dir/eph"]);
+  EXPECT_NE(seqPath, renamed[seqPath]);
+  EXPECT_TRUE(server->exists("/dir/eph"));
+  EXPECT_TRUE(server->exists(renamed[seqPath]));
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, DroppedConnectionKeepsSession) {
+  const auto session = zk->getSessionId();
+  zk->createSync("/eph", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL);
+  proxy->dropConnections();
+  // the first calls may see the connection loss; the retry loop rides it out
+  EXPECT_TRUE(zk->existsSync("/eph").ok());
+  EXPECT_EQ(session, zk->getSessionId());
+  EXPECT_LT(0, proxy->lastRecoveryTime().count());
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, StallPastSessionTimeoutRecovers) {
+  std::promise<void> recovered;
+  zk->addSessionRecoveredCb(
+    [&recovered](ZKClient *, const std::map<std::string, std::string> &) {
+      recovered.set_value();
+    });
+  zk->createSync("/eph", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL);
+  const auto session = zk->getSessionId();
+  proxy->run({ZooKeeperFaultProxy::stall(std::chrono::milliseconds(0)),
+              ZooKeeperFaultProxy::heal(std::chrono::milliseconds(200))});
+  auto done = recovered.get_future();
+  ASSERT_EQ(std::future_status::ready,
+            done.wait_for(std::chrono::seconds(5)));
+  EXPECT_NE(session, zk->getSessionId());
+  EXPECT_TRUE(server->exists("/eph"));
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, ScriptedLatency) {
+  zk->createSync("/slow", folly::IOBuf::copyBuffer("x"), &ZOO_OPEN_ACL_UNSAFE,
+                 0);
+  proxy->setLatency(std::chrono::milliseconds(5));
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(zk->getSync("/slow").ok());
+  EXPECT_LE(std::chrono::milliseconds(10),
+            std::chrono::steady_clock::now() - start);
+  proxy->heal();
+  EXPECT_TRUE(zk->getSync("/slow").ok());
+}
+
+TEST_F(InMemoryZooKeeperHarness, LinearizableReads) {
+  auto writer = std::make_shared<ZKClient>(
+    [](int, int, std::string, ZKClient *) {}, server->hosts());
+  writer->createSync("/lin", folly::IOBuf::copyBuffer("v1"),
+                     &ZOO_OPEN_ACL_UNSAFE, 0);
+  auto synced = zk->sync("/lin").get();
+  EXPECT_TRUE(synced.ok());
+  auto r = zk->get("/lin", false, ZKConsistency::kLinearizable).get();
+  ASSERT_TRUE(r.ok());
+  EXPECT_EQ("v1", std::string((char *)r.data(), r.buff->length()));
+  EXPECT_EQ(ZNONODE,
+            zk->exists("/nope", false, ZKConsistency::kLinearizable)
+              .get()
+              .result);
+  auto kids = zk->children("/", false, ZKConsistency::kLinearizable).get();
+  EXPECT_TRUE(kids.ok());
+}
+
+TEST_F(InMemoryZooKeeperHarness, CompactResults) {
+  auto created = zk->createCompact("/compact", folly::IOBuf::copyBuffer("v1"),
+                                   &ZOO_OPEN_ACL_UNSAFE, 0)
+                   .get();
+  ASSERT_TRUE(created.ok());
+  EXPECT_EQ("/compact", created.path);
+  auto dup = zk->createCompact("/compact", std::make_unique<folly::IOBuf>(),
+                               &ZOO_OPEN_ACL_UNSAFE, 0)
+               .get();
+  EXPECT_EQ(ZNODEEXISTS, dup.result);
+  EXPECT_TRUE(dup.path.empty());
+  auto seq = zk->createCompact("/compact/s-", std::make_unique<folly::IOBuf>(),
+                               &ZOO_OPEN_ACL_UNSAFE, ZOO_SEQUENCE)
+               .get();
+  ASSERT_TRUE(seq.ok());
+  EXPECT_NE("/compact/s-", seq.path);
+
+  auto r = zk->getCompact("/compact").get();
+  ASSERT_TRUE(r.ok());
+  EXPECT_EQ("v1", std::string((const char *)r.data(), r.length()));
+  EXPECT_EQ(1, r.stat.numChildren);
+  auto missing = zk->getCompact("/nope").get();
+  EXPECT_EQ(ZNONODE, missing.result);
+  EXPECT_EQ(nullptr, missing.buff);
+
+  auto st = zk->existsCompact("/compact").get();
+  ASSERT_TRUE(st.ok());
+  EXPECT_EQ(r.stat.mzxid, st.stat.mzxid);
+  EXPECT_EQ(ZNONODE, zk->existsCompact("/nope").get().result);
+
+  auto kids = zk->childrenCompact("/compact").get();
+  ASSERT_TRUE(kids.ok());
+  ASSERT_EQ(1u, kids.children.size());
+  EXPECT_EQ(seq.path, "/compact/" + kids.children[0]);
+
+  // a failed createSync carries no path
+  auto failed = zk->createSync("/compact", std::make_unique<folly::IOBuf>(),
+                               &ZOO_OPEN_ACL_UNSAFE, 0);
+  EXPECT_EQ(ZNODEEXISTS, failed.result);
+  EXPECT_EQ(nullptr, failed.buff);
+}
+
+TEST_F(InMemoryZooKeeperHarness, MultiIsAllOrNothing) {
+  std::vector<ZKOp> ops;
+  ops.push_back(ZKOp::create("/m", folly::IOBuf::copyBuffer("a"),
+                             &ZOO_OPEN_ACL_UNSAFE, 0));
+  ops.push_back(ZKOp::check("/missing", -1));
+  auto failed = zk->multi(std::move(ops)).get();
+  EXPECT_EQ(ZNONODE, failed.result);
+  EXPECT_EQ(ZNONODE, zk->existsSync("/m").result);
+
+  ops.clear();
+  ops.push_back(ZKOp::create("/m", folly::IOBuf::copyBuffer("a"),
+                             &ZOO_OPEN_ACL_UNSAFE, 0));
+  ops.push_back(ZKOp::set("/m", folly::IOBuf::copyBuffer("b")));
+  auto applied = zk->multi(std::move(ops)).get();
+  ASSERT_TRUE(applied.ok());
+  ASSERT_EQ(2u, applied.results.size());
+  EXPECT_EQ("/m", std::string((char *)applied.results[0].data(),
+                              applied.results[0].buff->length()));
+  EXPECT_EQ(1, applied.results[1].status->version);
+}
+
+TEST_F(InMemoryZooKeeperHarness, WalkAndDeleteRecursive) {
+  auto empty = [] { return std::make_unique<folly::IOBuf>(); };
+  zk->createSync("/tenant", empty(), &ZOO_OPEN_ACL_UNSAFE, 0);
+  size_t nodes = 1;
+  for(auto i = 0; i < 10; ++i) {
+    auto dir = "/tenant/d" + std::to_string(i);
+    zk->createSync(dir, empty(), &ZOO_OPEN_ACL_UNSAFE, 0);
+    ++nodes;
+    for(auto j = 0; j < 20; ++j) {
+      zk->createSync(dir + "/n" + std::to_string(j), empty(),
+                     &ZOO_OPEN_ACL_UNSAFE, 0);
+      ++nodes;
+    }
+  }
+
+  std::set<std::string> seen;
+  auto walked = zk->walk("/tenant",
+                         [&](const std::string &path, const ZKResult &r) {
+                           auto parent = path.substr(0, path.rfind('/'));
+                           // parents first
+                           EXPECT_TRUE(path == "/tenant" || seen.count(parent));
+                           EXPECT_EQ(r.strings.size(),
+                                     (size_t)r.status->numChildren);
+                           seen.insert(path);
+                         },
+                         4)
+                  .get();
+  EXPECT_EQ(ZOK, walked.result);
+  EXPECT_EQ(nodes, seen.size());
+
+  EXPECT_EQ(ZOK, zk->deleteRecursive("/tenant", 4, 7).get().result);
+  EXPECT_EQ(ZNONODE, zk->existsSync("/tenant").result);
+  EXPECT_EQ(ZNONODE, zk->deleteRecursive("/tenant").get().result);
+}
+
+TEST_F(InMemoryZooKeeperHarness, TreeArchiveRoundTrip) {
+  zk->createSync("/src", folly::IOBuf::copyBuffer("root"),
+                 &ZOO_OPEN_ACL_UNSAFE, 0);
+  for(auto i = 0; i < 30; ++i) {
+    auto dir = "/src/" + std::to_string(i);
+    zk->createSync(dir, folly::IOBuf::copyBuffer(dir), &ZOO_OPEN_ACL_UNSAFE,
+                   0);
+    zk->createSync(dir + "/leaf", std::make_unique<folly::IOBuf>(),
+                   &ZOO_OPEN_ACL_UNSAFE, 0);
+  }
+  zk->createSync("/src/owner", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL);
+
+  auto file = "/tmp/zkclient_test_tree." + std::to_string(::getpid());
+  auto exported = ZKTreeArchive::exportTree(*zk, "/src", file, 4);
+  ASSERT_EQ(ZOK, exported.result);
+  EXPECT_EQ(62u, exported.nodes);
+  EXPECT_EQ(1u, exported.ephemerals);
+
+  ZKImportOptions opts;
+  opts.batchSize = 7;
+  opts.maxInFlight = 3;
+  opts.progressFile = file + ".progress";
+  auto imported = ZKTreeArchive::importTree(*zk, file, "/dst", opts);
+  ASSERT_EQ(ZOK, imported.result);
+  EXPECT_EQ(61u, imported.nodes);
+  EXPECT_EQ(1u, imported.ephemerals);
+  EXPECT_EQ(0u, imported.replayed);
+  EXPECT_EQ("/src/7", std::string((char *)zk->getSync("/dst/7").data(), 6));
+  EXPECT_EQ(ZOK, zk->existsSync("/dst/29/leaf").result);
+  EXPECT_EQ(ZNONODE, zk->existsSync("/dst/owner").result);
+
+  // an import that died half way: what exists is left alone
+  zk->deleteRecursive("/dst/20").get();
+  opts.progressFile.clear();
+  auto again = ZKTreeArchive::importTree(*zk, file, "/dst", opts);
+  ASSERT_EQ(ZOK, again.result);
+  EXPECT_LT(0u, again.replayed);
+  EXPECT_EQ(ZOK, zk->existsSync("/dst/20/leaf").result);
+
+  ::unlink(file.c_str());
+  ::unlink((file + ".progress").c_str());
+}
+
+TEST_F(InMemoryZooKeeperHarness, PartitionerMovesFewShards) {
+  std::vector<std::string> shards;
+  for(auto i = 0; i < 64; ++i) {
+    shards.push_back("s" + std::to_string(i));
+  }
+  std::mutex lock;
+  std::map<std::string, std::string> owners;
+  std::map<std::string, int> handoffs;
+  auto join = [&](const std::string &member) {
+    return ZKPartitioner::create(
+             zk, "/workers", member, shards,
+             [&, member](const std::string &shard) {
+               std::lock_guard<std::mutex> l(lock);
+               // never two owners at once
+               EXPECT_EQ(0u, owners.count(shard));
+               owners[shard] = member;
+             },
+             [&, member](const std::string &shard) {
+               std::lock_guard<std::mutex> l(lock);
+               EXPECT_EQ(member, owners[shard]);
+               owners.erase(shard);
+               handoffs[member]++;
+               return makeFuture();
+             })
+      .get(std::chrono::seconds(5));
+  };
+  auto settled = [&](std::vector<std::shared_ptr<ZKPartitioner>> group) {
+    for(auto tries = 0; tries < 500; ++tries) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      std::lock_guard<std::mutex> l(lock);
+      auto expected = group.front()->assignment();
+      if(owners == expected
+         && group.front()->members().size() == group.size()) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto a = join("a");
+  auto b = join("b");
+  ASSERT_TRUE(settled({a, b}));
+  auto before = owners;
+
+  auto c = join("c");
+  ASSERT_TRUE(settled({a, b, c}));
+  size_t moved = 0;
+  for(auto &o : owners) {
+    if(o.second == "c") {
+      moved++;
+    } else {
+      // nothing moves between the old members
+      EXPECT_EQ(before[o.first], o.second);
+    }
+  }
+  EXPECT_LT(0u, moved);
+  EXPECT_EQ(moved, size_t(handoffs["a"] + handoffs["b"]));
+  EXPECT_EQ(c->owned().size(), moved);
+
+  c->leave().get(std::chrono::seconds(5));
+  ASSERT_TRUE(settled({a, b}));
+  EXPECT_EQ(before, owners);
+  // a, the lowest member, publishes the map
+  std::string published;
+  std::string expected;
+  for(auto &shard : shards) {
+    expected += shard + " " + before[shard] + "\n";
+  }
+  for(auto tries = 0; tries < 500 && published != expected; ++tries) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto r = zk->getSync("/workers/assignment");
+    published = r.ok() ? std::string((char *)r.data(), r.buff->length()) : "";
+  }
+  EXPECT_EQ(expected, published);
+
+  // no callbacks into this frame once everyone left
+  a->leave().get(std::chrono::seconds(5));
+  b->leave().get(std::chrono::seconds(5));
+}
+
+TEST_F(InMemoryZooKeeperHarness, SemaphoreLeases) {
+  auto sem = ZKSemaphore::create(zk, "/compactions", 2);
+  auto first = sem->acquire(std::chrono::seconds(5)).get();
+  auto second = sem->acquire(std::chrono::seconds(5)).get();
+  EXPECT_TRUE(first->valid());
+  EXPECT_NE(first->path(), second->path());
+
+  EXPECT_THROW(sem->acquire(std::chrono::milliseconds(50)).get(),
+               folly::FutureTimeout);
+  // the timed out waiter left the queue
+  EXPECT_EQ(2u, zk->childrenSync("/compactions").strings.size());
+
+  // waiters get in in queue order: both creates go out on one session, so
+  // third is queued ahead of fourth
+  auto third = sem->acquire(std::chrono::seconds(5));
+  auto fourth = sem->acquire(std::chrono::seconds(5));
+  EXPECT_FALSE(third.isReady());
+  first.reset();
+  auto lease = std::move(third).get(std::chrono::seconds(5));
+  EXPECT_TRUE(lease->valid());
+  EXPECT_FALSE(fourth.isReady());
+  second->release().get();
+  EXPECT_TRUE(std::move(fourth).get(std::chrono::seconds(5))->valid());
+}
+
+TEST_F(InMemoryZooKeeperHarness, SemaphoreLeaseLostWithSession) {
+  auto sem = ZKSemaphore::create(zk, "/lease", 1);
+  auto held = sem->acquire(std::chrono::seconds(5)).get();
+  auto waiting = sem->acquire(std::chrono::seconds(5));
+
+  auto session = zk->getSessionId();
+  server->expireSession(session);
+  EXPECT_THROW(std::move(waiting).get(std::chrono::seconds(5)),
+               std::runtime_error);
+  EXPECT_FALSE(held->valid());
+  while(zk->getSessionId() == session || !zk->ready) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  // the old nodes are not restored, the lease is free again
+  EXPECT_TRUE(sem->acquire(std::chrono::seconds(5)).get()->valid());
+}
+
+TEST_F(InMemoryZooKeeperHarness, SnapshotCacheWarmRestart) {
+  auto file = "/tmp/zkclient_test_snapshot." + std::to_string(::getpid());
+  auto put = [this](std::string path, std::string val) {
+    zk->createSync(path, folly::IOBuf::copyBuffer(val), &ZOO_OPEN_ACL_UNSAFE,
+                   0);
+  };
+  put("/cfg", "");
+  put("/cfg/a", "a1");
+  put("/cfg/b", "b1");
+  put("/cfg/b/deep", "d1");
+  {
+    auto cache = ZKSnapshotCache::create(zk, "/cfg", file);
+    EXPECT_EQ(0u, cache->load());
+    cache->reconcile().get();
+    EXPECT_EQ(4u, cache->size());
+    ASSERT_TRUE(cache->persist());
+  }
+
+  zk->setSync("/cfg/a", folly::IOBuf::copyBuffer("a2"));
+  zk->delSync("/cfg/b/deep");
+  zk->delSync("/cfg/b");
+  put("/cfg/c", "c1");
+
+  auto cache = ZKSnapshotCache::create(zk, "/cfg", file);
+  EXPECT_EQ(4u, cache->load());
+  EXPECT_EQ("a1", cache->get("/cfg/a")->data);
+  EXPECT_EQ("d1", cache->get("/cfg/b/deep")->data);
+
+  cache->reconcile().get();
+  EXPECT_EQ("a2", cache->get("/cfg/a")->data);
+  EXPECT_EQ(1, cache->get("/cfg/a")->version);
+  EXPECT_FALSE(cache->get("/cfg/b"));
+  EXPECT_FALSE(cache->get("/cfg/b/deep"));
+  EXPECT_EQ("c1", cache->get("/cfg/c")->data);
+  auto stats = cache->reconcileStats();
+  EXPECT_EQ(4u, stats.checked);
+  EXPECT_EQ(1u, stats.refetched);
+  EXPECT_EQ(1u, stats.added);
+  EXPECT_EQ(2u, stats.removed);
+  EXPECT_EQ(0u, stats.failures);
+  ::unlink(file.c_str());
+}
+
+TEST_F(InMemoryZooKeeperHarness, SubscriptionSkipsToLatest) {
+  zk->createSync("/sub", folly::IOBuf::copyBuffer("0"), &ZOO_OPEN_ACL_UNSAFE,
+                 0);
+  auto sub = ZKSubscription::data(zk, "/sub");
+  auto first = sub->next().get(std::chrono::seconds(5));
+  ASSERT_TRUE(first.ok());
+  EXPECT_EQ("0", std::string((char *)first.data(), first.buff->length()));
+
+  // the consumer is busy while the node churns
+  for(auto i = 1; i <= 50; ++i) {
+    zk->setSync("/sub", folly::IOBuf::copyBuffer(std::to_string(i)));
+  }
+  auto mzxid = first.status->mzxid;
+  std::string value;
+  while(value != "50") {
+    auto r = sub->next().get(std::chrono::seconds(5));
+    ASSERT_TRUE(r.ok());
+    EXPECT_LT(mzxid, r.status->mzxid);
+    mzxid = r.status->mzxid;
+    value = std::string((char *)r.data(), r.buff->length());
+  }
+  // never more than one read per event
+  EXPECT_LE(sub->reads(), sub->events() + 1);
+
+  zk->delSync("/sub");
+  EXPECT_EQ(ZNONODE, sub->next().get(std::chrono::seconds(5)).result);
+  zk->createSync("/sub", folly::IOBuf::copyBuffer("back"),
+                 &ZOO_OPEN_ACL_UNSAFE, 0);
+  auto back = sub->next().get(std::chrono::seconds(5));
+  ASSERT_TRUE(back.ok());
+  EXPECT_EQ("back", std::string((char *)back.data(), back.buff->length()));
+
+  sub->cancel();
+  EXPECT_EQ(ZCLOSING, sub->next().get().result);
+}
+
+TEST_F(InMemoryZooKeeperHarness, LiveTypedValue) {
+  zk->createSync("/limit", ZKCodec<int64_t>::encode(10), &ZOO_OPEN_ACL_UNSAFE,
+                 0);
+  ZKValue<int64_t> limit(zk, "/limit", -1);
+  std::atomic<int64_t> seen{-1};
+  std::atomic<int> changes{0};
+  limit.addOnChange([&](const int64_t &val, int32_t) {
+    seen = val;
+    changes++;
+  });
+  auto waitFor = [&](int64_t val) {
+    while(seen != val) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  };
+  waitFor(10);
+  EXPECT_EQ(10, *limit.get());
+
+  zk->setAsSync<int64_t>("/limit", 20);
+  waitFor(20);
+  auto snap = limit.get();
+  EXPECT_EQ(20, *snap);
+  EXPECT_EQ(1, snap.version());
+
+  // undecodable, then deleted: both keep the last good value
+  zk->setSync("/limit", folly::IOBuf::copyBuffer("x"));
+  zk->delSync("/limit");
+  zk->createSync("/limit", ZKCodec<int64_t>::encode(30), &ZOO_OPEN_ACL_UNSAFE,
+                 0);
+  waitFor(30);
+  EXPECT_EQ(30, limit.copy());
+  EXPECT_EQ(3, changes.load());
+}
+
+TEST_F(InMemoryZooKeeperHarness, LiveTypedValueDestroyedFromCallback) {
+  zk->createSync("/once", ZKCodec<int64_t>::encode(1), &ZOO_OPEN_ACL_UNSAFE,
+                 0);
+  auto value = std::make_unique<ZKValue<int64_t>>(zk, "/once", -1);
+  std::promise<int64_t> destroyed;
+  auto f = destroyed.get_future();
+  value->addOnChange([&](const int64_t &val, int32_t) {
+    value.reset();
+    destroyed.setValue(val);
+  });
+  ASSERT_EQ(std::future_status::ready, f.wait_for(std::chrono::seconds(5)));
+  EXPECT_EQ(1, f.get());
+  EXPECT_FALSE(value);
+}
+
+TEST_F(InMemoryZooKeeperHarness, ChildrenSubscriptionAfterExpiry) {
+  zk->createSync("/kids", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, 0);
+  auto sub = ZKSubscription::children(zk, "/kids");
+  EXPECT_TRUE(sub->next().get(std::chrono::seconds(5)).strings.empty());
+
+  auto session = zk->getSessionId();
+  server->expireSession(session);
+  while(zk->getSessionId() == session || !zk->ready) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  zk->createSync("/kids/a", std::make_unique<folly::IOBuf>(),
+                 &ZOO_OPEN_ACL_UNSAFE, 0);
+  std::vector<std::string> kids;
+  while(kids.empty()) {
+    auto r = sub->next().get(std::chrono::seconds(5));
+    ASSERT_TRUE(r.ok());
+    kids = r.strings;
+  }
+  EXPECT_EQ(std::vector<std::string>{"a"}, kids);
+}
+
+TEST_F(InMemoryZooKeeperHarness, DebouncedWatchEvents) {
+  std::atomic<int> hot{0};
+  std::atomic<int> cold{0};
+  auto cli = std::make_shared<ZKClient>(
+    [&](int type, int, std::string path, ZKClient *) {
+      if(type == ZOO_CHANGED_EVENT) {
+        (path == "/hot" ? hot : cold)++;
+      }
+    },
+    server->hosts());
+  cli->setWatchDebounce("/hot", ZKDebounce{std::chrono::seconds(1)});
+  for(auto &path : {"/hot", "/cold"}) {
+    cli->createSync(path, folly::IOBuf::copyBuffer("0"), &ZOO_OPEN_ACL_UNSAFE,
+                    0);
+  }
+
+  for(auto i = 0; i < 20; ++i) {
+    for(auto &path : {"/hot", "/cold"}) {
+      cli->existsSync(path, true);
+      cli->setSync(path, folly::IOBuf::copyBuffer(std::to_string(i)));
+    }
+  }
+  // the first right away, the rest folded into one a second later - or a
+  // few, if setting took longer than the window on a busy host
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while(cold.load() < 20 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(20, cold.load());
+  auto stats = cli->watchDebounceStats();
+  while(stats["/hot"].delivered + stats["/hot"].suppressed < 20
+        && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    stats = cli->watchDebounceStats();
+  }
+  ASSERT_EQ(20u, stats["/hot"].delivered + stats["/hot"].suppressed);
+  EXPECT_LE(2u, stats["/hot"].delivered);
+  EXPECT_GT(20u, stats["/hot"].delivered);
+  // the last one may still be pending
+  while(uint64_t(hot.load()) < stats["/hot"].delivered
+        && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(stats["/hot"].delivered, uint64_t(hot.load()));
+}
+
+TEST(ZKWatchDebouncerTest, FoldsEventsOnInjectedClock) {
+  std::atomic<int64_t> nowMs{0};
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<std::string> dispatched;
+  ZKWatchDebouncer debouncer(
+    [&](int, int, const std::string &path) {
+      std::lock_guard<std::mutex> g(lock);
+      dispatched.push_back(path);
+      cv.notify_all();
+    },
+    [&nowMs] {
+      return ZKWatchDebouncer::Clock::time_point(
+        std::chrono::milliseconds(nowMs.load()));
+    });
+  debouncer.setRule("/hot", ZKDebounce{std::chrono::seconds(1)});
+
+  EXPECT_FALSE(debouncer.offer(ZOO_CHANGED_EVENT, 0, "/hot/a"));
+  for(auto i = 0; i < 19; ++i) {
+    EXPECT_TRUE(debouncer.offer(ZOO_CHANGED_EVENT, 0, "/hot/a"));
+  }
+  EXPECT_FALSE(debouncer.offer(ZOO_CHANGED_EVENT, 0, "/cold"));
+  auto stats = debouncer.stats();
+  EXPECT_EQ(1u, stats["/hot"].delivered);
+  EXPECT_EQ(18u, stats["/hot"].suppressed);
+
+  nowMs = 1000;
+  debouncer.poke();
+  {
+    std::unique_lock<std::mutex> g(lock);
+    ASSERT_TRUE(cv.wait_for(g, std::chrono::seconds(5),
+                            [&] { return !dispatched.empty(); }));
+    EXPECT_EQ(std::vector<std::string>{"/hot/a"}, dispatched);
+  }
+  stats = debouncer.stats();
+  EXPECT_EQ(2u, stats["/hot"].delivered);
+  EXPECT_EQ(18u, stats["/hot"].suppressed);
+  // the window starts over from the folded event
+  EXPECT_TRUE(debouncer.offer(ZOO_CHANGED_EVENT, 0, "/hot/a"));
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, SessionHealth) {
+  zk->startHealthProbes(std::chrono::milliseconds(5));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  auto before = zk->health();
+  EXPECT_EQ(ZOO_CONNECTED_STATE, before.state);
+  EXPECT_EQ(proxy->hosts(), before.server);
+  EXPECT_LT(0u, before.probes);
+  EXPECT_EQ(0u, before.probeFailures);
+  EXPECT_LE(before.rttP50, before.rttMax);
+  EXPECT_EQ(0u, before.reconnects);
+
+  proxy->dropConnections();
+  EXPECT_TRUE(zk->getSync("/").ok());
+  proxy->expireSessions();
+  auto session = zk->getSessionId();
+  // probes keep running meanwhile, recovery must still get woken up
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while((zk->getSessionId() == session || !zk->ready)
+        && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  ASSERT_NE(session, zk->getSessionId()) << "expired session not recovered";
+  ASSERT_TRUE(zk->ready);
+  auto after = zk->health();
+  EXPECT_EQ(ZOO_CONNECTED_STATE, after.state);
+  EXPECT_LE(2u, after.reconnects);
+  EXPECT_EQ(1u, after.expirations);
+  EXPECT_LT(before.timeInState[ZOO_CONNECTED_STATE],
+            after.timeInState[ZOO_CONNECTED_STATE]);
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, HedgedReads) {
+  zk->createSync("/hedged", folly::IOBuf::copyBuffer("x"),
+                 &ZOO_OPEN_ACL_UNSAFE, 0);
+  // straight to the server, around the proxy
+  auto direct = std::make_shared<ZKClient>(
+    [](int, int, std::string, ZKClient *) {}, server->hosts());
+  ZKHedgeOptions opts;
+  opts.initialDelay = std::chrono::milliseconds(20);
+  opts.window = 1000000;
+  auto reader = ZKHedgedReader::create(zk, direct, opts);
+
+  proxy->setLatency(std::chrono::milliseconds(500));
+  auto r = reader->get("/hedged").get();
+  // answered by the hedge, not the slow primary
+  EXPECT_EQ(1u, reader->stats().hedged);
+  EXPECT_EQ(1u, reader->stats().hedgeWins);
+  EXPECT_EQ(ZOK, r.result);
+  EXPECT_EQ("x", std::string((char *)r.data(), r.buff->length()));
+  EXPECT_EQ(ZNONODE, reader->exists("/nope").get().result);
+  auto stats = reader->stats();
+  EXPECT_EQ(2u, stats.reads);
+  EXPECT_EQ(2u, stats.hedged);
+  EXPECT_EQ(2u, stats.hedgeWins);
+  EXPECT_EQ(1.0, stats.hedgeRate());
+
+  proxy->heal();
+  EXPECT_TRUE(zk->getSync("/hedged").ok());
+  EXPECT_EQ(ZOK, reader->children("/").get().result);
+  EXPECT_EQ(3u, reader->stats().reads);
+  EXPECT_EQ(2u, reader->stats().hedgeWins);
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, HedgedReadsSyncSecondary) {
+  auto direct = std::make_shared<ZKClient>(
+    [](int, int, std::string, ZKClient *) {}, server->hosts());
+  ZKHedgeOptions opts;
+  opts.initialDelay = std::chrono::milliseconds(20);
+  opts.window = 1000000;
+  opts.syncSecondary = true;
+  auto reader = ZKHedgedReader::create(zk, direct, opts);
+
+  // written on the primary, read back through the hedge
+  zk->createSync("/mine", folly::IOBuf::copyBuffer("v1"),
+                 &ZOO_OPEN_ACL_UNSAFE, 0);
+  proxy->setLatency(std::chrono::milliseconds(500));
+  auto r = reader->get("/mine").get();
+  ASSERT_EQ(ZOK, r.result);
+  EXPECT_EQ("v1", std::string((char *)r.data(), r.buff->length()));
+  EXPECT_EQ(1u, reader->stats().hedged);
+  EXPECT_EQ(1u, reader->stats().hedgeWins);
+}
+
+TEST_F(InMemoryZooKeeperFaultHarness, RoutedReadsAndWrites) {
+  // reads through the proxy, as if to a remote observer; writes direct
+  auto writes = std::make_shared<ZKClient>(
+    [](int, int, std::string, ZKClient *) {}, server->hosts());
+  ZKRoutedClient routed(zk, writes);
+  routed.connected().get();
+
+  EXPECT_EQ(ZOK, routed
+                   .create("/routed", folly::IOBuf::copyBuffer("v1"),
+                           &ZOO_OPEN_ACL_UNSAFE, 0)
+                   .get()
+                   .result);
+  // around the proxy, on the write session
+  EXPECT_EQ(0u, proxy->requests(ZOO_CREATE_OP));
+
+  // our write is seen right away, through a sync
+  auto r = routed.get("/routed").get();
+  EXPECT_EQ(ZOK, r.result);
+  EXPECT_EQ("v1", std::string((char *)r.data(), r.buff->length()));
+  EXPECT_EQ(1u, routed.syncedReads());
+  EXPECT_EQ(ZOK, routed.exists("/routed").get().result);
+  EXPECT_EQ(1u, routed.syncedReads());
+
+  EXPECT_EQ(ZOK, routed.setAs<std::string>("/routed", "v2").get().result);
+  EXPECT_EQ("v2", *routed.getAs<std::string>("/routed").get().value);
+  EXPECT_EQ(2u, routed.syncedReads());
+  EXPECT_EQ(0u, proxy->requests(ZOO_SETDATA_OP));
+  // the syncs and reads did go through the proxy
+  const int32_t kSyncOp = 9; // not in zookeeper.h
+  EXPECT_EQ(2u, proxy->requests(kSyncOp));
+}
+
+#if FOLLY_HAS_COROUTINES
+TEST_F(InMemoryZooKeeperHarness, CoroutineCheckReadWrite) {
+  auto flow = [](ZKClient &zk) -> folly::coro::Task<std::string> {
+    EXPECT_EQ(ZOK, co_await coro::touchPath(zk, "/coro/nested"));
+    auto stat = co_await coro::exists(zk, "/coro/nested/value");
+    if(stat.result == ZNONODE) {
+      co_await coro::create(zk, "/coro/nested/value",
+                            folly::IOBuf::copyBuffer("v1"),
+                            &ZOO_OPEN_ACL_UNSAFE, 0);
+    }
+    auto cur = co_await coro::get(zk, "/coro/nested/value");
+    auto set = co_await coro::set(zk, "/coro/nested/value",
+                                  folly::IOBuf::copyBuffer("v2"),
+                                  cur.status->version);
+    EXPECT_TRUE(set.ok());
+    auto kids = co_await coro::children(zk, "/coro/nested");
+    EXPECT_EQ(1u, kids.strings.size());
+    auto next = co_await coro::get(zk, "/coro/nested/value");
+    co_return std::string((char *)next.data(), next.buff->length());
+  };
+  EXPECT_EQ("v2", folly::coro::blockingWait(flow(*zk)));
+
+  auto node = folly::coro::blockingWait(
+    coro::registerCandidate(*zk, "/coro/election", "me"));
+  EXPECT_TRUE(folly::coro::blockingWait(
+    coro::isLowestCandidate(*zk, "/coro/election", node)));
+
+  auto other = std::make_shared<ZKClient>(
+    [](int, int, std::string, ZKClient *) {}, server->hosts());
+  auto next = folly::coro::blockingWait(
+    coro::registerCandidate(*other, "/coro/election", "next"));
+  EXPECT_FALSE(folly::coro::blockingWait(
+    coro::isLowestCandidate(*other, "/coro/election", next)));
+  auto elected = coro::awaitLeadership(*other, "/coro/election", next)
+                   .scheduleOn(folly::getCPUExecutor().get())
+                   .start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(elected.isReady());
+  ASSERT_TRUE(zk->delSync(node).ok());
+  std::move(elected).get(std::chrono::seconds(5));
+  EXPECT_TRUE(folly::coro::blockingWait(
+    coro::isLowestCandidate(*other, "/coro/election", next)));
+}
+#endif
+
 int main(int argc, char **argv) {
   ::testing::FLAGS_gtest_death_test_style = "threadsafe";
   google::InstallFailureSignalHandler();